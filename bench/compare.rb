@@ -0,0 +1,28 @@
+# Compares two results of bench/decode.rb case by case.  A case whose
+# file has a different digest in the two results is marked with "!", as
+# its numbers measure different bytes.
+#
+#   ruby bench/compare.rb BASE.json CURRENT.json
+
+require 'json'
+
+KEYS = %w[group file pixel_format scale source]
+
+def load_results(path)
+  JSON.parse(File.read(path))['results'].each_with_object({}) do |r, h|
+    h[r.values_at(*KEYS)] = r
+  end
+end
+
+abort "usage: #{$0} BASE.json CURRENT.json" unless ARGV.size == 2
+base, current = ARGV.map {|path| load_results(path) }
+
+printf("%-13s %-50s %-9s %-6s %-14s %10s %10s %8s\n",
+       'group', 'file', 'format', 'scale', 'source', 'base', 'current', 'ratio')
+current.each do |key, r|
+  b = base[key] or next
+  changed = b['sha256'] && r['sha256'] && b['sha256'] != r['sha256']
+  printf("%-13s %-50s %-9s %-6s %-14s %10.1f %10.1f %7.2fx%s\n",
+         *key, b['images_per_sec'], r['images_per_sec'],
+         r['images_per_sec'] / b['images_per_sec'], changed ? ' !' : '')
+end
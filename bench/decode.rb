@@ -0,0 +1,210 @@
+# Decode benchmark of ImageFile::JpegReader.
+#
+#   rake bench
+#   rake bench OUTPUT=tmp/bench/before.json BENCH_TIME=2
+#   rake bench:compare BASE=tmp/bench/before.json CURRENT=tmp/bench/after.json
+#
+# Every case varies one parameter from the default case: a 1024x768
+# baseline RGB file read from a path into RGB24 at scale 1.  The pixel
+# formats and the scales are also measured with the CMYK file of
+# spec/support, since CMYK takes its own conversion path.  Synthetic
+# fixtures are generated once in tmp/bench/fixtures from a seeded random
+# number generator, and encoded by ImageFile::JpegWriter; the encoder is
+# part of their names.  The JPEG files in spec/support are measured too.
+#
+# The results are printed as a table and written as JSON to OUTPUT
+# (defaults to tmp/bench/decode-<time>.json), with the SHA-256 digest of
+# every file so that bench/compare.rb can tell changed fixtures.
+
+require 'image_file'
+require 'image_file/version'
+require 'json'
+require 'digest'
+require 'stringio'
+require 'fileutils'
+require 'time'
+
+module ImageFileBench
+  ROOT_DIR = File.expand_path('..', File.dirname(__FILE__))
+  FIXTURE_DIR = File.join(ROOT_DIR, 'tmp', 'bench', 'fixtures')
+  SPEC_SUPPORT_DIR = File.join(ROOT_DIR, 'spec', 'support')
+  CMYK_FIXTURE = File.join(SPEC_SUPPORT_DIR, 'recompile_cat_CMYK.jpg')
+  ENCODER = 'jpeg_writer-q85'
+
+  SIZES = [[256, 256], [1024, 768], [2048, 1536]]
+  DEFAULT_SIZE = [1024, 768]
+  PIXEL_FORMATS = [:RGB24, :ARGB32, :RGB16_565]
+  SCALES = (1..8).map {|n| Rational(n, 8) }
+  SOURCES = [:path, :string, :string_io, :custom_io]
+  SEED = 20101217
+
+  # An IO-like object that has only #read, like a socket wrapper.
+  class ChunkedReader
+    def initialize(data)
+      @data = data
+      @pos = 0
+    end
+
+    def read(length)
+      return nil if @pos >= @data.bytesize
+      chunk = @data.byteslice(@pos, length)
+      @pos += chunk.bytesize
+      chunk
+    end
+  end
+
+  module_function
+
+  def clock
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # Smooth gradients with a little noise, so that the files compress like
+  # photographs rather than flat color.
+  def synthetic_image(width, height)
+    random = Random.new(SEED ^ (width << 16) ^ height)
+    data = ''.b
+    height.times do |y|
+      noise = random.bytes(width * 3).unpack('C*')
+      row = Array.new(width)
+      width.times do |x|
+        i = x * 3
+        r = ((x * 255 / width) + (noise[i] & 0x1F) - 16).clamp(0, 255)
+        g = ((y * 255 / height) + (noise[i + 1] & 0x1F) - 16).clamp(0, 255)
+        b = (((x ^ y) & 0xFF) + (noise[i + 2] & 0x0F) - 8).clamp(0, 255)
+        row[x] = (r << 16) | (g << 8) | b
+      end
+      data << row.pack('L*')
+    end
+    ImageFile::Image.new(pixel_format: :RGB24, width: width, height: height, row_stride: width, data: data, copy: false)
+  end
+
+  def synthetic_fixture(width, height, progressive)
+    name = "synthetic-#{width}x#{height}#{progressive ? '-progressive' : ''}-#{ENCODER}.jpg"
+    path = File.join(FIXTURE_DIR, name)
+    return path if File.exist?(path)
+
+    FileUtils.mkdir_p(FIXTURE_DIR)
+    ImageFile::JpegWriter.open(path).write_image(synthetic_image(width, height),
+                                                 quality: 85, progressive: progressive)
+    path
+  end
+
+  def open_reader(path, source, data)
+    case source
+    when :path
+      ImageFile::JpegReader.open(path)
+    when :string
+      ImageFile::JpegReader.from_string(data)
+    when :string_io
+      ImageFile::JpegReader.new(StringIO.new(data))
+    when :custom_io
+      ImageFile::JpegReader.new(ChunkedReader.new(data))
+    else
+      raise ArgumentError, "unknown source #{source}"
+    end
+  end
+
+  # Runs the block repeatedly for at least +min_time+ seconds after a
+  # warm-up run, and returns the number of runs and the elapsed time.
+  def measure(min_time)
+    yield
+    count = 0
+    start = clock
+    begin
+      yield
+      count += 1
+      elapsed = clock - start
+    end while elapsed < min_time
+    [count, elapsed]
+  end
+
+  def run_case(group, path, min_time, pixel_format: :RGB24, scale: Rational(1), source: :path)
+    data = File.binread(path).freeze
+    header = ImageFile::JpegReader.from_string(data)
+    probe = ImageFile.probe(data)
+    header.scale = scale
+    output_pixels = header.output_width * header.output_height
+
+    count, elapsed = measure(min_time) do
+      reader = open_reader(path, source, data)
+      reader.scale = scale
+      reader.read_image(pixel_format: pixel_format)
+    end
+
+    {
+      group: group,
+      file: File.basename(path),
+      width: probe[:width],
+      height: probe[:height],
+      bytes: data.bytesize,
+      sha256: Digest::SHA256.hexdigest(data),
+      color_space: probe[:color_space],
+      progressive: probe[:progressive],
+      pixel_format: pixel_format,
+      scale: scale.to_s,
+      source: source,
+      iterations: count,
+      seconds: elapsed,
+      images_per_sec: count / elapsed,
+      mb_per_sec: count * data.bytesize / elapsed / 1e6,
+      mpixels_per_sec: count * output_pixels / elapsed / 1e6
+    }
+  end
+
+  def cases
+    list = []
+    default = synthetic_fixture(*DEFAULT_SIZE, false)
+
+    SIZES.each do |width, height|
+      [false, true].each do |progressive|
+        path = synthetic_fixture(width, height, progressive)
+        list << [progressive ? 'progressive' : 'baseline', path, {}]
+      end
+    end
+    Dir[File.join(SPEC_SUPPORT_DIR, '*.jpg')].sort.each do |path|
+      list << ['fixture', path, {}]
+    end
+    [default, CMYK_FIXTURE].each do |path|
+      PIXEL_FORMATS.each do |pixel_format|
+        list << ['pixel_format', path, { pixel_format: pixel_format }]
+      end
+      SCALES.each do |scale|
+        list << ['scale', path, { scale: scale }]
+      end
+    end
+    SOURCES.each do |source|
+      list << ['source', default, { source: source }]
+    end
+    list
+  end
+
+  def print_result(r)
+    printf("%-13s %-50s %-9s %-6s %-14s %9.1f img/s %8.2f MB/s %8.2f Mpx/s\n",
+           r[:group], r[:file], r[:pixel_format], r[:scale], r[:source],
+           r[:images_per_sec], r[:mb_per_sec], r[:mpixels_per_sec])
+  end
+
+  def run
+    min_time = Float(ENV['BENCH_TIME'] || 0.5)
+    output = ENV['OUTPUT'] || File.join(ROOT_DIR, 'tmp', 'bench',
+                                        "decode-#{Time.now.strftime('%Y%m%d%H%M%S')}.json")
+
+    results = cases.map do |group, path, options|
+      run_case(group, path, min_time, **options).tap {|r| print_result(r) }
+    end
+
+    FileUtils.mkdir_p(File.dirname(output))
+    File.write(output, JSON.pretty_generate(
+      version: 1,
+      time: Time.now.iso8601,
+      ruby: RUBY_DESCRIPTION,
+      image_file: ImageFile::Version::STRING,
+      bench_time: min_time,
+      results: results
+    ))
+    puts "results written to #{output}"
+  end
+end
+
+ImageFileBench.run if $0 == __FILE__
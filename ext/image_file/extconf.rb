@@ -7,9 +7,50 @@ $defs << "-DRUBY_VERSION=#{ver}"
 
 $CFLAGS << ' -Wall -Wextra -Wshadow'
 
+have_header('unistd.h')
+have_func('sysconf')
+have_library('pthread', 'pthread_create') if have_header('pthread.h')
+have_header('sys/mman.h')
+have_func('mmap')
+have_func('pread')
+have_func('clock_gettime', 'time.h')
+if have_func('strerror_r', 'string.h')
+  checking_for(checking_message('strerror_r returning char*')) do
+    if try_compile('char* f(char* buf) { return strerror_r(0, buf, 8); }', '-Werror')
+      $defs << '-DSTRERROR_R_CHAR_P'
+      true
+    end
+  end
+end
+have_func('rb_io_descriptor', 'ruby/io.h')
+have_func('rb_funcallv_kw', 'ruby.h')
+if have_header('immintrin.h')
+  checking_for(checking_message('__builtin_cpu_supports')) do
+    if try_link('int main(void) { __builtin_cpu_init(); return __builtin_cpu_supports("avx2"); }')
+      $defs << '-DHAVE___BUILTIN_CPU_SUPPORTS'
+      true
+    end
+  end
+end
+have_header('arm_neon.h')
+if have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+end
+if have_header('ruby/io/buffer.h')
+  have_func('rb_io_buffer_get_bytes_for_reading', 'ruby/io/buffer.h')
+end
+
 dir_config('jpeg')
 have_header('jpeglib.h')
 have_library('jpeg')
+have_const('JCS_RGB565', ['stdio.h', 'jpeglib.h'])
+have_func('jpeg_crop_scanline', ['stdio.h', 'jpeglib.h'])
+have_func('jpeg_skip_scanlines', ['stdio.h', 'jpeglib.h'])
+
+dir_config('png')
+if have_header('png.h') && have_library('png', 'png_create_read_struct', 'png.h')
+  have_func('png_process_data_pause', 'png.h')
+end
 
 if PKGConfig.have_package('cairo', 1, 2, 0)
   unless have_header('rb_cairo.h')
@@ -20,6 +61,7 @@ if PKGConfig.have_package('cairo', 1, 2, 0)
       have_header('rb_cairo.h')
     end
   end
+  have_func('rb_postponed_job_preregister', 'ruby/debug.h')
 end
 
 create_makefile('image_file')
@@ -2,6 +2,7 @@
 
 #ifdef HAVE_RB_CAIRO_H
 # include <rb_cairo.h>
+# include <ruby/debug.h>
 #endif
 
 VALUE cImageFileImage = Qnil;
@@ -96,29 +97,102 @@ pixel_format_to_cairo_format(rb_image_file_image_pixel_format_t const pf)
     rb_bug("unknown pixel format (%d)", pf);
     return -1;
 }
-#endif /* HAVE_RB_CAIRO_H */
 
-static inline int
-pixel_format_size(rb_image_file_image_pixel_format_t const pf)
+/*
+ * A buffer shared with surfaces is locked, so that it can't be resized
+ * under them, and kept alive by its holder in shared_buffers until all of
+ * them are destroyed.  rcairo may destroy a surface in its free function
+ * during GC, where Ruby can't be called, so the destroy callback only
+ * counts it there and leaves the release to a postponed job.
+ */
+struct shared_buffer {
+    VALUE buffer;
+    long surfaces;
+    long destroyed;
+};
+
+static VALUE shared_buffers = Qnil;	/* buffer => holder, by identity */
+
+static void
+shared_buffer_mark(void* ptr)
 {
-    switch (pf) {
-	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID:
-	    return -1;
+    struct shared_buffer* shared = (struct shared_buffer*)ptr;
+    rb_gc_mark(shared->buffer);
+}
 
-	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32:
-	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24:
-	    return 4;
+static rb_data_type_t const shared_buffer_data_type = {
+    "image_file::image::shared_buffer",
+#if RUBY_VERSION >= 193
+    {
+#endif
+	shared_buffer_mark,
+	RUBY_TYPED_DEFAULT_FREE,
+	NULL,
+#if RUBY_VERSION >= 193
+    },
+#endif
+};
 
-	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565:
-	    return 2;
+static int
+release_shared_buffer_i(VALUE buffer, VALUE holder, VALUE arg ARG_UNUSED)
+{
+    struct shared_buffer* shared = (struct shared_buffer*)DATA_PTR(holder);
+    if (shared->destroyed < shared->surfaces)
+	return ST_CONTINUE;
+    rb_str_unlocktmp(buffer);
+    return ST_DELETE;
+}
 
-	default:
-	    break;
+static void
+release_shared_buffers(void* arg ARG_UNUSED)
+{
+    rb_hash_foreach(shared_buffers, release_shared_buffer_i, Qnil);
+}
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t release_shared_buffers_job;
+#endif
+
+static void
+image_shared_surface_did_destroyed(void* data)
+{
+    struct shared_buffer* shared = (struct shared_buffer*)data;
+    ++shared->destroyed;
+    if (!rb_during_gc())
+	release_shared_buffers(NULL);
+    else
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+	rb_postponed_job_trigger(release_shared_buffers_job);
+#else
+	rb_postponed_job_register_one(0, release_shared_buffers, NULL);
+#endif
+}
+
+static struct shared_buffer*
+share_buffer(VALUE buffer)
+{
+    struct shared_buffer* shared;
+    VALUE holder = rb_hash_lookup(shared_buffers, buffer);
+
+    if (NIL_P(holder)) {
+	rb_str_locktmp(buffer);
+	holder = TypedData_Make_Struct(0, struct shared_buffer, &shared_buffer_data_type, shared);
+	shared->buffer = buffer;
+	rb_hash_aset(shared_buffers, buffer, holder);
     }
-    assert(0); /* MUST NOT REACH HERE */
-    return -1;
+    shared = (struct shared_buffer*)DATA_PTR(holder);
+    ++shared->surfaces;
+    return shared;
 }
 
+static int
+buffer_shared_p(VALUE buffer)
+{
+    release_shared_buffers(NULL);
+    return !NIL_P(rb_hash_lookup(shared_buffers, buffer));
+}
+#endif /* HAVE_RB_CAIRO_H */
+
 static long
 minimum_buffer_size(rb_image_file_image_pixel_format_t const pf, long const st, long const ht)
 {
@@ -220,13 +294,15 @@ process_arguments_of_image_initialize(int const argc, VALUE* const argv,
     VALUE width = Qnil;
     VALUE height = Qnil;
     VALUE stride = Qnil;
+    VALUE copy = Qnil;
 
     rb_image_file_image_pixel_format_t pf;
     long wd, ht, st;
     long min_len;
 
-    ID id_pixel_format, id_data, id_width, id_height, id_row_stride;
+    ID id_pixel_format, id_data, id_copy, id_width, id_height, id_row_stride;
     CONST_ID(id_data,  "data");
+    CONST_ID(id_copy,  "copy");
     CONST_ID(id_pixel_format,  "pixel_format");
     CONST_ID(id_width,  "width");
     CONST_ID(id_height, "height");
@@ -239,11 +315,13 @@ process_arguments_of_image_initialize(int const argc, VALUE* const argv,
 	width = rb_hash_lookup(params, ID2SYM(id_width));
 	height = rb_hash_lookup(params, ID2SYM(id_height));
 	stride = rb_hash_lookup(params, ID2SYM(id_row_stride));
+	copy = rb_hash_lookup(params, ID2SYM(id_copy));
     }
 
     if (!NIL_P(buffer)) {
 	Check_Type(buffer, T_STRING);
-	buffer = rb_str_dup(buffer);
+	if (NIL_P(copy) || RTEST(copy))
+	    buffer = rb_str_dup(buffer);
     }
 
     if (NIL_P(pixel_format))
@@ -297,6 +375,13 @@ process_arguments_of_image_initialize(int const argc, VALUE* const argv,
     *stride_ptr = st;
 }
 
+/*
+ * Creates an image of :pixel_format, :width, :height and :row_stride.
+ * The pixels are copied from :data if it is given.  With copy: false, the
+ * image uses the string of :data itself as its buffer, so the pixels are
+ * shared with the caller; the string must not be resized or replaced
+ * while the image is in use.
+ */
 static VALUE
 image_initialize(int argc, VALUE* argv, VALUE obj)
 {
@@ -329,6 +414,28 @@ rb_image_file_image_get_buffer(VALUE obj)
     return image->buffer;
 }
 
+/*
+ * Changes the shape of the image without touching its buffer.  Returns
+ * zero if the buffer is too short for the new shape.
+ */
+int
+rb_image_file_image_reshape(VALUE obj, rb_image_file_image_pixel_format_t const pf,
+	long const wd, long const ht, long const st)
+{
+    struct image_data* image = get_image_data(obj);
+
+    if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID == pf || wd <= 0 || ht <= 0 || st < wd)
+	return 0;
+    if (RSTRING_LEN(image->buffer) < minimum_buffer_size(pf, st, ht))
+	return 0;
+
+    image->pixel_format = pf;
+    image->width = wd;
+    image->height = ht;
+    image->stride = st;
+    return 1;
+}
+
 static VALUE
 image_get_pixel_format(VALUE obj)
 {
@@ -358,6 +465,300 @@ image_get_row_stride(VALUE obj)
 }
 
 
+/* a 4x4 ordered-dither (Bayer) matrix */
+static unsigned char const dither_matrix[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+/* Sets the biases of the pixels of the row +y+ for the 5-6-5 bits. */
+static void
+set_dither_row(uint32_t* dither, long const y)
+{
+    int x;
+    for (x = 0; x < 4; ++x) {
+	uint32_t const t = dither_matrix[y & 3][x];
+	dither[x] = ((t >> 1) << 16) | ((t >> 2) << 8) | (t >> 1);
+    }
+}
+
+static void
+convert_row(char const* src, rb_image_file_image_pixel_format_t const src_pf,
+	char* dst, rb_image_file_image_pixel_format_t const dst_pf,
+	long const wd, uint32_t const* dither)
+{
+    if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == src_pf) {
+	if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == dst_pf)
+	    MEMCPY(dst, src, uint16_t, wd);
+	else
+	    rb_image_file_pixel_converter.rgb16_565_to_xrgb32(
+		    (uint16_t const*)src, (uint32_t*)dst, wd, 0xFF000000U);
+    }
+    else if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == dst_pf)
+	rb_image_file_pixel_converter.xrgb32_to_rgb16_565(
+		(uint32_t const*)src, (uint16_t*)dst, wd, dither);
+    else
+	rb_image_file_pixel_converter.xrgb32_to_xrgb32(
+		(uint32_t const*)src, (uint32_t*)dst, wd, src_pf == dst_pf ? 0 : 0xFF000000U);
+}
+
+/*
+ * Converts the pixels of +src+ into +dst+ row by row.  They can be the
+ * same buffer if a row of +dst+ is not longer than a row of +src+, since
+ * each row goes through a scratch row first then.
+ */
+static void
+convert_pixels(char const* src, rb_image_file_image_pixel_format_t const src_pf, long const src_stride,
+	char* dst, rb_image_file_image_pixel_format_t const dst_pf, long const dst_stride,
+	long const wd, long const ht, int const dither)
+{
+    long const src_pitch = src_stride * pixel_format_size(src_pf);
+    long const dst_pitch = dst_stride * pixel_format_size(dst_pf);
+    long const row_size = wd * pixel_format_size(dst_pf);
+    int const in_place = src == dst;
+    char* row = NULL;
+    uint32_t biases[4];
+    long y;
+
+    assert(!in_place || dst_pitch <= src_pitch);
+
+    if (in_place)
+	row = ALLOC_N(char, row_size);
+    for (y = 0; y < ht; ++y) {
+	char* d = dst + y*dst_pitch;
+	if (dither)
+	    set_dither_row(biases, y);
+	convert_row(src + y*src_pitch, src_pf, in_place ? row : d, dst_pf, wd,
+		dither ? biases : NULL);
+	if (in_place)
+	    MEMCPY(d, row, char, row_size);
+	if (dst_pitch > row_size)
+	    MEMZERO(d + row_size, char, dst_pitch - row_size);
+    }
+    if (row)
+	xfree(row);
+}
+
+static void
+process_arguments_of_image_convert(int const argc, VALUE* const argv,
+	VALUE* pixel_format_ptr, VALUE* stride_ptr, int* dither_ptr)
+{
+    VALUE params;
+    VALUE pixel_format = Qnil;
+    VALUE stride = Qnil;
+    VALUE dither = Qnil;
+
+    ID id_pixel_format, id_row_stride, id_dither;
+    CONST_ID(id_pixel_format, "pixel_format");
+    CONST_ID(id_row_stride, "row_stride");
+    CONST_ID(id_dither, "dither");
+
+    rb_scan_args(argc, argv, "01", &params);
+    if (TYPE(params) == T_HASH) {
+	pixel_format = rb_hash_lookup(params, ID2SYM(id_pixel_format));
+	stride = rb_hash_lookup(params, ID2SYM(id_row_stride));
+	dither = rb_hash_lookup(params, ID2SYM(id_dither));
+    }
+
+    if (TYPE(pixel_format) == T_STRING)
+	pixel_format = rb_str_intern(pixel_format);
+
+    *pixel_format_ptr = pixel_format;
+    *stride_ptr = stride;
+    *dither_ptr = RTEST(dither);
+}
+
+/*
+ * Returns a new image of the pixels converted to :pixel_format, with
+ * :row_stride.  Both default to the ones Image.new would use; the pixel
+ * format defaults to that of the image.  ARGB32 pixels lose their alpha
+ * in RGB24 and RGB16_565, which is the same as compositing them over
+ * black; RGB24 and RGB16_565 pixels become opaque in ARGB32.  With
+ * dither: true, conversions into RGB16_565 use a 4x4 ordered dither.
+ */
+static VALUE
+image_convert(int argc, VALUE* argv, VALUE obj)
+{
+    struct image_data* image = get_image_data(obj);
+    struct image_data* converted;
+    VALUE pixel_format, stride, params, result;
+    int dither;
+
+    ID id_pixel_format, id_width, id_height, id_row_stride;
+    CONST_ID(id_pixel_format, "pixel_format");
+    CONST_ID(id_width, "width");
+    CONST_ID(id_height, "height");
+    CONST_ID(id_row_stride, "row_stride");
+
+    process_arguments_of_image_convert(argc, argv, &pixel_format, &stride, &dither);
+
+    params = rb_hash_new();
+    rb_hash_aset(params, ID2SYM(id_pixel_format), NIL_P(pixel_format)
+	    ? rb_image_file_image_pixel_format_to_symbol(image->pixel_format)
+	    : pixel_format);
+    rb_hash_aset(params, ID2SYM(id_width), LONG2NUM(image->width));
+    rb_hash_aset(params, ID2SYM(id_height), LONG2NUM(image->height));
+    if (!NIL_P(stride))
+	rb_hash_aset(params, ID2SYM(id_row_stride), stride);
+    result = rb_class_new_instance(1, &params, cImageFileImage);
+
+    converted = get_image_data(result);
+    convert_pixels(RSTRING_PTR(image->buffer), image->pixel_format, image->stride,
+	    RSTRING_PTR(converted->buffer), converted->pixel_format, converted->stride,
+	    image->width, image->height, dither);
+
+    return result;
+}
+
+/*
+ * Converts the pixels of the image itself like convert, except that
+ * :row_stride defaults to the current one.  The conversion is done in the
+ * buffer of the image if the new rows are not longer than the current
+ * ones, so an image created with copy: false keeps sharing its pixels;
+ * otherwise the image gets a new buffer.
+ */
+static VALUE
+image_convert_bang(int argc, VALUE* argv, VALUE obj)
+{
+    struct image_data* image = get_image_data(obj);
+    VALUE pixel_format, stride, buffer;
+    rb_image_file_image_pixel_format_t pf;
+    long st;
+    int dither;
+
+    process_arguments_of_image_convert(argc, argv, &pixel_format, &stride, &dither);
+
+    pf = NIL_P(pixel_format) ? image->pixel_format : check_pixel_format(pixel_format);
+    st = NIL_P(stride) ? image->stride : NUM2LONG(stride);
+    if (st <= 0)
+	rb_raise(rb_eArgError, "zero or negative image row-stride");
+    else if (st < image->width) {
+	rb_warning("the given row-stride is less than the image width.");
+	st = image->width;
+    }
+
+    if (pf == image->pixel_format && st == image->stride)
+	return obj;
+#ifdef HAVE_RB_CAIRO_H
+    if (buffer_shared_p(image->buffer))
+	rb_raise(rb_eRuntimeError, "the buffer is shared with a cairo surface");
+#endif
+
+    if (st * pixel_format_size(pf) <= image->stride * pixel_format_size(image->pixel_format)) {
+	rb_str_modify(image->buffer);
+	buffer = image->buffer;
+    }
+    else
+	buffer = rb_str_new(NULL, minimum_buffer_size(pf, st, image->height));
+    convert_pixels(RSTRING_PTR(image->buffer), image->pixel_format, image->stride,
+	    RSTRING_PTR(buffer), pf, st, image->width, image->height, dither);
+
+    image->buffer = buffer;
+    image->pixel_format = pf;
+    image->stride = st;
+    return obj;
+}
+
+static rb_image_file_resize_filter_t
+check_resize_filter(VALUE const filter)
+{
+    ID id, id_box, id_bilinear, id_lanczos3;
+    CONST_ID(id_box, "box");
+    CONST_ID(id_bilinear, "bilinear");
+    CONST_ID(id_lanczos3, "lanczos3");
+
+    if (NIL_P(filter))
+	return RB_IMAGE_FILE_RESIZE_FILTER_BOX;
+    Check_Type(filter, T_SYMBOL);
+
+    id = SYM2ID(filter);
+    if (id == id_box)
+	return RB_IMAGE_FILE_RESIZE_FILTER_BOX;
+    if (id == id_bilinear)
+	return RB_IMAGE_FILE_RESIZE_FILTER_BILINEAR;
+    if (id == id_lanczos3)
+	return RB_IMAGE_FILE_RESIZE_FILTER_LANCZOS3;
+    rb_raise(rb_eArgError, "unknown resize filter");
+    return RB_IMAGE_FILE_RESIZE_FILTER_BOX; /* MUST NOT REACH HERE */
+}
+
+/*
+ * Returns the image resampled to +width+ x +height+ pixels of the same
+ * pixel format.  The filter is one of :box (the default), :bilinear and
+ * :lanczos3.  The rows are resampled in bands by at most :threads native
+ * threads (one by default).  With :into, the pixels go into the given
+ * image, which is reshaped to the new size and keeps its row-stride if it
+ * is wide enough.
+ */
+static VALUE
+image_resize(int argc, VALUE* argv, VALUE obj)
+{
+    VALUE width, height, params;
+    VALUE filter = Qnil, threads = Qnil, into = Qnil;
+    struct image_data* image = get_image_data(obj);
+    struct image_data* dst;
+    rb_image_file_resize_filter_t ft;
+    long wd, ht, st;
+    int nthreads = 1;
+
+    ID id_filter, id_threads, id_into, id_pixel_format, id_width, id_height;
+    CONST_ID(id_filter, "filter");
+    CONST_ID(id_threads, "threads");
+    CONST_ID(id_into, "into");
+    CONST_ID(id_pixel_format, "pixel_format");
+    CONST_ID(id_width, "width");
+    CONST_ID(id_height, "height");
+
+    rb_scan_args(argc, argv, "21", &width, &height, &params);
+    if (TYPE(params) == T_HASH) {
+	filter = rb_hash_lookup(params, ID2SYM(id_filter));
+	threads = rb_hash_lookup(params, ID2SYM(id_threads));
+	into = rb_hash_lookup(params, ID2SYM(id_into));
+    }
+
+    wd = NUM2LONG(width);
+    if (wd <= 0)
+	rb_raise(rb_eArgError, "zero or negative image width");
+    ht = NUM2LONG(height);
+    if (ht <= 0)
+	rb_raise(rb_eArgError, "zero or negative image height");
+    ft = check_resize_filter(filter);
+    if (!NIL_P(threads)) {
+	nthreads = NUM2INT(threads);
+	if (nthreads < 1)
+	    rb_raise(rb_eArgError, "threads must be positive");
+    }
+
+    if (NIL_P(into)) {
+	VALUE new_params = rb_hash_new();
+	rb_hash_aset(new_params, ID2SYM(id_pixel_format),
+		rb_image_file_image_pixel_format_to_symbol(image->pixel_format));
+	rb_hash_aset(new_params, ID2SYM(id_width), LONG2NUM(wd));
+	rb_hash_aset(new_params, ID2SYM(id_height), LONG2NUM(ht));
+	into = rb_class_new_instance(1, &new_params, cImageFileImage);
+    }
+    else {
+	if (!rb_obj_is_kind_of(into, cImageFileImage))
+	    rb_raise(rb_eTypeError, "into must be an ImageFile::Image");
+	if (into == obj)
+	    rb_raise(rb_eArgError, "unable to resize an image into itself");
+	st = get_image_data(into)->stride;
+	if (!rb_image_file_image_reshape(into, image->pixel_format, wd, ht, st < wd ? wd : st))
+	    rb_raise(rb_eArgError, "the buffer of the given image is too short");
+    }
+
+    dst = get_image_data(into);
+    rb_str_modify(dst->buffer);
+    rb_image_file_resize(
+	    RSTRING_PTR(image->buffer), image->width, image->height, image->stride,
+	    RSTRING_PTR(dst->buffer), dst->width, dst->height, dst->stride,
+	    image->pixel_format, ft, nthreads);
+
+    return into;
+}
+
 #ifdef HAVE_RB_CAIRO_H
 static cairo_user_data_key_t const cairo_data_key = {};
 
@@ -367,19 +768,51 @@ image_surface_did_destroyed(void* data)
     xfree(data);
 }
 
+/*
+ * Creates a cairo image surface of the pixels.  By default the surface has
+ * a copy of them.  With copy: false, the surface draws on the buffer of
+ * the image itself, so drawings on the surface appear in the image and
+ * vice versa.  The buffer stays alive and locked until the surface is
+ * destroyed, even after the image is collected, and convert! raises
+ * meanwhile.
+ */
 static VALUE
-image_create_cairo_surface(VALUE obj)
+image_create_cairo_surface(int argc, VALUE* argv, VALUE obj)
 {
     cairo_surface_t* cairo_surface;
     cairo_format_t cairo_format;
     unsigned char* data;
-    VALUE surface;
+    VALUE params, surface;
+    VALUE copy = Qnil;
     struct image_data* image = get_image_data(obj);
 
+    ID id_copy;
+    CONST_ID(id_copy,  "copy");
+
+    rb_scan_args(argc, argv, "01", &params);
+    if (TYPE(params) == T_HASH)
+	copy = rb_hash_lookup(params, ID2SYM(id_copy));
+
+    cairo_format = pixel_format_to_cairo_format(image->pixel_format);
+
+    if (!NIL_P(copy) && !RTEST(copy)) {
+	struct shared_buffer* shared;
+
+	if (!buffer_shared_p(image->buffer))
+	    rb_str_modify(image->buffer);
+	shared = share_buffer(image->buffer);
+	data = (unsigned char*)RSTRING_PTR(image->buffer);
+	cairo_surface = cairo_image_surface_create_for_data(
+		data, cairo_format, (int)image->width, (int)image->height,
+		(int)image->stride*pixel_format_size(image->pixel_format));
+	cairo_surface_set_user_data(cairo_surface, &cairo_data_key, shared,
+		image_shared_surface_did_destroyed);
+	return CRSURFACE2RVAL_WITH_DESTROY(cairo_surface);
+    }
+
     data = xmalloc(sizeof(unsigned char)*RSTRING_LEN(image->buffer));
     MEMCPY(data, RSTRING_PTR(image->buffer), unsigned char, RSTRING_LEN(image->buffer));
 
-    cairo_format = pixel_format_to_cairo_format(image->pixel_format);
     cairo_surface = cairo_image_surface_create_for_data(
 	    data, cairo_format, (int)image->width, (int)image->height,
 	    (int)image->stride*pixel_format_size(image->pixel_format));
@@ -400,9 +833,18 @@ rb_image_file_Init_image_file_image(void)
     rb_define_method(cImageFileImage, "width", image_get_width, 0);
     rb_define_method(cImageFileImage, "height", image_get_height, 0);
     rb_define_method(cImageFileImage, "row_stride", image_get_row_stride, 0);
+    rb_define_method(cImageFileImage, "convert", image_convert, -1);
+    rb_define_method(cImageFileImage, "convert!", image_convert_bang, -1);
+    rb_define_method(cImageFileImage, "resize", image_resize, -1);
 
 #ifdef HAVE_RB_CAIRO_H
-    rb_define_method(cImageFileImage, "create_cairo_surface", image_create_cairo_surface, 0);
+    rb_define_method(cImageFileImage, "create_cairo_surface", image_create_cairo_surface, -1);
+    shared_buffers = rb_hash_new();
+    rb_funcall(shared_buffers, rb_intern("compare_by_identity"), 0);
+    rb_gc_register_mark_object(shared_buffers);
+# ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    release_shared_buffers_job = rb_postponed_job_preregister(0, release_shared_buffers, NULL);
+# endif
 #endif
 
     CONST_ID(id_ARGB32, "ARGB32");
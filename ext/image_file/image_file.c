@@ -7,6 +7,12 @@ Init_image_file(void)
 {
     mImageFile = rb_define_module("ImageFile");
 
+    rb_image_file_Init_image_file_pixel_convert();
+    rb_image_file_Init_image_file_resize();
     rb_image_file_Init_image_file_image();
     rb_image_file_Init_image_file_jpeg_reader();
+    rb_image_file_Init_image_file_jpeg_writer();
+    rb_image_file_Init_image_file_jpeg_transformer();
+    rb_image_file_Init_image_file_png_reader();
+    rb_image_file_Init_image_file_probe();
 }
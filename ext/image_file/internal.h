@@ -42,11 +42,23 @@ RUBY_EXTERN VALUE rb_image_file_mImageFile;
 RUBY_EXTERN VALUE rb_image_file_cImageFileImage;
 RUBY_EXTERN VALUE rb_image_file_cImageFileJpegReader;
 RUBY_EXTERN VALUE rb_image_file_eImageFileJpegReaderError;
+RUBY_EXTERN VALUE rb_image_file_cImageFileJpegWriter;
+RUBY_EXTERN VALUE rb_image_file_eImageFileJpegWriterError;
+RUBY_EXTERN VALUE rb_image_file_cImageFileJpegTransformer;
+RUBY_EXTERN VALUE rb_image_file_eImageFileJpegTransformerError;
+RUBY_EXTERN VALUE rb_image_file_cImageFilePngReader;
+RUBY_EXTERN VALUE rb_image_file_eImageFilePngReaderError;
 
 #define mImageFile rb_image_file_mImageFile
 #define cImageFileImage rb_image_file_cImageFileImage
 #define cImageFileJpegReader rb_image_file_cImageFileJpegReader
 #define eImageFileJpegReaderError rb_image_file_eImageFileJpegReaderError
+#define cImageFileJpegWriter rb_image_file_cImageFileJpegWriter
+#define eImageFileJpegWriterError rb_image_file_eImageFileJpegWriterError
+#define cImageFileJpegTransformer rb_image_file_cImageFileJpegTransformer
+#define eImageFileJpegTransformerError rb_image_file_eImageFileJpegTransformerError
+#define cImageFilePngReader rb_image_file_cImageFilePngReader
+#define eImageFilePngReaderError rb_image_file_eImageFilePngReaderError
 
 typedef enum {
     RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID = -1,
@@ -58,9 +70,87 @@ typedef enum {
 rb_image_file_image_pixel_format_t rb_image_file_image_symbol_to_pixel_format(VALUE symbol);
 VALUE rb_image_file_image_pixel_format_to_symbol(rb_image_file_image_pixel_format_t const pf);
 VALUE rb_image_file_image_get_buffer(VALUE obj);
+int rb_image_file_image_reshape(VALUE obj, rb_image_file_image_pixel_format_t const pf,
+	long const wd, long const ht, long const st);
+
+static inline int
+pixel_format_size(rb_image_file_image_pixel_format_t const pf)
+{
+    switch (pf) {
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID:
+	    return -1;
+
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32:
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24:
+	    return 4;
+
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565:
+	    return 2;
+
+	default:
+	    break;
+    }
+    assert(0); /* MUST NOT REACH HERE */
+    return -1;
+}
+
+typedef enum {
+    RB_IMAGE_FILE_RESIZE_FILTER_BOX = 0,
+    RB_IMAGE_FILE_RESIZE_FILTER_BILINEAR = 1,
+    RB_IMAGE_FILE_RESIZE_FILTER_LANCZOS3 = 2,
+} rb_image_file_resize_filter_t;
+
+void rb_image_file_resize(
+	char const* const src, long const src_width, long const src_height, long const src_stride,
+	char* const dst, long const dst_width, long const dst_height, long const dst_stride,
+	rb_image_file_image_pixel_format_t const pf,
+	rb_image_file_resize_filter_t const filter, int const threads);
+
+typedef struct {
+    char const* name;
+    void (* rgb_to_xrgb32)(unsigned char const* src, uint32_t* dst, long n, uint32_t alpha);
+    void (* rgb_to_rgb16_565)(unsigned char const* src, uint16_t* dst, long n);
+    void (* cmyk_to_xrgb32)(unsigned char const* src, uint32_t* dst, long n, uint32_t alpha, int inverted);
+    void (* cmyk_to_rgb16_565)(unsigned char const* src, uint16_t* dst, long n, int inverted);
+    void (* xrgb32_to_xrgb32)(uint32_t const* src, uint32_t* dst, long n, uint32_t alpha);
+    void (* xrgb32_to_rgb16_565)(uint32_t const* src, uint16_t* dst, long n, uint32_t const* dither);
+    void (* rgb16_565_to_xrgb32)(uint16_t const* src, uint32_t* dst, long n, uint32_t alpha);
+} rb_image_file_pixel_converter_t;
+
+RUBY_EXTERN rb_image_file_pixel_converter_t rb_image_file_pixel_converter;
+
+typedef void rb_image_file_parallel_func_t(void* data, long index);
+
+int rb_image_file_io_descriptor(VALUE io);
+
+/* Copies the message of +errnum+ to +buf+; strerror(3) is not thread-safe. */
+static inline void
+copy_error_message(int const errnum, char* buf, size_t const size)
+{
+#if defined(HAVE_STRERROR_R) && defined(STRERROR_R_CHAR_P)
+    char const* message = strerror_r(errnum, buf, size);
+    if (message != buf)
+	snprintf(buf, size, "%s", message);
+#elif defined(HAVE_STRERROR_R)
+    if (strerror_r(errnum, buf, size) != 0)
+	snprintf(buf, size, "error %d", errnum);
+#else
+    snprintf(buf, size, "%s", strerror(errnum));
+#endif
+}
+
+int rb_image_file_number_of_processors(void);
+void rb_image_file_parallel_for(long const n, int threads,
+	rb_image_file_parallel_func_t* func, void* data);
 
 void rb_image_file_Init_image_file_image(void);
 void rb_image_file_Init_image_file_jpeg_reader(void);
+void rb_image_file_Init_image_file_jpeg_writer(void);
+void rb_image_file_Init_image_file_jpeg_transformer(void);
+void rb_image_file_Init_image_file_png_reader(void);
+void rb_image_file_Init_image_file_pixel_convert(void);
+void rb_image_file_Init_image_file_probe(void);
+void rb_image_file_Init_image_file_resize(void);
 
 static inline int
 file_p(VALUE fname)
@@ -70,6 +160,30 @@ file_p(VALUE fname)
     return RTEST(rb_funcall(rb_cFile, id_file_p, 1, fname));
 }
 
+/* A string beginning with the SOI marker is the content of a file. */
+static inline int
+jpeg_data_p(VALUE obj)
+{
+    return RB_TYPE_P(obj, T_STRING) && RSTRING_LEN(obj) >= 2
+	&& (unsigned char)RSTRING_PTR(obj)[0] == 0xFF
+	&& (unsigned char)RSTRING_PTR(obj)[1] == 0xD8;
+}
+
+/* Reads a 16 or 32-bit value of an Exif (TIFF) structure. */
+static inline unsigned int
+exif_get16(unsigned char const* p, int const big_endian)
+{
+    return big_endian ? ((unsigned int)p[0] << 8) | p[1] : ((unsigned int)p[1] << 8) | p[0];
+}
+
+static inline size_t
+exif_get32(unsigned char const* p, int const big_endian)
+{
+    return big_endian
+	? ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3]
+	: ((size_t)p[3] << 24) | ((size_t)p[2] << 16) | ((size_t)p[1] << 8) | p[0];
+}
+
 static inline void
 check_file_not_found(VALUE fname)
 {
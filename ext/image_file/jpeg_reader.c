@@ -1,10 +1,40 @@
 #include "internal.h"
+#include <ruby/io.h>
+#ifdef HAVE_RUBY_IO_BUFFER_H
+# include <ruby/io/buffer.h>
+#endif
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+
+#include <setjmp.h>
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
 #undef EXTERN
 #include <jpeglib.h>
 #include <jerror.h>
 
+#if defined(HAVE_PREAD) || defined(HAVE_MMAP)
+# define USE_NATIVE_FILE_SOURCE 1
+#endif
+
 static size_t const INPUT_BUFFER_SIZE = 4096U;
+static size_t const FILE_INPUT_BUFFER_SIZE = 65536U;
+
+static JOCTET const fake_eoi_marker[2] = { (JOCTET)0xFF, (JOCTET)JPEG_EOI };
 
 VALUE cImageFileJpegReader = Qnil;
 VALUE eImageFileJpegReaderError = Qnil;
@@ -23,10 +53,36 @@ static ID id_FS;
 static ID id_new;
 static ID id_close;
 static ID id_read;
+static ID id_to_path;
+static ID id_read_nonblock;
+static ID id_wait_readable;
+static ID id_wait_writable;
+static ID id_exception;
 static ID id_pixel_format;
 static ID id_width;
 static ID id_height;
 static ID id_row_stride;
+static ID id_threads;
+static ID id_scale;
+static ID id_numerator;
+static ID id_denominator;
+static ID id_quality;
+static ID id_fast;
+static ID id_default;
+static ID id_fit;
+static ID id_max_width;
+static ID id_max_height;
+static ID id_region;
+static ID id_into;
+static ID id_bytes_read;
+static ID id_fill_input_buffer_calls;
+static ID id_header_time;
+static ID id_decompress_time;
+static ID id_convert_time;
+static ID id_scanlines;
+static ID id_scanline_batches;
+static ID id_scanlines_per_batch;
+static ID id_peak_buffer_size;
 
 static inline char const*
 j_color_space_name(J_COLOR_SPACE const color_space)
@@ -53,7 +109,6 @@ j_color_space_name(J_COLOR_SPACE const color_space)
 	default:
 	    break;
     }
-    assert(0); /* MUST NOT REACH HERE */
     return "(unknown color space)";
 }
 
@@ -78,6 +133,11 @@ j_color_space_to_image_pixel_format(J_COLOR_SPACE const color_space)
     return RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID;
 }
 
+/*
+ * Returns the extended color space of libjpeg-turbo whose memory layout
+ * is the same as the pixel format, or JCS_UNKNOWN if there is no such
+ * color space.
+ */
 static J_COLOR_SPACE
 image_pixel_format_to_j_color_space(rb_image_file_image_pixel_format_t const pf)
 {
@@ -85,15 +145,32 @@ image_pixel_format_to_j_color_space(rb_image_file_image_pixel_format_t const pf)
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID:
 	    return JCS_UNKNOWN;
 
+#ifdef JCS_ALPHA_EXTENSIONS
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32:
+# ifdef WORDS_BIGENDIAN
+	    return JCS_EXT_ARGB;
+# else
+	    return JCS_EXT_BGRA;
+# endif
+#endif
+
+#ifdef JCS_EXTENSIONS
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24:
+# ifdef WORDS_BIGENDIAN
+	    return JCS_EXT_XRGB;
+# else
+	    return JCS_EXT_BGRX;
+# endif
+#endif
+
+#ifdef HAVE_CONST_JCS_RGB565
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565:
-	    return JCS_RGB;
+	    return JCS_RGB565;
+#endif
 
 	default:
 	    break;
     }
-    assert(0); /* MUST NOT REACH HERE */
     return JCS_UNKNOWN;
 }
 
@@ -119,6 +196,25 @@ color_space_to_symbol(J_COLOR_SPACE const color_space)
 	case JCS_YCCK:
 	    return ID2SYM(id_YCCK);
 
+#ifdef JCS_EXTENSIONS
+	case JCS_EXT_RGB:
+	case JCS_EXT_RGBX:
+	case JCS_EXT_BGR:
+	case JCS_EXT_BGRX:
+	case JCS_EXT_XBGR:
+	case JCS_EXT_XRGB:
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+	case JCS_EXT_RGBA:
+	case JCS_EXT_BGRA:
+	case JCS_EXT_ABGR:
+	case JCS_EXT_ARGB:
+#endif
+#ifdef HAVE_CONST_JCS_RGB565
+	case JCS_RGB565:
+#endif
+	    return ID2SYM(id_RGB);
+
 	default:
 	    break;
     }
@@ -162,6 +258,20 @@ dct_method_to_symbol(J_DCT_METHOD const dct_method)
     return Qnil;
 }
 
+static J_DCT_METHOD
+symbol_to_dct_method(VALUE symbol)
+{
+    ID const id = SYM2ID(symbol);
+    if (id == id_ISLOW)
+	return JDCT_ISLOW;
+    if (id == id_IFAST)
+	return JDCT_IFAST;
+    if (id == id_FLOAT)
+	return JDCT_FLOAT;
+    rb_raise(rb_eArgError, "unknown DCT method (%s)", rb_id2name(id));
+    return JDCT_ISLOW; /* DO NOT REACH HERE */
+}
+
 static VALUE
 dither_mode_to_symbol(J_DITHER_MODE const dither_mode)
 {
@@ -190,22 +300,111 @@ enum jpeg_reader_state {
     READER_FINISHED_DECOMPRESS
 };
 
+/*
+ * Counters of a reader.  They are merged into a process-wide aggregate
+ * when a header read or a decode finishes, with the GVL held, so that
+ * the workers of decode_batch never write the aggregate.
+ */
+struct jpeg_reader_stats {
+    size_t bytes_read;
+    size_t fill_input_buffer_calls;
+    uint64_t header_nsec;
+    uint64_t decompress_nsec;	/* in libjpeg, without the conversion */
+    uint64_t convert_nsec;
+    size_t scanlines;
+    size_t scanline_batches;	/* calls of jpeg_read_scanlines */
+    size_t peak_buffer_size;	/* of the temporary buffers of a decode */
+};
+
+static struct jpeg_reader_stats global_stats;
+
+#define STATS_ADD(reader, field, n) ((reader)->stats.field += (n))
+
+static inline uint64_t
+stats_clock(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000U + (uint64_t)tv.tv_usec * 1000U;
+#endif
+}
+
+enum jpeg_reader_source_type {
+    SOURCE_IO = 0,	/* Ruby IO object, read via IO#read */
+    SOURCE_FILE_MAP,	/* regular file mapped by mmap(2) */
+    SOURCE_FILE_READ,	/* regular file read by pread(2) */
+    SOURCE_MEMORY	/* bytes of a frozen String or an IO::Buffer */
+};
+
 struct jpeg_reader_data {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr error;
     VALUE source;
     VALUE buffer;
+    VALUE buffer_lock;		/* owns the finalizer unlocking an IO::Buffer source */
     enum jpeg_reader_state state;
+    enum jpeg_reader_source_type source_type;
+    int fd;
+    JOCTET* map;
+    size_t map_length;
+    JOCTET const* memory;
+    size_t memory_length;
+    JOCTET* file_buffer;
+    off_t file_offset;
+    size_t skip_bytes;		/* to be skipped by the next resume_source */
+    JSAMPARRAY band;
+    rb_image_file_image_pixel_format_t pixel_format;
+    long stride;
+    struct jpeg_reader_stats stats;
+    struct jpeg_reader_stats merged_stats;	/* the part of stats in global_stats */
+    unsigned long generation;	/* incremented by every reset */
+    jmp_buf jmpbuf;
+    char error_message[JMSG_LENGTH_MAX];
     unsigned close_source: 1;
     unsigned start_of_file: 1;
+    unsigned without_gvl: 1;
+    unsigned direct_decode: 1;
+    unsigned output_started: 1;
+    unsigned nonblock: 1;
+    unsigned suspended: 1;	/* waiting for resume_source */
+    unsigned busy: 1;		/* libjpeg runs on it where other threads can run */
+    unsigned app1_saved: 1;	/* the APP1 segments of the header are in marker_list */
 };
 
+/* Adds the counts since the last merge to global_stats; needs the GVL. */
+static void
+stats_merge(struct jpeg_reader_data* reader)
+{
+    struct jpeg_reader_stats const* stats = &reader->stats;
+    struct jpeg_reader_stats* merged = &reader->merged_stats;
+
+    global_stats.bytes_read += stats->bytes_read - merged->bytes_read;
+    global_stats.fill_input_buffer_calls += stats->fill_input_buffer_calls - merged->fill_input_buffer_calls;
+    global_stats.header_nsec += stats->header_nsec - merged->header_nsec;
+    global_stats.decompress_nsec += stats->decompress_nsec - merged->decompress_nsec;
+    global_stats.convert_nsec += stats->convert_nsec - merged->convert_nsec;
+    global_stats.scanlines += stats->scanlines - merged->scanlines;
+    global_stats.scanline_batches += stats->scanline_batches - merged->scanline_batches;
+    /* a peak merged before reset_stats must not come back */
+    if (merged->peak_buffer_size < stats->peak_buffer_size
+	    && global_stats.peak_buffer_size < stats->peak_buffer_size)
+	global_stats.peak_buffer_size = stats->peak_buffer_size;
+    *merged = *stats;
+}
+
 static void
 jpeg_reader_mark(void* ptr)
 {
     struct jpeg_reader_data* reader = (struct jpeg_reader_data*)ptr;
+    /* rb_gc_mark pins the source, so the bytes of a memory source never move */
     rb_gc_mark(reader->source);
     rb_gc_mark(reader->buffer);
+    rb_gc_mark(reader->buffer_lock);
 }
 
 static void
@@ -217,9 +416,16 @@ jpeg_reader_free(void* ptr)
     if (reader->close_source && rb_respond_to(reader->source, id_close)) {
 	rb_funcall(reader->source, id_close, 0);
     }
+#endif
+#ifdef HAVE_MMAP
+    if (reader->map != NULL) {
+	munmap(reader->map, reader->map_length);
+	reader->map = NULL;
+    }
 #endif
     reader->source = Qnil;
     jpeg_destroy_decompress(&reader->cinfo);
+    stats_merge(reader);
     xfree(ptr);
 }
 
@@ -250,9 +456,32 @@ jpeg_reader_alloc(VALUE klass)
 	    klass, struct jpeg_reader_data, &jpeg_reader_data_type, reader);
     reader->source = Qnil;
     reader->buffer = Qnil;
+    reader->buffer_lock = Qnil;
     reader->state = READER_ALLOCATED;
+    reader->source_type = SOURCE_IO;
+    reader->fd = -1;
+    reader->map = NULL;
+    reader->map_length = 0;
+    reader->memory = NULL;
+    reader->memory_length = 0;
+    reader->file_buffer = NULL;
+    reader->file_offset = 0;
+    reader->skip_bytes = 0;
+    reader->band = NULL;
+    reader->pixel_format = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID;
+    reader->stride = 0;
+    MEMZERO(&reader->stats, struct jpeg_reader_stats, 1);
+    MEMZERO(&reader->merged_stats, struct jpeg_reader_stats, 1);
+    reader->generation = 0;
     reader->close_source = 0;
     reader->start_of_file = 0;
+    reader->without_gvl = 0;
+    reader->direct_decode = 0;
+    reader->output_started = 0;
+    reader->nonblock = 0;
+    reader->suspended = 0;
+    reader->busy = 0;
+    reader->app1_saved = 0;
     return obj;
 }
 
@@ -264,19 +493,65 @@ get_jpeg_reader_data(VALUE obj)
     return reader;
 }
 
+static inline void
+reader_check_not_busy(struct jpeg_reader_data* reader)
+{
+    assert(reader != NULL);
+    if (reader->busy) {
+	rb_raise(eImageFileJpegReaderError, "reader is in use by another thread");
+    }
+}
+
+static void
+stats_update_peak_buffer_size(struct jpeg_reader_data* reader, size_t const size)
+{
+    if (reader->stats.peak_buffer_size < size)
+	reader->stats.peak_buffer_size = size;
+}
+
+/*
+ * Without the GVL, an error cannot be raised here.  The message is saved
+ * and the control returns to the setjmp point in decompress_without_gvl.
+ */
 static void
 error_exit(j_common_ptr cinfo)
 {
+    struct jpeg_reader_data* reader = (struct jpeg_reader_data*)cinfo->client_data;
     char message[JMSG_LENGTH_MAX];
+
+    if (reader != NULL && reader->without_gvl) {
+	(* cinfo->err->format_message)(cinfo, reader->error_message);
+	longjmp(reader->jmpbuf, 1);
+    }
+
     (* cinfo->err->format_message)(cinfo, message);
     rb_raise(eImageFileJpegReaderError, "%s", message);
 }
 
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+output_message_with_gvl(void* message)
+{
+    rb_warning("%s", (char const*)message);
+    return NULL;
+}
+#endif
+
 static void
 output_message(j_common_ptr cinfo)
 {
+    struct jpeg_reader_data* reader = (struct jpeg_reader_data*)cinfo->client_data;
     char message[JMSG_LENGTH_MAX];
+
     (* cinfo->err->format_message)(cinfo, message);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (reader != NULL && reader->without_gvl) {
+	rb_thread_call_with_gvl(output_message_with_gvl, message);
+	return;
+    }
+#else
+    (void)reader;
+#endif
     rb_warning("%s", message);
 }
 
@@ -292,42 +567,45 @@ init_error_mgr(struct jpeg_error_mgr* err)
 static void
 init_source(j_decompress_ptr cinfo)
 {
-    VALUE obj;
     struct jpeg_reader_data* reader;
 
     assert(cinfo != NULL);
 
-    obj = (VALUE)cinfo->client_data;
-    reader = get_jpeg_reader_data(obj);
+    reader = (struct jpeg_reader_data*)cinfo->client_data;
     reader->start_of_file = 1;
 }
 
+static boolean
+insert_fake_eoi(j_decompress_ptr cinfo)
+{
+    WARNMS(cinfo, JWRN_JPEG_EOF);
+    cinfo->src->next_input_byte = fake_eoi_marker;
+    cinfo->src->bytes_in_buffer = sizeof(fake_eoi_marker);
+    return TRUE;
+}
+
 static boolean
 fill_input_buffer(j_decompress_ptr cinfo)
 {
-    VALUE obj;
     struct jpeg_reader_data* reader;
 
     assert(cinfo != NULL);
 
-    obj = (VALUE)cinfo->client_data;
-    reader = get_jpeg_reader_data(obj);
+    reader = (struct jpeg_reader_data*)cinfo->client_data;
 
     reader->buffer = rb_funcall(reader->source, id_read, 1, INT2FIX(INPUT_BUFFER_SIZE));
     if (NIL_P(reader->buffer)) { /* EOF */
 	if (reader->start_of_file) { /* empty file */
 	    ERREXIT(cinfo, JERR_INPUT_EMPTY);
 	}
-	WARNMS(cinfo, JWRN_JPEG_EOF);
-	/* Insert fake EOI marker */
-	RB_GC_GUARD(reader->buffer) = rb_str_tmp_new(2);
-	RSTRING_PTR(reader->buffer)[0] = (JOCTET) 0xFF;
-	RSTRING_PTR(reader->buffer)[1] = (JOCTET) JPEG_EOI;
+	return insert_fake_eoi(cinfo);
     }
 
     cinfo->src->next_input_byte = (JOCTET const*)RSTRING_PTR(reader->buffer);
     cinfo->src->bytes_in_buffer = RSTRING_LEN(reader->buffer);
     reader->start_of_file = 0;
+    STATS_ADD(reader, bytes_read, (size_t)RSTRING_LEN(reader->buffer));
+    STATS_ADD(reader, fill_input_buffer_calls, 1);
 
     return TRUE;
 }
@@ -345,12 +623,234 @@ skip_input_data(j_decompress_ptr cinfo, long num_bytes)
     }
 }
 
+/*
+ * In nonblocking mode, libjpeg is always suspended when it needs more
+ * bytes, and the bytes are appended by resume_source outside of libjpeg.
+ */
+static boolean
+fill_input_buffer_nonblock(j_decompress_ptr cinfo)
+{
+    struct jpeg_reader_data* reader;
+
+    assert(cinfo != NULL);
+
+    reader = (struct jpeg_reader_data*)cinfo->client_data;
+    reader->suspended = 1;
+    return FALSE;
+}
+
+static void
+skip_input_data_nonblock(j_decompress_ptr cinfo, long num_bytes)
+{
+    struct jpeg_reader_data* reader;
+    struct jpeg_source_mgr* src;
+
+    assert(cinfo != NULL);
+
+    reader = (struct jpeg_reader_data*)cinfo->client_data;
+    src = cinfo->src;
+    if (num_bytes <= 0)
+	return;
+    if ((size_t)num_bytes > src->bytes_in_buffer) {
+	/* the rest is dropped from the following bytes of the source */
+	reader->skip_bytes = (size_t)num_bytes - src->bytes_in_buffer;
+	src->next_input_byte += src->bytes_in_buffer;
+	src->bytes_in_buffer = 0;
+	return;
+    }
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= (size_t)num_bytes;
+}
+
+static inline int
+suspending_source_p(struct jpeg_reader_data const* reader)
+{
+    return reader->cinfo.src->fill_input_buffer == fill_input_buffer_nonblock;
+}
+
+/* Returns a String, nil at EOF, or :wait_readable or :wait_writable. */
+static VALUE
+read_source_nonblock(struct jpeg_reader_data* reader)
+{
+    VALUE args[2];
+
+    if (!rb_respond_to(reader->source, id_read_nonblock))
+	return rb_funcall(reader->source, id_read, 1, INT2FIX(INPUT_BUFFER_SIZE));
+
+    args[0] = INT2FIX(INPUT_BUFFER_SIZE);
+    args[1] = rb_hash_new();
+    rb_hash_aset(args[1], ID2SYM(id_exception), Qfalse);
+#ifdef HAVE_RB_FUNCALLV_KW
+    return rb_funcallv_kw(reader->source, id_read_nonblock, 2, args, RB_PASS_KEYWORDS);
+#else
+    return rb_funcallv(reader->source, id_read_nonblock, 2, args);
+#endif
+}
+
+/*
+ * Waits by wait_readable or wait_writable of the source, which lets the
+ * Fiber scheduler run other fibers.
+ */
+static void
+wait_source(struct jpeg_reader_data* reader, ID const id)
+{
+    if (rb_respond_to(reader->source, id))
+	rb_funcall(reader->source, id, 0);
+    else if (id == id_wait_writable)
+	rb_thread_fd_writable(rb_image_file_io_descriptor(reader->source));
+    else
+	rb_thread_wait_fd(rb_image_file_io_descriptor(reader->source));
+}
+
+/*
+ * Appends the bytes that are ready in the source to the ones libjpeg left
+ * unread when it was suspended, after waiting for the source if there are
+ * none.  The end of the file is handled as by fill_input_buffer.
+ */
+static void
+resume_source(struct jpeg_reader_data* reader)
+{
+    j_decompress_ptr const cinfo = &reader->cinfo;
+    struct jpeg_source_mgr* const src = cinfo->src;
+    JOCTET const* bytes;
+    size_t length;
+    VALUE result, buffer;
+
+    for (;;) {
+	result = read_source_nonblock(reader);
+	if (result == ID2SYM(id_wait_readable) || result == ID2SYM(id_wait_writable)) {
+	    wait_source(reader, SYM2ID(result));
+	    continue;
+	}
+	if (NIL_P(result))
+	    break;
+	StringValue(result);
+	STATS_ADD(reader, bytes_read, (size_t)RSTRING_LEN(result));
+	STATS_ADD(reader, fill_input_buffer_calls, 1);
+	if ((size_t)RSTRING_LEN(result) > reader->skip_bytes)
+	    break;
+	reader->skip_bytes -= (size_t)RSTRING_LEN(result);
+    }
+
+    if (NIL_P(result)) { /* EOF */
+	if (reader->start_of_file) { /* empty file */
+	    ERREXIT(cinfo, JERR_INPUT_EMPTY);
+	}
+	WARNMS(cinfo, JWRN_JPEG_EOF);
+	bytes = fake_eoi_marker;
+	length = sizeof(fake_eoi_marker);
+    }
+    else {
+	bytes = (JOCTET const*)RSTRING_PTR(result) + reader->skip_bytes;
+	length = (size_t)RSTRING_LEN(result) - reader->skip_bytes;
+    }
+    reader->skip_bytes = 0;
+
+    buffer = rb_str_buf_new((long)(src->bytes_in_buffer + length));
+    rb_str_buf_cat(buffer, (char const*)src->next_input_byte, (long)src->bytes_in_buffer);
+    rb_str_buf_cat(buffer, (char const*)bytes, (long)length);
+    reader->buffer = buffer;
+    src->next_input_byte = (JOCTET const*)RSTRING_PTR(buffer);
+    src->bytes_in_buffer = (size_t)RSTRING_LEN(buffer);
+    reader->start_of_file = 0;
+    reader->suspended = 0;
+    RB_GC_GUARD(result);
+}
+
 void
 term_source(j_decompress_ptr cinfo ARG_UNUSED)
 {
     /* nothing to do */
 }
 
+/* The whole memory block is handed to libjpeg at the first request. */
+static boolean
+fill_input_buffer_from_memory(j_decompress_ptr cinfo)
+{
+    struct jpeg_reader_data* reader;
+
+    assert(cinfo != NULL);
+
+    reader = (struct jpeg_reader_data*)cinfo->client_data;
+    if (!reader->start_of_file)
+	return insert_fake_eoi(cinfo);
+    if (reader->memory_length == 0)
+	ERREXIT(cinfo, JERR_INPUT_EMPTY);
+
+    cinfo->src->next_input_byte = reader->memory;
+    cinfo->src->bytes_in_buffer = reader->memory_length;
+    reader->start_of_file = 0;
+    STATS_ADD(reader, bytes_read, reader->memory_length);
+    STATS_ADD(reader, fill_input_buffer_calls, 1);
+
+    return TRUE;
+}
+
+#ifdef HAVE_PREAD
+static boolean
+fill_input_buffer_from_fd(j_decompress_ptr cinfo)
+{
+    struct jpeg_reader_data* reader;
+    ssize_t len;
+
+    assert(cinfo != NULL);
+
+    reader = (struct jpeg_reader_data*)cinfo->client_data;
+    do {
+	len = pread(reader->fd, reader->file_buffer, FILE_INPUT_BUFFER_SIZE, reader->file_offset);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0)
+	ERREXIT(cinfo, JERR_FILE_READ);
+    if (len == 0) { /* EOF */
+	if (reader->start_of_file) { /* empty file */
+	    ERREXIT(cinfo, JERR_INPUT_EMPTY);
+	}
+	return insert_fake_eoi(cinfo);
+    }
+
+    cinfo->src->next_input_byte = reader->file_buffer;
+    cinfo->src->bytes_in_buffer = (size_t)len;
+    reader->file_offset += len;
+    reader->start_of_file = 0;
+    STATS_ADD(reader, bytes_read, (size_t)len);
+    STATS_ADD(reader, fill_input_buffer_calls, 1);
+
+    return TRUE;
+}
+
+/* Skipped bytes beyond the buffer are never read; only the offset moves. */
+static void
+skip_input_data_from_fd(j_decompress_ptr cinfo, long num_bytes)
+{
+    struct jpeg_reader_data* reader;
+
+    assert(cinfo != NULL);
+
+    reader = (struct jpeg_reader_data*)cinfo->client_data;
+    if (num_bytes <= 0)
+	return;
+
+    if (num_bytes > (long)cinfo->src->bytes_in_buffer) {
+	reader->file_offset += num_bytes - (long)cinfo->src->bytes_in_buffer;
+	cinfo->src->next_input_byte = NULL;
+	cinfo->src->bytes_in_buffer = 0;
+    }
+    else {
+	cinfo->src->next_input_byte += num_bytes;
+	cinfo->src->bytes_in_buffer -= num_bytes;
+    }
+}
+#endif /* HAVE_PREAD */
+
+static void
+set_io_source_callbacks(struct jpeg_reader_data* reader, int const suspending)
+{
+    struct jpeg_source_mgr* const src = reader->cinfo.src;
+    src->fill_input_buffer = suspending ? fill_input_buffer_nonblock : fill_input_buffer;
+    src->skip_input_data = suspending ? skip_input_data_nonblock : skip_input_data;
+}
+
 static void
 init_source_mgr(struct jpeg_reader_data* reader)
 {
@@ -368,24 +868,111 @@ init_source_mgr(struct jpeg_reader_data* reader)
 
     src = (struct jpeg_source_mgr*)reader->cinfo.src;
     src->init_source = init_source;
-    src->fill_input_buffer = fill_input_buffer;
-    src->skip_input_data = skip_input_data;
+    set_io_source_callbacks(reader, reader->nonblock);
     src->resync_to_restart = jpeg_resync_to_restart;
     src->term_source = term_source;
     src->bytes_in_buffer = 0;
     src->next_input_byte = NULL;
+    reader->source_type = SOURCE_IO;
+    reader->skip_bytes = 0;
+    reader->suspended = 0;
+}
+
+static void
+init_memory_source_mgr(struct jpeg_reader_data* reader,
+	enum jpeg_reader_source_type const source_type,
+	JOCTET const* memory, size_t const length)
+{
+    assert(reader != NULL);
+    assert(reader->cinfo.src != NULL);
+
+    reader->memory = memory;
+    reader->memory_length = length;
+    reader->cinfo.src->fill_input_buffer = fill_input_buffer_from_memory;
+    reader->cinfo.src->skip_input_data = skip_input_data;
+    reader->source_type = source_type;
+}
+
+int
+rb_image_file_io_descriptor(VALUE io)
+{
+#ifdef HAVE_RB_IO_DESCRIPTOR
+    return rb_io_descriptor(io);
+#else
+    rb_io_t* fptr;
+    GetOpenFile(io, fptr);
+    return fptr->fd;
+#endif
+}
+
+#ifdef USE_NATIVE_FILE_SOURCE
+/*
+ * Switches the source manager to read the regular file +fd+ directly,
+ * without calling IO#read.  The file is mapped into memory if possible,
+ * or read by pread(2) into a buffer allocated only once.  Other kinds of
+ * files are left to the Ruby IO source manager.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void
+init_file_source_mgr(struct jpeg_reader_data* reader, int const fd)
+{
+    struct jpeg_source_mgr* src;
+    struct stat st;
+
+    assert(reader != NULL);
+    assert(reader->cinfo.src != NULL);
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+	return;
+
+    src = reader->cinfo.src;
+    reader->fd = fd;
+
+#ifdef HAVE_MMAP
+    if (st.st_size > 0 && (uintmax_t)st.st_size <= (uintmax_t)SIZE_MAX) {
+	void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED) {
+# ifdef MADV_SEQUENTIAL
+	    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+# endif
+	    reader->map = (JOCTET*)map;
+	    reader->map_length = (size_t)st.st_size;
+	    init_memory_source_mgr(reader, SOURCE_FILE_MAP, reader->map, reader->map_length);
+	    return;
+	}
+    }
+#endif
+
+#ifdef HAVE_PREAD
+    if (reader->file_buffer == NULL) {
+	reader->file_buffer = (JOCTET*)
+	    (* reader->cinfo.mem->alloc_small)(
+		    (j_common_ptr)&reader->cinfo,
+		    JPOOL_PERMANENT,
+		    FILE_INPUT_BUFFER_SIZE);
+    }
+    reader->file_offset = 0;
+    src->fill_input_buffer = fill_input_buffer_from_fd;
+    src->skip_input_data = skip_input_data_from_fd;
+    reader->source_type = SOURCE_FILE_READ;
+#else
+    reader->fd = -1;
+#endif
 }
+#endif /* USE_NATIVE_FILE_SOURCE */
 
 static VALUE
 jpeg_reader_initialize(VALUE obj, VALUE source)
 {
     struct jpeg_reader_data* reader;
     reader = get_jpeg_reader_data(obj);
+    reader_check_not_busy(reader);
     reader->cinfo.err = init_error_mgr(&reader->error);
+    reader->cinfo.client_data = (void*)reader;
     jpeg_create_decompress(&reader->cinfo);
     init_source_mgr(reader);
     reader->source = source;
-    reader->cinfo.client_data = (void*)obj;
     reader->state = READER_INITIALIZED;
     return obj;
 }
@@ -400,9 +987,97 @@ jpeg_reader_s_open(VALUE klass, VALUE path)
     obj = rb_funcall(klass, id_new, 1, io);
     reader = get_jpeg_reader_data(obj);
     reader->close_source = 1;
+#ifdef USE_NATIVE_FILE_SOURCE
+    init_file_source_mgr(reader, rb_image_file_io_descriptor(io));
+#endif
+
+    return obj;
+}
+
+/*
+ * The reader decodes the bytes of +string+ in place.  An unfrozen string
+ * is replaced by a frozen one sharing the same bytes, so later changes to
+ * +string+ do not affect the reader.
+ */
+static VALUE
+jpeg_reader_s_from_string(VALUE klass, VALUE string)
+{
+    struct jpeg_reader_data* reader;
+    VALUE obj;
+
+    StringValue(string);
+    string = rb_str_new_frozen(string);
+    obj = rb_funcall(klass, id_new, 1, string);
+    reader = get_jpeg_reader_data(obj);
+    init_memory_source_mgr(reader, SOURCE_MEMORY,
+	    (JOCTET const*)RSTRING_PTR(string), (size_t)RSTRING_LEN(string));
+
+    return obj;
+}
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+static VALUE
+unlock_buffer_finalizer(RB_BLOCK_CALL_FUNC_ARGLIST(object_id, buffer))
+{
+    rb_io_buffer_unlock(buffer);
+    return Qnil;
+}
+
+/*
+ * Locks +buffer+ so that freeing or resizing it raises while the reader
+ * decodes its bytes, possibly without the GVL.  If the reader is collected
+ * first, the buffer is unlocked by the finalizer of a private object that
+ * only the reader refers to; the free function can't touch the buffer
+ * because it may be collected in the same GC, and finalizers defined on
+ * the reader itself are left to its users.
+ */
+static void
+reader_lock_buffer(struct jpeg_reader_data* reader, VALUE buffer)
+{
+    VALUE const lock = rb_obj_alloc(rb_cObject);
+    VALUE const finalizer = rb_proc_new(unlock_buffer_finalizer, buffer);
+
+    rb_io_buffer_lock(buffer);
+    rb_define_finalizer(lock, finalizer);
+    reader->buffer_lock = lock;
+}
+
+static void
+reader_unlock_buffer(struct jpeg_reader_data* reader)
+{
+    if (!NIL_P(reader->buffer_lock)) {
+	rb_undefine_finalizer(reader->buffer_lock);
+	reader->buffer_lock = Qnil;
+	rb_io_buffer_unlock(reader->source);
+    }
+}
+
+/*
+ * The reader decodes the bytes of +buffer+ in place.  The buffer is locked
+ * until the reader is reset or collected, so it can't be resized or freed
+ * while the reader is in use.
+ */
+static VALUE
+jpeg_reader_s_from_buffer(VALUE klass, VALUE buffer)
+{
+    struct jpeg_reader_data* reader;
+    void const* base;
+    size_t size;
+    VALUE obj;
+
+    if (!RTEST(rb_obj_is_kind_of(buffer, rb_cIOBuffer)))
+	rb_raise(rb_eTypeError, "wrong argument type %s (expected IO::Buffer)",
+		rb_obj_classname(buffer));
+
+    rb_io_buffer_get_bytes_for_reading(buffer, &base, &size);
+    obj = rb_funcall(klass, id_new, 1, buffer);
+    reader = get_jpeg_reader_data(obj);
+    reader_lock_buffer(reader, buffer);
+    init_memory_source_mgr(reader, SOURCE_MEMORY, (JOCTET const*)base, size);
 
     return obj;
 }
+#endif
 
 static VALUE
 jpeg_reader_source_will_be_closed(VALUE obj)
@@ -419,53 +1094,260 @@ reader_check_initialized(struct jpeg_reader_data* reader)
     if (reader->state < READER_INITIALIZED) {
 	rb_raise(eImageFileJpegReaderError, "reader not initialized");
     }
+    reader_check_not_busy(reader);
 }
 
-static inline void
-read_header(struct jpeg_reader_data* reader)
+static VALUE
+reader_clear_busy(VALUE arg)
 {
-    assert(reader != NULL);
-    reader_check_initialized(reader);
-    if (reader->state < READER_RED_HEADER) {
-	jpeg_read_header(&reader->cinfo, TRUE);
-	reader->state = READER_RED_HEADER;
-    }
+    ((struct jpeg_reader_data*)arg)->busy = 0;
+    return Qnil;
 }
 
+/*
+ * Runs +func+ while the reader is busy.  libjpeg runs on the reader there
+ * without the GVL or calling back into an IO source, so other threads can
+ * run; they get an error instead of touching the decompressor and the
+ * source under it.
+ */
 static VALUE
-jpeg_reader_get_image_width(VALUE obj)
+reader_run_busy(struct jpeg_reader_data* reader, VALUE (*func)(VALUE), VALUE arg)
 {
-    struct jpeg_reader_data* reader;
-    reader = get_jpeg_reader_data(obj);
-    read_header(reader);
-    return ULONG2NUM(reader->cinfo.image_width);
+    reader_check_not_busy(reader);
+    reader->busy = 1;
+    return rb_ensure(func, arg, reader_clear_busy, (VALUE)reader);
 }
 
-static VALUE
-jpeg_reader_get_image_height(VALUE obj)
+static inline void
+reader_check_not_started(struct jpeg_reader_data* reader)
 {
-    struct jpeg_reader_data* reader;
-    reader = get_jpeg_reader_data(obj);
-    read_header(reader);
-    return ULONG2NUM(reader->cinfo.image_height);
+    assert(reader != NULL);
+    if (reader->state >= READER_STARTED_DECOMPRESS) {
+	rb_raise(eImageFileJpegReaderError, "decompression has already been started");
+    }
 }
 
 static VALUE
-jpeg_reader_get_num_components(VALUE obj)
+jpeg_reader_is_nonblock(VALUE obj)
 {
     struct jpeg_reader_data* reader;
     reader = get_jpeg_reader_data(obj);
-    read_header(reader);
-    return LONG2NUM(reader->cinfo.num_components);
+    return reader->nonblock ? Qtrue : Qfalse;
 }
 
+/*
+ * In nonblocking mode, an IO source is read by read_nonblock, and libjpeg
+ * is suspended instead of waiting inside it when no bytes are ready.  The
+ * reader then waits by wait_readable of the source, which lets a Fiber
+ * scheduler run other fibers, and resumes libjpeg where it stopped.  The
+ * bytes are decoded as they arrive, not a full buffer at a time.  Other
+ * sources are not affected.  The mode is kept by reset.
+ */
 static VALUE
-jpeg_reader_get_jpeg_color_space(VALUE obj)
+jpeg_reader_set_nonblock(VALUE obj, VALUE flag)
 {
     struct jpeg_reader_data* reader;
     reader = get_jpeg_reader_data(obj);
-    read_header(reader);
-    return color_space_to_symbol(reader->cinfo.jpeg_color_space);
+    reader_check_initialized(reader);
+    reader_check_not_started(reader);
+    if (reader->suspended)
+	rb_raise(eImageFileJpegReaderError, "reading the header has been suspended");
+
+    reader->nonblock = RTEST(flag) ? 1 : 0;
+    if (reader->source_type == SOURCE_IO
+	    && !(reader->state >= READER_RED_HEADER && reader->cinfo.arith_code))
+	set_io_source_callbacks(reader, reader->nonblock);
+    return flag;
+}
+
+/*
+ * Aborts the decompression and forgets the source, but keeps the
+ * decompressor and its permanent pool, including the source manager and
+ * the pread buffer, for the next source.  The reader must not be busy.
+ */
+static void
+reader_release_source(struct jpeg_reader_data* reader)
+{
+    VALUE const source = reader->source;
+    int const close_source = reader->close_source;
+
+    assert(!reader->busy);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    reader_unlock_buffer(reader);
+#endif
+
+    jpeg_abort_decompress(&reader->cinfo);
+    /* not cleared by libjpeg until the next jpeg_start_decompress */
+    reader->cinfo.output_scanline = 0;
+#ifdef HAVE_MMAP
+    if (reader->map != NULL) {
+	munmap(reader->map, reader->map_length);
+	reader->map = NULL;
+	reader->map_length = 0;
+    }
+#endif
+    reader->source = Qnil;
+    reader->buffer = Qnil;
+    reader->fd = -1;
+    reader->memory = NULL;
+    reader->memory_length = 0;
+    reader->file_offset = 0;
+    reader->band = NULL;
+    reader->pixel_format = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID;
+    reader->stride = 0;
+    reader->close_source = 0;
+    reader->start_of_file = 0;
+    reader->direct_decode = 0;
+    reader->output_started = 0;
+    reader->app1_saved = 0;
+    init_source_mgr(reader);
+    reader->state = READER_INITIALIZED;
+    ++reader->generation;
+
+    if (close_source && rb_respond_to(source, id_close)) {
+	rb_funcall(source, id_close, 0);
+    }
+}
+
+/*
+ * Makes the reader ready to decode +source+ from the beginning, reusing
+ * the decompressor of the previous one.  The previous decompression is
+ * aborted, and the previous source is closed if the reader opened it.
+ *
+ * +source+ is the content of a JPEG file as a String, an IO::Buffer, an
+ * IO, or the path of a file.  Parameters such as scale are reset to the
+ * defaults of the new file when its header is read.  Raises Error while
+ * another thread reads with the reader.
+ */
+static VALUE
+jpeg_reader_reset(VALUE obj, VALUE source)
+{
+    struct jpeg_reader_data* reader;
+    VALUE io = Qnil;
+
+    reader = get_jpeg_reader_data(obj);
+    reader_check_initialized(reader);
+
+    if (jpeg_data_p(source)) {
+	source = rb_str_new_frozen(source);
+    }
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    else if (RTEST(rb_obj_is_kind_of(source, rb_cIOBuffer))) {
+	/* nothing to prepare */
+    }
+#endif
+    else if (!rb_respond_to(source, id_read)
+	    || (!RB_TYPE_P(source, T_FILE) && rb_respond_to(source, id_to_path))) {
+	/* a path; Pathname responds to read too */
+	FilePathValue(source);
+	io = source = rb_file_open_str(source, "rb");
+    }
+
+    /* to_path and opening the file may have let another thread start a decode */
+    if (reader->busy) {
+	if (!NIL_P(io))
+	    rb_io_close(io);
+	reader_check_not_busy(reader);
+    }
+    reader_release_source(reader);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    if (RTEST(rb_obj_is_kind_of(source, rb_cIOBuffer)))
+	reader_lock_buffer(reader, source);
+#endif
+    reader->source = source;
+
+    if (!NIL_P(io)) {
+	reader->close_source = 1;
+#ifdef USE_NATIVE_FILE_SOURCE
+	init_file_source_mgr(reader, rb_image_file_io_descriptor(io));
+#endif
+    }
+    else if (RB_TYPE_P(source, T_STRING)) {
+	init_memory_source_mgr(reader, SOURCE_MEMORY,
+		(JOCTET const*)RSTRING_PTR(source), (size_t)RSTRING_LEN(source));
+    }
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    else if (RTEST(rb_obj_is_kind_of(source, rb_cIOBuffer))) {
+	void const* base;
+	size_t size;
+	rb_io_buffer_get_bytes_for_reading(source, &base, &size);
+	init_memory_source_mgr(reader, SOURCE_MEMORY, (JOCTET const*)base, size);
+    }
+#endif
+
+    return obj;
+}
+
+static VALUE
+read_header_0(VALUE arg)
+{
+    struct jpeg_reader_data* reader = (struct jpeg_reader_data*)arg;
+    uint64_t const start = stats_clock();
+
+    while (jpeg_read_header(&reader->cinfo, TRUE) == JPEG_SUSPENDED)
+	resume_source(reader);
+    /* the arithmetic decoder of libjpeg can't be suspended */
+    if (reader->cinfo.arith_code && suspending_source_p(reader))
+	set_io_source_callbacks(reader, 0);
+    reader->state = READER_RED_HEADER;
+    STATS_ADD(reader, header_nsec, stats_clock() - start);
+    stats_merge(reader);
+    return Qnil;
+}
+
+static inline void
+read_header(struct jpeg_reader_data* reader)
+{
+    assert(reader != NULL);
+    reader_check_initialized(reader);
+    if (reader->state < READER_RED_HEADER)
+	reader_run_busy(reader, read_header_0, (VALUE)reader);
+}
+
+static VALUE
+jpeg_reader_get_image_width(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    return ULONG2NUM(reader->cinfo.image_width);
+}
+
+static VALUE
+jpeg_reader_get_image_height(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    return ULONG2NUM(reader->cinfo.image_height);
+}
+
+static VALUE
+jpeg_reader_get_num_components(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    return LONG2NUM(reader->cinfo.num_components);
+}
+
+/* The number of MCUs in a restart interval, or 0 without restart markers. */
+static VALUE
+jpeg_reader_get_restart_interval(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    return UINT2NUM(reader->cinfo.restart_interval);
+}
+
+static VALUE
+jpeg_reader_get_jpeg_color_space(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    return color_space_to_symbol(reader->cinfo.jpeg_color_space);
 }
 
 static VALUE
@@ -532,6 +1414,17 @@ jpeg_reader_is_buffered_image(VALUE obj)
     return reader->cinfo.buffered_image ? Qtrue : Qfalse;
 }
 
+static VALUE
+jpeg_reader_set_buffered_image(VALUE obj, VALUE flag)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    reader_check_not_started(reader);
+    reader->cinfo.buffered_image = RTEST(flag) ? TRUE : FALSE;
+    return flag;
+}
+
 static VALUE
 jpeg_reader_get_dct_method(VALUE obj)
 {
@@ -541,6 +1434,58 @@ jpeg_reader_get_dct_method(VALUE obj)
     return dct_method_to_symbol(reader->cinfo.dct_method);
 }
 
+static VALUE
+jpeg_reader_set_dct_method(VALUE obj, VALUE dct_method)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    reader_check_not_started(reader);
+    Check_Type(dct_method, T_SYMBOL);
+    reader->cinfo.dct_method = symbol_to_dct_method(dct_method);
+    return dct_method;
+}
+
+static VALUE
+jpeg_reader_is_do_fancy_upsampling(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    return reader->cinfo.do_fancy_upsampling ? Qtrue : Qfalse;
+}
+
+static VALUE
+jpeg_reader_set_do_fancy_upsampling(VALUE obj, VALUE flag)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    reader_check_not_started(reader);
+    reader->cinfo.do_fancy_upsampling = RTEST(flag) ? TRUE : FALSE;
+    return flag;
+}
+
+static VALUE
+jpeg_reader_is_do_block_smoothing(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    return reader->cinfo.do_block_smoothing ? Qtrue : Qfalse;
+}
+
+static VALUE
+jpeg_reader_set_do_block_smoothing(VALUE obj, VALUE flag)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    read_header(reader);
+    reader_check_not_started(reader);
+    reader->cinfo.do_block_smoothing = RTEST(flag) ? TRUE : FALSE;
+    return flag;
+}
+
 static VALUE
 jpeg_reader_is_quantize_colors(VALUE obj)
 {
@@ -596,81 +1541,92 @@ jpeg_reader_get_output_components(VALUE obj)
     return INT2NUM(reader->cinfo.output_components);
 }
 
-static inline void
-start_decompress(struct jpeg_reader_data* reader)
+static VALUE
+stats_to_hash(struct jpeg_reader_stats const* stats)
 {
-    assert(reader != NULL);
-    if (reader->state < READER_STARTED_DECOMPRESS) {
-	read_header(reader);
-	jpeg_start_decompress(&reader->cinfo);
-	reader->state = READER_STARTED_DECOMPRESS;
-    }
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(id_bytes_read), SIZET2NUM(stats->bytes_read));
+    rb_hash_aset(hash, ID2SYM(id_fill_input_buffer_calls), SIZET2NUM(stats->fill_input_buffer_calls));
+    rb_hash_aset(hash, ID2SYM(id_header_time), DBL2NUM(stats->header_nsec / 1e9));
+    rb_hash_aset(hash, ID2SYM(id_decompress_time), DBL2NUM(stats->decompress_nsec / 1e9));
+    rb_hash_aset(hash, ID2SYM(id_convert_time), DBL2NUM(stats->convert_nsec / 1e9));
+    rb_hash_aset(hash, ID2SYM(id_scanlines), SIZET2NUM(stats->scanlines));
+    rb_hash_aset(hash, ID2SYM(id_scanline_batches), SIZET2NUM(stats->scanline_batches));
+    rb_hash_aset(hash, ID2SYM(id_scanlines_per_batch), DBL2NUM(stats->scanline_batches > 0
+		? (double)stats->scanlines / stats->scanline_batches : 0.0));
+    rb_hash_aset(hash, ID2SYM(id_peak_buffer_size), SIZET2NUM(stats->peak_buffer_size));
+    return hash;
+}
+
+/*
+ * Returns the counters of the reader since it was created, as a hash of
+ * :bytes_read, :fill_input_buffer_calls, :header_time, :decompress_time,
+ * :convert_time (in seconds), :scanlines, :scanline_batches,
+ * :scanlines_per_batch and :peak_buffer_size (in bytes).  The time of
+ * the conversion of pixels and of resampling for fit is not included in
+ * :decompress_time.
+ */
+static VALUE
+jpeg_reader_get_stats(VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    reader = get_jpeg_reader_data(obj);
+    return stats_to_hash(&reader->stats);
 }
 
-static inline uint32_t
-cmyk_to_rgb24(JSAMPROW cmyk)
+/*
+ * Returns the sums of the counters of all readers, including those of
+ * ImageFile.decode_batch, since the last reset_stats.  :peak_buffer_size
+ * is the largest of them.
+ */
+static VALUE
+jpeg_reader_s_get_stats(VALUE klass ARG_UNUSED)
 {
-    double const c = cmyk[0]/255;
-    double const m = cmyk[1]/255;
-    double const y = cmyk[2]/255;
-    double const k = cmyk[3]/255;
-    double const r = c*(1 - k) + k;
-    double const g = m*(1 - k) + k;
-    double const b = y*(1 - k) + k;
-    return ((uint32_t)(r*255) << 16) | ((uint32_t)(g*255) << 8) | ((uint32_t)(b*255));
+    struct jpeg_reader_stats stats = global_stats;
+    return stats_to_hash(&stats);
 }
 
-static inline uint16_t
-cmyk_to_rgb16_565(JSAMPROW cmyk)
+static VALUE
+jpeg_reader_s_reset_stats(VALUE klass ARG_UNUSED)
 {
-    double const c = cmyk[0]/255;
-    double const m = cmyk[1]/255;
-    double const y = cmyk[2]/255;
-    double const k = cmyk[3]/255;
-    double const r = c*(1 - k) + k;
-    double const g = m*(1 - k) + k;
-    double const b = y*(1 - k) + k;
-    return ((uint16_t)(r*31) << 11) | ((uint16_t)(g*63) << 6) | ((uint16_t)(b*31));
+    MEMZERO(&global_stats, struct jpeg_reader_stats, 1);
+    return Qnil;
 }
 
+/*
+ * The alpha of ARGB32, which is also written into the unused byte of RGB24
+ * as libjpeg-turbo does in the direct decode.
+ */
+#define OPAQUE_ALPHA 0xFF000000U
+
 static void
 convert_scanlines_from_CMYK(
-	VALUE image_buffer, JSAMPARRAY rows,
-	long const sl_beg, long const sl_end,
+	char* const image_buffer, JSAMPARRAY rows, long const nrows,
 	rb_image_file_image_pixel_format_t const pixel_format,
-	long const width, long const stride)
+	long const width, long const stride, int const inverted)
 {
     long i, j;
-    JSAMPROW src;
 
-    assert(TYPE(image_buffer) == T_STRING);
+    assert(image_buffer != NULL);
     assert(rows != NULL);
-    assert(sl_beg < sl_end);
+    assert(nrows > 0);
     assert(pixel_format != RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID);
 
     switch (pixel_format) {
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32:
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24:
-	    for (i = sl_beg; i < sl_end; ++i) {
-		uint32_t* dst = (uint32_t*)(RSTRING_PTR(image_buffer) + i*stride*4);
-		src = rows[i];
-		for (j = 0; j < width; ++j) {
-		    uint32_t const pixel = cmyk_to_rgb24(src + 4*j);
-		    *dst++ = pixel;
-		}
-		while (j++ < stride) *dst++ = 0;
+	    for (i = 0; i < nrows; ++i) {
+		uint32_t* dst = (uint32_t*)(image_buffer + i*stride*4);
+		rb_image_file_pixel_converter.cmyk_to_xrgb32(rows[i], dst, width, OPAQUE_ALPHA, inverted);
+		for (j = width; j < stride; ++j) dst[j] = 0;
 	    }
 	    break;
 
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565:
-	    for (i = sl_beg; i < sl_end; ++i) {
-		uint16_t* dst = (uint16_t*)(RSTRING_PTR(image_buffer) + i*stride*2);
-		src = rows[i];
-		for (j = 0; j < width; ++j) {
-		    uint16_t const pixel = cmyk_to_rgb16_565(src + 4*j);
-		    *dst++ = pixel;
-		}
-		while (j++ < stride) *dst++ = 0;
+	    for (i = 0; i < nrows; ++i) {
+		uint16_t* dst = (uint16_t*)(image_buffer + i*stride*2);
+		rb_image_file_pixel_converter.cmyk_to_rgb16_565(rows[i], dst, width, inverted);
+		for (j = width; j < stride; ++j) dst[j] = 0;
 	    }
 	    break;
 
@@ -682,44 +1638,76 @@ convert_scanlines_from_CMYK(
 
 static void
 convert_scanlines_from_RGB(
-	VALUE image_buffer, JSAMPARRAY rows,
-	long const sl_beg, long const sl_end,
+	char* const image_buffer, JSAMPARRAY rows, long const nrows,
+	rb_image_file_image_pixel_format_t const pixel_format,
+	long const width, long const stride)
+{
+    long i, j;
+
+    assert(image_buffer != NULL);
+    assert(rows != NULL);
+    assert(nrows > 0);
+    assert(pixel_format != RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID);
+
+    switch (pixel_format) {
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32:
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24:
+	    for (i = 0; i < nrows; ++i) {
+		uint32_t* dst = (uint32_t*)(image_buffer + i*stride*4);
+		rb_image_file_pixel_converter.rgb_to_xrgb32(rows[i], dst, width, OPAQUE_ALPHA);
+		for (j = width; j < stride; ++j) dst[j] = 0;
+	    }
+	    break;
+
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565:
+	    for (i = 0; i < nrows; ++i) {
+		uint16_t* dst = (uint16_t*)(image_buffer + i*stride*2);
+		rb_image_file_pixel_converter.rgb_to_rgb16_565(rows[i], dst, width);
+		for (j = width; j < stride; ++j) dst[j] = 0;
+	    }
+	    break;
+
+	default:
+	    rb_bug("invalid pixel format");
+	    break;
+    }
+}
+
+static void
+convert_scanlines_from_GRAYSCALE(
+	char* const image_buffer, JSAMPARRAY rows, long const nrows,
 	rb_image_file_image_pixel_format_t const pixel_format,
 	long const width, long const stride)
 {
     long i, j;
     JSAMPROW src;
 
-    assert(TYPE(image_buffer) == T_STRING);
+    assert(image_buffer != NULL);
     assert(rows != NULL);
-    assert(sl_beg < sl_end);
+    assert(nrows > 0);
     assert(pixel_format != RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID);
 
     switch (pixel_format) {
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32:
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24:
-	    for (i = sl_beg; i < sl_end; ++i) {
-		uint32_t* dst = (uint32_t*)(RSTRING_PTR(image_buffer) + i*stride*4);
+	    for (i = 0; i < nrows; ++i) {
+		uint32_t* dst = (uint32_t*)(image_buffer + i*stride*4);
 		src = rows[i];
 		for (j = 0; j < width; ++j) {
-		    uint32_t pixel = (uint32_t)(*src++) << 16;
-		    pixel |= (uint32_t)(*src++) << 8;
-		    pixel |= *src++;
-		    *dst++ = pixel;
+		    uint32_t const y = *src++;
+		    *dst++ = (y << 16) | (y << 8) | y | OPAQUE_ALPHA;
 		}
 		while (j++ < stride) *dst++ = 0;
 	    }
 	    break;
 
 	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565:
-	    for (i = sl_beg; i < sl_end; ++i) {
-		uint16_t* dst = (uint16_t*)(RSTRING_PTR(image_buffer) + i*stride*2);
+	    for (i = 0; i < nrows; ++i) {
+		uint16_t* dst = (uint16_t*)(image_buffer + i*stride*2);
 		src = rows[i];
 		for (j = 0; j < width; ++j) {
-		    uint16_t pixel = (uint16_t)(*src++ >> 3) << 11;
-		    pixel |= (uint16_t)(*src++ >> 2) << 5;
-		    pixel |= *src++ >> 3;
-		    *dst++ = pixel;
+		    uint16_t const y = *src++;
+		    *dst++ = (uint16_t)(((y >> 3) << 11) | ((y >> 2) << 5) | (y >> 3));
 		}
 		while (j++ < stride) *dst++ = 0;
 	    }
@@ -731,6 +1719,113 @@ convert_scanlines_from_RGB(
     }
 }
 
+/*
+ * Makes libjpeg write scanlines in the layout of +pf+ if it can convert
+ * the color space of the file to it.  Otherwise the scanlines are decoded
+ * into the sample band and converted.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void
+select_out_color_space(struct jpeg_reader_data* reader, rb_image_file_image_pixel_format_t const pf)
+{
+    J_COLOR_SPACE jcs = JCS_UNKNOWN;
+
+    switch (reader->cinfo.jpeg_color_space) {
+	case JCS_GRAYSCALE:
+	case JCS_YCbCr:
+	case JCS_RGB:
+	    jcs = image_pixel_format_to_j_color_space(pf);
+	    break;
+
+	default:
+	    break;
+    }
+
+    reader->direct_decode = (JCS_UNKNOWN != jcs);
+    if (reader->direct_decode) {
+	reader->cinfo.out_color_space = jcs;
+#ifdef HAVE_CONST_JCS_RGB565
+	/* libjpeg-turbo dithers RGB565 unless dithering is disabled */
+	if (JCS_RGB565 == jcs)
+	    reader->cinfo.dither_mode = JDITHER_NONE;
+#endif
+    }
+    jpeg_calc_output_dimensions(&reader->cinfo);
+}
+
+static rb_image_file_image_pixel_format_t
+default_pixel_format(struct jpeg_reader_data* reader)
+{
+    rb_image_file_image_pixel_format_t pf;
+
+    pf = j_color_space_to_image_pixel_format(reader->cinfo.out_color_space);
+    if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID == pf
+	    && reader->cinfo.out_color_space == JCS_CMYK)
+	pf = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24;
+    return pf;
+}
+
+/*
+ * Trades some quality for a faster decode: the fast integer DCT, and
+ * neither fancy upsampling nor block smoothing.
+ */
+static void
+set_fast_decode(j_decompress_ptr cinfo)
+{
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->do_block_smoothing = FALSE;
+}
+
+static void
+check_into(VALUE into)
+{
+    if (!RTEST(rb_obj_is_kind_of(into, cImageFileImage)))
+	rb_raise(rb_eTypeError, "wrong argument type %s (expected ImageFile::Image)",
+		rb_obj_classname(into));
+}
+
+static VALUE
+into_pixel_format(VALUE into)
+{
+    check_into(into);
+    return rb_funcall(into, id_pixel_format, 0);
+}
+
+/*
+ * Creates an image from the parameters of Image.new, or reshapes +into+
+ * to them if it is given.  The buffer of +into+ is reused as it is; it
+ * must be large enough for the new shape.  Without :row_stride, the
+ * current row-stride of +into+ is kept if it is still wide enough.
+ */
+static VALUE
+new_image(VALUE params, VALUE into)
+{
+    rb_image_file_image_pixel_format_t pf;
+    VALUE stride;
+    long wd, ht, st;
+
+    if (NIL_P(into))
+	return rb_funcall(cImageFileImage, id_new, 1, params);
+
+    check_into(into);
+    pf = rb_image_file_image_symbol_to_pixel_format(rb_hash_lookup(params, ID2SYM(id_pixel_format)));
+    wd = NUM2LONG(rb_hash_lookup(params, ID2SYM(id_width)));
+    ht = NUM2LONG(rb_hash_lookup(params, ID2SYM(id_height)));
+    stride = rb_hash_lookup(params, ID2SYM(id_row_stride));
+    st = NIL_P(stride) ? NUM2LONG(rb_funcall(into, id_row_stride, 0)) : NUM2LONG(stride);
+    if (st < wd)
+	st = wd;
+
+    if (!rb_image_file_image_reshape(into, pf, wd, ht, st))
+	rb_raise(rb_eArgError, "the buffer of the image is too small for %ldx%ld pixels", wd, ht);
+    /* the buffer may be shared with the string given to Image.new */
+    rb_str_modify(rb_image_file_image_get_buffer(into));
+
+    return into;
+}
+
 static void
 process_arguments_of_read_image(int argc, VALUE* argv, struct jpeg_reader_data* reader,
 	VALUE* params_ptr,
@@ -743,23 +1838,34 @@ process_arguments_of_read_image(int argc, VALUE* argv, struct jpeg_reader_data*
     VALUE params, width, height;
     VALUE pixel_format = Qnil;
     VALUE stride = Qnil;
+    VALUE quality = Qnil;
+    VALUE into = Qnil;
 
     rb_image_file_image_pixel_format_t pf;
     long st;
 
     assert(reader != NULL);
-    assert(reader->state < READER_STARTED_DECOMPRESS);
+
+    reader_check_not_started(reader);
 
     rb_scan_args(argc, argv, "01", &params);
     if (TYPE(params) == T_HASH) {
 	pixel_format = rb_hash_lookup(params, ID2SYM(id_pixel_format));
 	stride = rb_hash_lookup(params, ID2SYM(id_row_stride));
+	quality = rb_hash_lookup(params, ID2SYM(id_quality));
+	into = rb_hash_lookup(params, ID2SYM(id_into));
+	params = rb_hash_dup(params);
     }
     else {
-	rb_warning("invalid arguments are ignored.");
+	if (!NIL_P(params))
+	    rb_warning("invalid arguments are ignored.");
 	params = rb_hash_new();
     }
 
+    /* the image to be reused keeps its pixel format by default */
+    if (!NIL_P(into) && NIL_P(pixel_format))
+	pixel_format = into_pixel_format(into);
+
     if (!NIL_P(pixel_format) && TYPE(pixel_format) != T_SYMBOL) {
 	rb_warning("pixel_format is not a symbol.");
 	pixel_format = Qnil;
@@ -771,13 +1877,6 @@ process_arguments_of_read_image(int argc, VALUE* argv, struct jpeg_reader_data*
 	    rb_warning("invalid pixel_format (%s), use default instead.", StringValueCStr(str));
 	    pixel_format = Qnil;
 	}
-	else {
-	    J_COLOR_SPACE const jcs = image_pixel_format_to_j_color_space(pf);
-	    if (JCS_UNKNOWN == jcs)
-		rb_warning("unknown pixel format, use default instead.");
-	    else
-		reader->cinfo.out_color_space = jcs;
-	}
     }
 
     if (!NIL_P(stride) && TYPE(stride) != T_FIXNUM && TYPE(stride) != T_BIGNUM) {
@@ -785,17 +1884,27 @@ process_arguments_of_read_image(int argc, VALUE* argv, struct jpeg_reader_data*
 	stride = Qnil;
     }
 
-    start_decompress(reader);
+    if (!NIL_P(quality) && TYPE(quality) != T_SYMBOL) {
+	rb_warning("quality is not a symbol.");
+	quality = Qnil;
+    }
+    if (!NIL_P(quality) && SYM2ID(quality) != id_fast && SYM2ID(quality) != id_default) {
+	VALUE str = rb_id2str(SYM2ID(quality));
+	rb_warning("invalid quality (%s), use default instead.", StringValueCStr(str));
+	quality = Qnil;
+    }
+
+    read_header(reader);
+    if (!NIL_P(quality) && SYM2ID(quality) == id_fast)
+	set_fast_decode(&reader->cinfo);
+    calc_output_dimensions(reader);
 
     if (NIL_P(pixel_format)) {
-	pf = j_color_space_to_image_pixel_format(reader->cinfo.out_color_space);
+	pf = default_pixel_format(reader);
 	if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID == pf) {
-	    if (reader->cinfo.out_color_space != JCS_CMYK) {
-		char const* jcs_name = j_color_space_name(reader->cinfo.out_color_space);
-		rb_raise(eImageFileJpegReaderError,
-			"unsupported output color space (%s)", jcs_name);
-	    }
-	    pf = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24;
+	    char const* jcs_name = j_color_space_name(reader->cinfo.out_color_space);
+	    rb_raise(eImageFileJpegReaderError,
+		    "unsupported output color space (%s)", jcs_name);
 	}
 	rb_hash_aset(params, ID2SYM(id_pixel_format),
 		rb_image_file_image_pixel_format_to_symbol(pf));
@@ -821,6 +1930,8 @@ process_arguments_of_read_image(int argc, VALUE* argv, struct jpeg_reader_data*
 	st = (long)reader->cinfo.output_width;
     rb_hash_aset(params, ID2SYM(id_row_stride), stride);
 
+    select_out_color_space(reader, pf);
+
     *params_ptr = params;
     *pixel_format_ptr = pf;
     *width_ptr = (long)reader->cinfo.output_width;
@@ -828,75 +1939,1748 @@ process_arguments_of_read_image(int argc, VALUE* argv, struct jpeg_reader_data*
     *stride_ptr = st;
 }
 
-static VALUE
-jpeg_reader_read_image(int argc, VALUE* argv, VALUE obj)
-{
+struct decompress_args {
     struct jpeg_reader_data* reader;
-    VALUE params, image, image_buffer;
-    rb_image_file_image_pixel_format_t pf;
-    long wd, ht, st, i, nc;
-
-    VALUE row_buffer;
-    VALUE sample_buffer;
-    JSAMPARRAY rows;
-
-    reader = get_jpeg_reader_data(obj);
-
-    process_arguments_of_read_image(argc, argv, reader, &params, &pf, &wd, &ht, &st);
-    assert(reader->state >= READER_STARTED_DECOMPRESS);
-
-    image = rb_funcall(cImageFileImage, id_new, 1, params);
-    image_buffer = rb_image_file_image_get_buffer(image);
+    char* image_buffer;		/* destination of the scanline first_row */
+    rb_image_file_image_pixel_format_t pixel_format;
+    long width;
+    long stride;
+    long first_row;
+    long end_row;
+    long x_offset;		/* columns of a decoded row left of the image */
+    int crop;
+    int progressive;		/* one output pass per call in buffered-image mode */
+    int volatile interrupted;
+    int completed;
+    uint64_t convert_nsec;	/* spent in the conversion during a call */
+};
 
-    RB_GC_GUARD(row_buffer) = rb_str_tmp_new(sizeof(JSAMPROW)*ht);
-    rows = (JSAMPARRAY)(RSTRING_PTR(row_buffer));
+static inline long
+read_band(struct jpeg_reader_data* reader, long const nrows)
+{
+    long const n = (long)jpeg_read_scanlines(&reader->cinfo, reader->band, (JDIMENSION)nrows);
+    STATS_ADD(reader, scanlines, (size_t)n);
+    STATS_ADD(reader, scanline_batches, 1);
+    return n;
+}
 
-    nc = (long)reader->cinfo.output_components;
-    RB_GC_GUARD(sample_buffer) = rb_str_tmp_new(sizeof(JSAMPLE)*ht*wd*nc);
-    for (i = 0; i < ht; ++i)
-	rows[i] = (JSAMPROW)(RSTRING_PTR(sample_buffer) + i*wd*nc);
+static void
+convert_scanlines(struct decompress_args* args, char* dst, JSAMPARRAY rows, long const nrows)
+{
+    j_decompress_ptr const cinfo = &args->reader->cinfo;
 
-    while ((long)reader->cinfo.output_scanline < ht) {
-	long sl_beg, sl_end;
+    switch (cinfo->out_color_space) {
+	case JCS_GRAYSCALE:
+	    convert_scanlines_from_GRAYSCALE(dst, rows, nrows,
+		    args->pixel_format, args->width, args->stride);
+	    break;
+	case JCS_RGB:
+	    convert_scanlines_from_RGB(dst, rows, nrows,
+		    args->pixel_format, args->width, args->stride);
+	    break;
+	case JCS_CMYK:
+	    convert_scanlines_from_CMYK(dst, rows, nrows,
+		    args->pixel_format, args->width, args->stride,
+		    cinfo->saw_Adobe_marker);
+	    break;
+	default:
+	    break;
+    }
+}
 
-	sl_beg = reader->cinfo.output_scanline;
-	jpeg_read_scanlines(
-		&reader->cinfo,
-		rows + reader->cinfo.output_scanline,
-		(JDIMENSION)ht - reader->cinfo.output_scanline);
-	sl_end = reader->cinfo.output_scanline;
+/*
+ * Copies or converts the columns of a cropped decode that belong to the
+ * image.  Direct color spaces already hold pixels of the image format.
+ */
+static void
+crop_scanlines(struct decompress_args* args, char* dst, long const nrows)
+{
+    struct jpeg_reader_data* reader = args->reader;
+    long const bpp = pixel_format_size(args->pixel_format);
+    long i;
+
+    for (i = 0; i < nrows; ++i) {
+	char* d = dst + i*args->stride*bpp;
+	if (reader->direct_decode) {
+	    memcpy(d, reader->band[i] + args->x_offset*bpp, args->width*bpp);
+	    memset(d + args->width*bpp, 0, (args->stride - args->width)*bpp);
+	}
+	else {
+	    JSAMPROW row = reader->band[i] + args->x_offset*reader->cinfo.output_components;
+	    convert_scanlines(args, d, &row, 1);
+	}
+    }
+}
 
-	switch (reader->cinfo.out_color_space) {
-	    case JCS_RGB:
-		convert_scanlines_from_RGB(image_buffer, rows, sl_beg, sl_end, pf, wd, st);
-		break;
-	    case JCS_CMYK:
-		convert_scanlines_from_CMYK(image_buffer, rows, sl_beg, sl_end, pf, wd, st);
-		break;
-	    default:
-		break;
+static size_t
+band_size(struct jpeg_reader_data* reader, int const crop)
+{
+    j_decompress_ptr const cinfo = &reader->cinfo;
+    if (reader->direct_decode && !crop)
+	return sizeof(JSAMPROW) * cinfo->rec_outbuf_height;
+    return sizeof(JSAMPLE) * cinfo->output_width * cinfo->output_components
+	* cinfo->rec_outbuf_height;
+}
+
+/*
+ * Decompresses scanlines up to args->end_row through the sample band of
+ * the reader, which holds only rec_outbuf_height rows.
+ */
+static void
+decompress_scanlines_0(struct decompress_args* args)
+{
+    struct jpeg_reader_data* reader = args->reader;
+    j_decompress_ptr const cinfo = &reader->cinfo;
+    long const bpp = pixel_format_size(args->pixel_format);
+
+    if (reader->state < READER_STARTED_DECOMPRESS) {
+	if (!jpeg_start_decompress(cinfo))
+	    return;	/* suspended */
+	if (args->crop) {
+#ifdef HAVE_JPEG_CROP_SCANLINE
+	    /* one more column on each side keeps the upsampling of the edge
+	     * columns the same as in the full image */
+	    long const left = args->x_offset > 0 ? args->x_offset - 1 : 0;
+	    long right = args->x_offset + args->width + 1;
+	    JDIMENSION x, w;
+	    if (right > (long)cinfo->output_width)
+		right = (long)cinfo->output_width;
+	    x = (JDIMENSION)left;
+	    w = (JDIMENSION)(right - left);
+	    jpeg_crop_scanline(cinfo, &x, &w);
+	    args->x_offset -= (long)x;
+#endif
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+	    /* jpeg_skip_scanlines doesn't support a suspending source */
+	    if (!suspending_source_p(reader))
+		jpeg_skip_scanlines(cinfo, (JDIMENSION)args->first_row);
+#endif
+	}
+	if (reader->direct_decode && !args->crop && args->first_row == 0) {
+	    /* only row pointers into the image buffer */
+	    reader->band = (JSAMPARRAY)(* cinfo->mem->alloc_small)(
+		    (j_common_ptr)cinfo, JPOOL_IMAGE,
+		    sizeof(JSAMPROW) * cinfo->rec_outbuf_height);
+	}
+	else {
+	    reader->band = (* cinfo->mem->alloc_sarray)(
+		    (j_common_ptr)cinfo, JPOOL_IMAGE,
+		    cinfo->output_width * cinfo->output_components,
+		    (JDIMENSION)cinfo->rec_outbuf_height);
+	}
+	stats_update_peak_buffer_size(reader, band_size(reader, args->crop || args->first_row > 0)
+		+ (reader->source_type == SOURCE_FILE_READ ? FILE_INPUT_BUFFER_SIZE : 0));
+	reader->state = READER_STARTED_DECOMPRESS;
+    }
+
+    if (cinfo->buffered_image && !reader->output_started) {
+	if (!args->progressive) {
+	    /* only the final output pass */
+	    while (!jpeg_input_complete(cinfo)
+		    && jpeg_consume_input(cinfo) != JPEG_SUSPENDED)
+		;
+	    if (!jpeg_input_complete(cinfo))
+		return;	/* suspended */
+	}
+	if (!jpeg_start_output(cinfo, cinfo->input_scan_number))
+	    return;
+	reader->output_started = 1;
+    }
+
+    while ((long)cinfo->output_scanline < args->end_row) {
+	long const row = (long)cinfo->output_scanline;
+	long nrows = args->end_row - row;
+	char* dst;
+	uint64_t start;
+	long i;
+
+	if (args->interrupted || reader->suspended)
+	    return;
+
+	if (nrows > cinfo->rec_outbuf_height)
+	    nrows = cinfo->rec_outbuf_height;
+
+	if (row < args->first_row) {
+	    /* skip the rows above the image without jpeg_skip_scanlines; the
+	     * sample band is allocated for them even in a direct decode */
+	    if (nrows > args->first_row - row)
+		nrows = args->first_row - row;
+	    read_band(reader, nrows);
+	    continue;
+	}
+
+	dst = args->image_buffer + (row - args->first_row)*args->stride*bpp;
+
+	if (args->crop) {
+	    nrows = read_band(reader, nrows);
+	    start = stats_clock();
+	    crop_scanlines(args, dst, nrows);
+	    args->convert_nsec += stats_clock() - start;
+	    continue;
+	}
+
+	if (reader->direct_decode) {
+	    long const pad = (args->stride - args->width)*bpp;
+	    for (i = 0; i < nrows; ++i)
+		reader->band[i] = (JSAMPROW)(dst + i*args->stride*bpp);
+	    nrows = read_band(reader, nrows);
+	    if (pad > 0) {
+		for (i = 0; i < nrows; ++i)
+		    memset(reader->band[i] + args->width*bpp, 0, pad);
+	    }
+	    continue;
+	}
+
+	nrows = read_band(reader, nrows);
+	if (nrows == 0)
+	    continue;
+	start = stats_clock();
+	convert_scanlines(args, dst, reader->band, nrows);
+	args->convert_nsec += stats_clock() - start;
+    }
+
+    if (cinfo->output_scanline >= cinfo->output_height) {
+	if (cinfo->buffered_image && reader->output_started) {
+	    if (!jpeg_finish_output(cinfo))
+		return;
+	    reader->output_started = 0;
+	}
+	if (!cinfo->buffered_image || jpeg_input_complete(cinfo)) {
+	    if (!jpeg_finish_decompress(cinfo))
+		return;
+	    reader->band = NULL;
+	    reader->state = READER_FINISHED_DECOMPRESS;
+	}
+    }
+    else if (args->crop) {
+	/* the rows below a cropped image are never decoded */
+	jpeg_abort_decompress(cinfo);
+	reader->band = NULL;
+	reader->state = READER_FINISHED_DECOMPRESS;
+    }
+    args->completed = 1;
+}
+
+/* This function must not call any Ruby API; it may run without the GVL. */
+static void
+decompress_scanlines(struct decompress_args* args)
+{
+    uint64_t const start = stats_clock();
+
+    args->convert_nsec = 0;
+    decompress_scanlines_0(args);
+    STATS_ADD(args->reader, convert_nsec, args->convert_nsec);
+    STATS_ADD(args->reader, decompress_nsec, stats_clock() - start - args->convert_nsec);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+decompress_without_gvl(void* ptr)
+{
+    struct decompress_args* args = (struct decompress_args*)ptr;
+    struct jpeg_reader_data* reader = args->reader;
+
+    reader->without_gvl = 1;
+    if (setjmp(reader->jmpbuf) == 0)
+	decompress_scanlines(args);
+    else
+	args->interrupted = -1;
+    reader->without_gvl = 0;
+
+    return NULL;
+}
+
+static void
+interrupt_decompress(void* ptr)
+{
+    struct decompress_args* args = (struct decompress_args*)ptr;
+    args->interrupted = 1;
+}
+#endif
+
+/*
+ * Native sources never call back into Ruby, so they are decompressed
+ * without the GVL.  A pending interrupt stops decompression between
+ * scanlines; it is resumed if the interrupt did not raise.  An IO source
+ * in nonblocking mode is resumed whenever libjpeg is suspended.
+ */
+static VALUE
+decompress_0(VALUE arg)
+{
+    struct decompress_args* args = (struct decompress_args*)arg;
+    struct jpeg_reader_data* reader = args->reader;
+
+    args->completed = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (reader->source_type != SOURCE_IO) {
+	while (!args->completed) {
+	    args->interrupted = 0;
+	    rb_thread_call_without_gvl(decompress_without_gvl, args, interrupt_decompress, args);
+	    if (args->interrupted < 0)
+		rb_raise(eImageFileJpegReaderError, "%s", reader->error_message);
+	    rb_thread_check_ints();
 	}
+	stats_merge(reader);
+	return Qnil;
+    }
+#endif
+    decompress_scanlines(args);
+    while (!args->completed && reader->suspended) {
+	resume_source(reader);
+	decompress_scanlines(args);
+    }
+    stats_merge(reader);
+    return Qnil;
+}
+
+static void
+decompress(struct decompress_args* args)
+{
+    reader_run_busy(args->reader, decompress_0, (VALUE)args);
+}
+
+/* Decompresses the scanlines that fill +image+ from the current one. */
+static void
+decompress_into_image(struct jpeg_reader_data* reader, VALUE image, long const nrows)
+{
+    struct decompress_args args;
+
+    args.reader = reader;
+    args.image_buffer = RSTRING_PTR(rb_image_file_image_get_buffer(image));
+    args.pixel_format = reader->pixel_format;
+    args.width = (long)reader->cinfo.output_width;
+    args.stride = reader->stride;
+    args.first_row = (long)reader->cinfo.output_scanline;
+    args.end_row = args.first_row + nrows;
+    args.x_offset = 0;
+    args.crop = 0;
+    args.progressive = 0;
+    args.interrupted = 0;
+    decompress(&args);
+
+    RB_GC_GUARD(image);
+}
+
+/*
+ * Processes the parameters of read_image, and creates an image of +nrows+
+ * scanlines whose pixel format and row-stride are used by the following
+ * scanline reads.
+ */
+static VALUE
+prepare_decompress(int argc, VALUE* argv, struct jpeg_reader_data* reader, long nrows)
+{
+    VALUE params, image;
+    rb_image_file_image_pixel_format_t pf;
+    long wd, ht, st;
+
+    process_arguments_of_read_image(argc, argv, reader, &params, &pf, &wd, &ht, &st);
+    if (nrows > 0 && nrows < ht)
+	rb_hash_aset(params, ID2SYM(id_height), LONG2NUM(nrows));
+
+    image = new_image(params, rb_hash_lookup(params, ID2SYM(id_into)));
+    reader->pixel_format = pf;
+    reader->stride = NUM2LONG(rb_funcall(image, id_row_stride, 0));
+
+    return image;
+}
+
+static VALUE
+new_band_image(struct jpeg_reader_data* reader, long const nrows, VALUE into)
+{
+    VALUE params = rb_hash_new();
+    rb_hash_aset(params, ID2SYM(id_pixel_format),
+	    rb_image_file_image_pixel_format_to_symbol(reader->pixel_format));
+    rb_hash_aset(params, ID2SYM(id_width), UINT2NUM(reader->cinfo.output_width));
+    rb_hash_aset(params, ID2SYM(id_height), LONG2NUM(nrows));
+    rb_hash_aset(params, ID2SYM(id_row_stride), LONG2NUM(reader->stride));
+    return new_image(params, into);
+}
+
+static inline long
+remaining_scanlines(struct jpeg_reader_data* reader)
+{
+    return (long)reader->cinfo.output_height - (long)reader->cinfo.output_scanline;
+}
+
+/*
+ * Chooses the largest reduction of libjpeg's scaling whose output is not
+ * smaller than +width+ x +height+.
+ */
+static void
+select_scale_to_fit(struct jpeg_reader_data* reader, long const width, long const height)
+{
+    j_decompress_ptr cinfo = &reader->cinfo;
+    unsigned int num;
+
+    for (num = 1; num <= 8; ++num) {
+	cinfo->scale_num = num;
+	cinfo->scale_denom = 8;
+	jpeg_calc_output_dimensions(cinfo);
+	if ((long)cinfo->output_width >= width && (long)cinfo->output_height >= height)
+	    return;
+    }
+    cinfo->scale_num = cinfo->scale_denom = 1;
+    jpeg_calc_output_dimensions(cinfo);
+}
+
+static long
+fit_bound(VALUE bound)
+{
+    long n;
+    if (NIL_P(bound))
+	return 0;
+    n = NUM2LONG(bound);
+    if (n <= 0)
+	rb_raise(rb_eArgError, "zero or negative size to fit");
+    return n;
+}
+
+/*
+ * Reads the image scaled down, keeping the aspect ratio, to fit in
+ * +fit_width+ x +fit_height+; a bound of 0 means no limit.  The image is
+ * decoded at the smallest DCT scale that is still large enough, and then
+ * downscaled to the final size by area averaging.
+ */
+static VALUE
+read_image_to_fit(struct jpeg_reader_data* reader, VALUE params,
+	long const fit_width, long const fit_height)
+{
+    VALUE decode_params, stride, into, image, decoded;
+    double ratio = 1.0;
+    uint64_t start;
+    long width, height;
+
+    reader_check_not_started(reader);
+    read_header(reader);
+
+    width = (long)reader->cinfo.image_width;
+    height = (long)reader->cinfo.image_height;
+    if (fit_width > 0 && fit_width < width)
+	ratio = (double)fit_width / width;
+    if (fit_height > 0 && fit_height < height && (double)fit_height / height < ratio)
+	ratio = (double)fit_height / height;
+    if (ratio < 1.0) {
+	width = (long)(width * ratio + 0.5);
+	height = (long)(height * ratio + 0.5);
+	if (width < 1) width = 1;
+	if (height < 1) height = 1;
+    }
+    select_scale_to_fit(reader, width, height);
+
+    decode_params = rb_hash_dup(params);
+    rb_hash_delete(decode_params, ID2SYM(id_fit));
+    if ((long)reader->cinfo.output_width == width && (long)reader->cinfo.output_height == height) {
+	image = prepare_decompress(1, &decode_params, reader, 0);
+	decompress_into_image(reader, image, height);
+	return image;
+    }
+
+    stride = rb_hash_delete(decode_params, ID2SYM(id_row_stride));
+    /* only the downscaled image goes into the given one */
+    into = rb_hash_delete(decode_params, ID2SYM(id_into));
+    if (!NIL_P(into) && NIL_P(rb_hash_lookup(decode_params, ID2SYM(id_pixel_format))))
+	rb_hash_aset(decode_params, ID2SYM(id_pixel_format), into_pixel_format(into));
+    decoded = prepare_decompress(1, &decode_params, reader, 0);
+    decompress_into_image(reader, decoded, (long)reader->cinfo.output_height);
+
+    params = rb_hash_new();
+    rb_hash_aset(params, ID2SYM(id_pixel_format),
+	    rb_image_file_image_pixel_format_to_symbol(reader->pixel_format));
+    rb_hash_aset(params, ID2SYM(id_width), LONG2NUM(width));
+    rb_hash_aset(params, ID2SYM(id_height), LONG2NUM(height));
+    rb_hash_aset(params, ID2SYM(id_row_stride), stride);
+    image = new_image(params, into);
+
+    /* the decoded image and the intermediate image of the resampler */
+    stats_update_peak_buffer_size(reader,
+	    (size_t)RSTRING_LEN(rb_image_file_image_get_buffer(decoded))
+	    + (size_t)width * 4 * reader->cinfo.output_height);
+    start = stats_clock();
+    rb_image_file_resize(
+	    RSTRING_PTR(rb_image_file_image_get_buffer(decoded)),
+	    (long)reader->cinfo.output_width, (long)reader->cinfo.output_height, reader->stride,
+	    RSTRING_PTR(rb_image_file_image_get_buffer(image)),
+	    width, height, NUM2LONG(rb_funcall(image, id_row_stride, 0)),
+	    reader->pixel_format, RB_IMAGE_FILE_RESIZE_FILTER_BOX, 1);
+    STATS_ADD(reader, convert_nsec, stats_clock() - start);
+    stats_merge(reader);
+
+    RB_GC_GUARD(decoded);
+    return image;
+}
+
+/*
+ * Reads only the +region+, [x, y, width, height] in output coordinates.
+ * With libjpeg-turbo, the rows above the region are skipped and only the
+ * iMCU columns covering it are decoded; decoding stops after its last row.
+ */
+static VALUE
+read_image_region(struct jpeg_reader_data* reader, VALUE params, VALUE region)
+{
+    struct decompress_args args;
+    VALUE decode_params, stride, image;
+    rb_image_file_image_pixel_format_t pf;
+    long x, y, wd, ht, st, output_width, output_height;
+
+    region = rb_convert_type(region, T_ARRAY, "Array", "to_ary");
+    if (RARRAY_LEN(region) != 4)
+	rb_raise(rb_eArgError, "region must be [x, y, width, height]");
+    x = NUM2LONG(RARRAY_PTR(region)[0]);
+    y = NUM2LONG(RARRAY_PTR(region)[1]);
+    wd = NUM2LONG(RARRAY_PTR(region)[2]);
+    ht = NUM2LONG(RARRAY_PTR(region)[3]);
+
+    decode_params = rb_hash_dup(params);
+    rb_hash_delete(decode_params, ID2SYM(id_region));
+    stride = rb_hash_delete(decode_params, ID2SYM(id_row_stride));
+    process_arguments_of_read_image(1, &decode_params, reader, &params,
+	    &pf, &output_width, &output_height, &st);
+
+    if (x < 0 || y < 0 || wd <= 0 || ht <= 0
+	    || x + wd > output_width || y + ht > output_height)
+	rb_raise(rb_eArgError, "region out of the image");
+
+    if (!NIL_P(stride)) {
+	st = NUM2LONG(stride);
+	if (st < wd) {
+	    rb_warning("stride less than the region width.");
+	    stride = Qnil;
+	}
+    }
+    rb_hash_aset(params, ID2SYM(id_width), LONG2NUM(wd));
+    rb_hash_aset(params, ID2SYM(id_height), LONG2NUM(ht));
+    rb_hash_aset(params, ID2SYM(id_row_stride), stride);
+    image = new_image(params, rb_hash_lookup(params, ID2SYM(id_into)));
+    reader->pixel_format = pf;
+    reader->stride = NUM2LONG(rb_funcall(image, id_row_stride, 0));
+    /* libjpeg-turbo crops and skips only in the single-pass mode */
+    reader->cinfo.buffered_image = FALSE;
+
+    args.reader = reader;
+    args.image_buffer = RSTRING_PTR(rb_image_file_image_get_buffer(image));
+    args.pixel_format = pf;
+    args.width = wd;
+    args.stride = reader->stride;
+    args.first_row = y;
+    args.end_row = y + ht;
+    args.x_offset = x;
+    args.crop = 1;
+    args.progressive = 0;
+    args.interrupted = 0;
+    decompress(&args);
+
+    RB_GC_GUARD(image);
+    return image;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#define MAX_RESTART_SEGMENTS 64
+
+/* Warnings are dropped because worker threads cannot call Ruby. */
+static void
+discard_message(j_common_ptr cinfo ARG_UNUSED)
+{
+}
+
+/*
+ * Parallel decoding of a single-scan image with restart markers.  The
+ * entropy decoder starts afresh after every restart marker, so the scan
+ * can be cut at any restart interval that begins an MCU row.  Each
+ * segment of MCU rows is decoded by its own decompressor from a stream
+ * made of the headers of the file, with the image height changed, and the
+ * restart intervals of the segment, with their markers renumbered from
+ * RST0.  The segments write their rows directly into the image.
+ *
+ * A segment is decoded with at least one MCU row above and below it,
+ * which are discarded, so that the upsampling of its edge rows sees the
+ * same neighbors as in a sequential decode.
+ */
+
+struct restart_index {
+    JOCTET const* data;
+    size_t length;
+    size_t header_length;	/* up to the end of the SOS segment */
+    size_t sof_height_offset;
+    size_t scan_end;		/* offset of the marker after the scan */
+    size_t* markers;		/* offsets of the restart markers */
+    long num_markers;
+    long num_intervals;
+    long interval;		/* MCUs in a restart interval */
+    long mcus_per_row;
+    long mcu_rows;
+    long mcu_height;		/* in pixels of the file */
+    long output_mcu_height;	/* in output scanlines */
+};
+
+struct restart_segment {
+    struct jpeg_reader_data reader;
+    struct decompress_args args;
+    JOCTET* data;
+    size_t length;
+    long first_interval;
+    long end_interval;
+    long image_height;		/* of the stream of the segment */
+    int failed;
+};
+
+struct restart_decode {
+    struct jpeg_reader_data* reader;
+    struct restart_index index;
+    long const* starts;		/* the first MCU rows of the segments */
+    struct restart_segment* segments;
+    long num_segments;
+    char* buffer;
+    int threads;
+};
+
+/*
+ * Finds the end of the headers, which is the end of the SOS segment, and
+ * the height in the SOF segment.  Returns zero if they are not found.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static int
+parse_restart_headers(struct restart_index* index)
+{
+    JOCTET const* const p = index->data;
+    size_t const n = index->length;
+    size_t i = 2;
+
+    index->sof_height_offset = 0;
+    if (n < 4 || p[0] != 0xFF || p[1] != 0xD8)
+	return 0;
+
+    while (i < n && p[i] == 0xFF) {
+	int marker;
+	size_t len;
+
+	while (i < n && p[i] == 0xFF)
+	    ++i;
+	if (i + 3 > n)
+	    return 0;
+	marker = p[i++];
+	if ((JPEG_RST0 <= marker && marker <= JPEG_RST0 + 7) || marker == 0x01)
+	    continue;
+	len = ((size_t)p[i] << 8) | p[i + 1];
+	if (len < 2 || i + len > n)
+	    return 0;
+	/* SOF0 to SOF15 except DHT, JPG and DAC */
+	if ((marker & 0xF0) == 0xC0 && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+	    if (len < 7)
+		return 0;
+	    index->sof_height_offset = i + 3;
+	}
+	i += len;
+	if (marker == 0xDA) {
+	    index->header_length = i;
+	    return index->sof_height_offset != 0;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Records the offsets of the restart markers of the scan, which must come
+ * in the order of their numbers.  The scan ends at any other marker.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void*
+index_restart_markers(void* ptr)
+{
+    struct restart_index* index = (struct restart_index*)ptr;
+    JOCTET const* const p = index->data;
+    size_t const n = index->length;
+    size_t i = index->header_length;
+    long k = 0;
+
+    while (i + 1 < n) {
+	JOCTET const* q = memchr(p + i, 0xFF, n - i - 1);
+	int marker;
+	if (q == NULL) {
+	    i = n;
+	    break;
+	}
+	i = (size_t)(q - p);
+	marker = p[i + 1];
+	if (marker == 0x00) {	/* stuffed byte */
+	    i += 2;
+	    continue;
+	}
+	if (marker == 0xFF) {	/* fill byte */
+	    i += 1;
+	    continue;
+	}
+	if (marker != JPEG_RST0 + (k & 7) || k >= index->num_intervals - 1)
+	    break;
+	index->markers[k++] = i;
+	i += 2;
+    }
+    index->scan_end = i < n ? i : n;
+    index->num_markers = k;
+
+    return NULL;
+}
+
+static inline size_t
+restart_interval_start(struct restart_index const* index, long const m)
+{
+    return m == 0 ? index->header_length : index->markers[m - 1] + 2;
+}
+
+static inline size_t
+restart_interval_end(struct restart_index const* index, long const m)
+{
+    return m == index->num_intervals ? index->scan_end : index->markers[m - 1];
+}
+
+/* This function doesn't use any Ruby API. */
+static void
+build_segment_stream(struct restart_index const* index, struct restart_segment* segment)
+{
+    size_t const begin = restart_interval_start(index, segment->first_interval);
+    size_t const end = restart_interval_end(index, segment->end_interval);
+    JOCTET* d = segment->data;
+    long m;
+
+    memcpy(d, index->data, index->header_length);
+    d[index->sof_height_offset] = (JOCTET)(segment->image_height >> 8);
+    d[index->sof_height_offset + 1] = (JOCTET)(segment->image_height & 0xFF);
+    d += index->header_length;
+
+    memcpy(d, index->data + begin, end - begin);
+    for (m = segment->first_interval; m + 1 < segment->end_interval; ++m)
+	d[index->markers[m] - begin + 1] = (JOCTET)(JPEG_RST0 + ((m - segment->first_interval) & 7));
+    d += end - begin;
+
+    d[0] = 0xFF;
+    d[1] = JPEG_EOI;
+    segment->length = (size_t)(d + 2 - segment->data);
+}
+
+static void
+decode_restart_segment(void* ptr, long const i)
+{
+    struct restart_decode* decode = (struct restart_decode*)ptr;
+    struct restart_segment* segment = &decode->segments[i];
+    struct jpeg_reader_data* reader = &segment->reader;
+    j_decompress_ptr const src = &decode->reader->cinfo;
+    j_decompress_ptr const cinfo = &reader->cinfo;
+
+    if (segment->failed || segment->args.completed || segment->args.interrupted)
+	return;
+    if (setjmp(reader->jmpbuf) != 0) {
+	segment->failed = 1;
+	return;
+    }
+
+    if (reader->state < READER_RED_HEADER) {
+	uint64_t const start = stats_clock();
+	build_segment_stream(&decode->index, segment);
+	init_memory_source_mgr(reader, SOURCE_MEMORY, segment->data, segment->length);
+	jpeg_read_header(cinfo, TRUE);
+	reader->state = READER_RED_HEADER;
+	STATS_ADD(reader, header_nsec, stats_clock() - start);
+
+	cinfo->scale_num = src->scale_num;
+	cinfo->scale_denom = src->scale_denom;
+	cinfo->output_gamma = src->output_gamma;
+	cinfo->dct_method = src->dct_method;
+	cinfo->do_fancy_upsampling = src->do_fancy_upsampling;
+	cinfo->do_block_smoothing = src->do_block_smoothing;
+	cinfo->out_color_space = src->out_color_space;
+	cinfo->dither_mode = src->dither_mode;
+	reader->direct_decode = decode->reader->direct_decode;
+	jpeg_calc_output_dimensions(cinfo);
+    }
+
+    decompress_scanlines(&segment->args);
+}
+
+static void*
+decode_restart_segments_without_gvl(void* ptr)
+{
+    struct restart_decode* decode = (struct restart_decode*)ptr;
+    rb_image_file_parallel_for(decode->num_segments, decode->threads, decode_restart_segment, decode);
+    return NULL;
+}
+
+static void
+interrupt_restart_segments(void* ptr)
+{
+    struct restart_decode* decode = (struct restart_decode*)ptr;
+    long i;
+    for (i = 0; i < decode->num_segments; ++i)
+	decode->segments[i].args.interrupted = 1;
+}
+
+/* The last MCU row at or above +row+ that begins a restart interval. */
+static long
+restart_row_at_or_above(struct restart_index const* index, long row)
+{
+    while (row > 0 && row * index->mcus_per_row % index->interval != 0)
+	--row;
+    return row;
+}
+
+static void
+create_segment_reader(struct jpeg_reader_data* reader)
+{
+    reader->cinfo.err = init_error_mgr(&reader->error);
+    reader->error.output_message = discard_message;
+    reader->cinfo.client_data = (void*)reader;
+    reader->source = Qnil;
+    reader->buffer = Qnil;
+    reader->fd = -1;
+    reader->without_gvl = 1;
+    if (setjmp(reader->jmpbuf) != 0)
+	rb_raise(eImageFileJpegReaderError, "%s", reader->error_message);
+
+    jpeg_create_decompress(&reader->cinfo);
+    init_source_mgr(reader);
+    reader->state = READER_INITIALIZED;
+}
+
+static void
+setup_restart_segment(struct restart_decode* decode, long const i)
+{
+    struct jpeg_reader_data* const reader = decode->reader;
+    j_decompress_ptr const cinfo = &reader->cinfo;
+    struct restart_index const* index = &decode->index;
+    struct restart_segment* segment = &decode->segments[i];
+    struct jpeg_reader_data* segment_reader = &segment->reader;
+    long const rows = index->mcu_rows;
+    long const first = decode->starts[i];
+    long const end = i + 1 < decode->num_segments ? decode->starts[i + 1] : rows;
+    /* one more MCU row above and below for the upsampling of the edges */
+    long const top = first > 0 ? restart_row_at_or_above(index, first - 1) : 0;
+    long const bottom = end < rows ? end + 1 : rows;
+    long const omh = index->output_mcu_height;
+    long const total_mcus = index->mcus_per_row * rows;
+    long available, end_row;
+
+    segment->first_interval = top * index->mcus_per_row / index->interval;
+    segment->end_interval = (bottom * index->mcus_per_row + index->interval - 1) / index->interval;
+    if (segment->end_interval > index->num_intervals)
+	segment->end_interval = index->num_intervals;
+    available = segment->end_interval * index->interval;
+    available = (available < total_mcus ? available : total_mcus) / index->mcus_per_row - top;
+    segment->image_height = available * index->mcu_height;
+    if (segment->image_height > (long)cinfo->image_height - top * index->mcu_height)
+	segment->image_height = (long)cinfo->image_height - top * index->mcu_height;
+    segment->data = ALLOC_N(JOCTET, index->header_length + 2
+	    + restart_interval_end(index, segment->end_interval)
+	    - restart_interval_start(index, segment->first_interval));
+
+    create_segment_reader(segment_reader);
+
+    end_row = end * omh < (long)cinfo->output_height ? end * omh : (long)cinfo->output_height;
+    segment->args.reader = segment_reader;
+    segment->args.image_buffer = decode->buffer + first * omh * reader->stride * pixel_format_size(reader->pixel_format);
+    segment->args.pixel_format = reader->pixel_format;
+    segment->args.width = (long)cinfo->output_width;
+    segment->args.stride = reader->stride;
+    segment->args.first_row = (first - top) * omh;
+    segment->args.end_row = end_row - top * omh;
+    segment->args.x_offset = 0;
+    segment->args.crop = 0;
+    segment->args.progressive = 0;
+    segment->args.interrupted = 0;
+    segment->args.completed = 0;
+}
+
+/*
+ * An interrupt stops the segments between scanlines; they are resumed if
+ * the interrupt did not raise.
+ */
+static VALUE
+run_restart_decode(VALUE arg)
+{
+    struct restart_decode* decode = (struct restart_decode*)arg;
+    struct jpeg_reader_data* reader = decode->reader;
+    size_t peak = 0;
+    long i;
+
+    decode->index.markers = ALLOC_N(size_t, decode->index.num_intervals - 1);
+    rb_thread_call_without_gvl(index_restart_markers, &decode->index, RUBY_UBF_PROCESS, NULL);
+    if (decode->index.num_markers != decode->index.num_intervals - 1)
+	return Qfalse;	/* a truncated or broken scan is left to the sequential decode */
+
+    decode->segments = ALLOC_N(struct restart_segment, decode->num_segments);
+    MEMZERO(decode->segments, struct restart_segment, decode->num_segments);
+    for (i = 0; i < decode->num_segments; ++i)
+	setup_restart_segment(decode, i);
+
+    for (;;) {
+	int done = 1;
+	for (i = 0; i < decode->num_segments; ++i)
+	    decode->segments[i].args.interrupted = 0;
+	rb_thread_call_without_gvl(decode_restart_segments_without_gvl, decode,
+		interrupt_restart_segments, decode);
+	rb_thread_check_ints();
+	for (i = 0; i < decode->num_segments; ++i) {
+	    struct restart_segment const* segment = &decode->segments[i];
+	    if (!segment->failed && !segment->args.completed)
+		done = 0;
+	}
+	if (done)
+	    break;
+    }
+
+    for (i = 0; i < decode->num_segments; ++i) {
+	struct restart_segment const* segment = &decode->segments[i];
+	struct jpeg_reader_stats const* stats = &segment->reader.stats;
+	if (segment->failed)
+	    rb_raise(eImageFileJpegReaderError, "%s", segment->reader.error_message);
+	reader->stats.bytes_read += stats->bytes_read;
+	reader->stats.fill_input_buffer_calls += stats->fill_input_buffer_calls;
+	reader->stats.header_nsec += stats->header_nsec;
+	reader->stats.decompress_nsec += stats->decompress_nsec;
+	reader->stats.convert_nsec += stats->convert_nsec;
+	reader->stats.scanlines += stats->scanlines;
+	reader->stats.scanline_batches += stats->scanline_batches;
+	peak += segment->length + stats->peak_buffer_size;
+    }
+    stats_update_peak_buffer_size(reader, peak);
+    stats_merge(reader);
+
+    return Qtrue;
+}
+
+static VALUE
+cleanup_restart_decode(VALUE arg)
+{
+    struct restart_decode* decode = (struct restart_decode*)arg;
+    long i;
+
+    decode->reader->busy = 0;
+    if (decode->segments != NULL) {
+	for (i = 0; i < decode->num_segments; ++i) {
+	    jpeg_destroy_decompress(&decode->segments[i].reader.cinfo);
+	    xfree(decode->segments[i].data);
+	}
+	xfree(decode->segments);
+    }
+    xfree(decode->index.markers);
+
+    return Qnil;
+}
+
+/*
+ * Finds the size of the MCUs and the restart intervals of the scan, and
+ * returns zero if the image cannot be decoded in segments.
+ */
+static int
+setup_restart_index(struct jpeg_reader_data* reader, struct restart_index* index)
+{
+    j_decompress_ptr const cinfo = &reader->cinfo;
+    long mcu_width, total;
+#if JPEG_LIB_VERSION >= 70
+    long const scaled_size = (long)cinfo->min_DCT_v_scaled_size;
+#else
+    long const scaled_size = (long)cinfo->min_DCT_scaled_size;
+#endif
+
+    if (reader->memory == NULL || cinfo->restart_interval == 0
+	    || cinfo->progressive_mode || cinfo->buffered_image || cinfo->quantize_colors
+	    || cinfo->comps_in_scan != cinfo->num_components
+	    || cinfo->output_scanline != 0)
+	return 0;
+
+    if (cinfo->comps_in_scan == 1) {
+	jpeg_component_info const* comp = cinfo->cur_comp_info[0];
+	if (cinfo->max_h_samp_factor % comp->h_samp_factor != 0
+		|| cinfo->max_v_samp_factor % comp->v_samp_factor != 0)
+	    return 0;
+	mcu_width = DCTSIZE * (cinfo->max_h_samp_factor / comp->h_samp_factor);
+	index->mcu_height = DCTSIZE * (cinfo->max_v_samp_factor / comp->v_samp_factor);
     }
+    else {
+	mcu_width = DCTSIZE * cinfo->max_h_samp_factor;
+	index->mcu_height = DCTSIZE * cinfo->max_v_samp_factor;
+    }
+    if (index->mcu_height * scaled_size % DCTSIZE != 0)
+	return 0;
+    index->output_mcu_height = index->mcu_height * scaled_size / DCTSIZE;
+
+    index->data = reader->memory;
+    index->length = reader->memory_length;
+    index->interval = (long)cinfo->restart_interval;
+    index->mcus_per_row = ((long)cinfo->image_width + mcu_width - 1) / mcu_width;
+    index->mcu_rows = ((long)cinfo->image_height + index->mcu_height - 1) / index->mcu_height;
+    total = index->mcus_per_row * index->mcu_rows;
+    index->num_intervals = (total + index->interval - 1) / index->interval;
+    index->num_markers = 0;
+    index->markers = NULL;
+    if (index->num_intervals < 2 || !parse_restart_headers(index))
+	return 0;
+
+    return 1;
+}
 
-    jpeg_finish_decompress(&reader->cinfo);
+/*
+ * Decodes the image into +image+ in up to +threads+ segments at once if
+ * it has restart markers that allow it.  Returns zero without consuming
+ * the input otherwise.
+ */
+static int
+decompress_with_restarts(struct jpeg_reader_data* reader, VALUE image, int const threads)
+{
+    struct restart_decode decode;
+    long starts[MAX_RESTART_SEGMENTS];
+    long i, n;
+
+    if (threads < 2 || !setup_restart_index(reader, &decode.index))
+	return 0;
+
+    /* every segment needs a restart interval of its own to start from */
+    starts[0] = 0;
+    n = 1;
+    for (i = 1; i < threads && i < MAX_RESTART_SEGMENTS; ++i) {
+	long const row = decode.index.mcu_rows * i / threads;
+	long const top = restart_row_at_or_above(&decode.index, row - 1);
+	long const previous_top = n > 1 ? restart_row_at_or_above(&decode.index, starts[n - 1] - 1) : 0;
+	if (row > starts[n - 1] && top > previous_top)
+	    starts[n++] = row;
+    }
+    if (n < 2)
+	return 0;
+
+    decode.reader = reader;
+    decode.starts = starts;
+    decode.num_segments = n;
+    decode.segments = NULL;
+    decode.threads = threads;
+    decode.buffer = RSTRING_PTR(rb_image_file_image_get_buffer(image));
+    reader_check_not_busy(reader);
+    reader->busy = 1;
+    if (!RTEST(rb_ensure(run_restart_decode, (VALUE)&decode, cleanup_restart_decode, (VALUE)&decode)))
+	return 0;
+
+    jpeg_abort_decompress(&reader->cinfo);
     reader->state = READER_FINISHED_DECOMPRESS;
+    RB_GC_GUARD(image);
+    return 1;
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+/*
+ * Reads the whole image.  With :into, the pixels are written into the
+ * given image, which is reshaped to the output size instead of a new one
+ * being allocated; its pixel format is used unless :pixel_format is given.
+ * With :threads, a baseline image read from memory or a mapped file that
+ * has restart markers is decoded in that many parts at once.
+ */
+static VALUE
+jpeg_reader_read_image(int argc, VALUE* argv, VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    VALUE image, params, fit, region, threads;
+    int nthreads = 1;
+
+    reader = get_jpeg_reader_data(obj);
+
+    rb_scan_args(argc, argv, "01", &params);
+    if (TYPE(params) == T_HASH && !NIL_P(region = rb_hash_lookup(params, ID2SYM(id_region)))) {
+	if (!NIL_P(rb_hash_lookup(params, ID2SYM(id_fit))))
+	    rb_raise(rb_eArgError, "region and fit cannot be given together");
+	return read_image_region(reader, params, region);
+    }
+    if (TYPE(params) == T_HASH && !NIL_P(fit = rb_hash_lookup(params, ID2SYM(id_fit)))) {
+	fit = rb_convert_type(fit, T_ARRAY, "Array", "to_ary");
+	if (RARRAY_LEN(fit) != 2)
+	    rb_raise(rb_eArgError, "fit must be [width, height]");
+	return read_image_to_fit(reader, params,
+		fit_bound(RARRAY_PTR(fit)[0]), fit_bound(RARRAY_PTR(fit)[1]));
+    }
+
+    if (TYPE(params) == T_HASH && !NIL_P(threads = rb_hash_lookup(params, ID2SYM(id_threads)))) {
+	nthreads = NUM2INT(threads);
+	if (nthreads < 1)
+	    rb_raise(rb_eArgError, "threads must be positive");
+    }
+
+    image = prepare_decompress(argc, argv, reader, 0);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (!decompress_with_restarts(reader, image, nthreads))
+#endif
+	decompress_into_image(reader, image, (long)reader->cinfo.output_height);
+    assert(reader->state >= READER_FINISHED_DECOMPRESS);
+
+    return image;
+}
+
+/*
+ * Reads a thumbnail that fits in :max_width x :max_height, at least one of
+ * which must be given.  Other parameters are the same as read_image's.
+ */
+static VALUE
+jpeg_reader_read_thumbnail(VALUE obj, VALUE params)
+{
+    struct jpeg_reader_data* reader;
+    long max_width, max_height;
+
+    Check_Type(params, T_HASH);
+    max_width = fit_bound(rb_hash_lookup(params, ID2SYM(id_max_width)));
+    max_height = fit_bound(rb_hash_lookup(params, ID2SYM(id_max_height)));
+    if (max_width == 0 && max_height == 0)
+	rb_raise(rb_eArgError, "max_width or max_height is required");
+
+    params = rb_hash_dup(params);
+    rb_hash_delete(params, ID2SYM(id_max_width));
+    rb_hash_delete(params, ID2SYM(id_max_height));
+
+    reader = get_jpeg_reader_data(obj);
+    return read_image_to_fit(reader, params, max_width, max_height);
+}
+
+/*
+ * Finds the JPEG thumbnail of IFD1 in an Exif segment.  Returns 0 if there
+ * is none, or it doesn't fit in the segment.
+ */
+static int
+find_exif_thumbnail(JOCTET const* data, size_t const length,
+	JOCTET const** thumbnail, size_t* thumbnail_length)
+{
+    JOCTET const* tiff = data + 6;
+    size_t const n = length - 6;
+    size_t ifd, count, i, offset = 0, size = 0;
+    int big_endian;
+
+    if (length < 6 + 8 || memcmp(data, "Exif\0\0", 6) != 0)
+	return 0;
+    if (tiff[0] == 'M' && tiff[1] == 'M')
+	big_endian = 1;
+    else if (tiff[0] == 'I' && tiff[1] == 'I')
+	big_endian = 0;
+    else
+	return 0;
+
+    /* IFD1 follows the entries of IFD0 */
+    ifd = exif_get32(tiff + 4, big_endian);
+    if (ifd > n - 2 - 4)
+	return 0;
+    count = exif_get16(tiff + ifd, big_endian);
+    if (count > (n - ifd - 2 - 4) / 12)
+	return 0;
+    ifd = exif_get32(tiff + ifd + 2 + 12*count, big_endian);
+    if (ifd == 0 || ifd > n - 2)
+	return 0;
+
+    count = exif_get16(tiff + ifd, big_endian);
+    for (i = 0; i < count && ifd + 2 + 12*(i + 1) <= n; ++i) {
+	JOCTET const* entry = tiff + ifd + 2 + 12*i;
+	switch (exif_get16(entry, big_endian)) {
+	  case 0x0201:	/* JPEGInterchangeFormat */
+	    offset = exif_get32(entry + 8, big_endian);
+	    break;
+	  case 0x0202:	/* JPEGInterchangeFormatLength */
+	    size = exif_get32(entry + 8, big_endian);
+	    break;
+	}
+    }
+    if (offset == 0 || size < 4 || offset > n || size > n - offset)
+	return 0;
+    if (tiff[offset] != 0xFF || tiff[offset + 1] != 0xD8)
+	return 0;
+
+    *thumbnail = tiff + offset;
+    *thumbnail_length = size;
+    return 1;
+}
+
+/*
+ * Finds the JPEG thumbnail in the APP1 segments before the first SOS of
+ * the file in +data+, as probe.c walks the markers.
+ */
+static int
+find_exif_thumbnail_in_file(JOCTET const* data, size_t const length,
+	JOCTET const** thumbnail, size_t* thumbnail_length)
+{
+    size_t offset = 2;
+
+    if (length < 2 || data[0] != 0xFF || data[1] != 0xD8)
+	return 0;
+    while (offset + 4 <= length) {
+	unsigned int marker;
+	size_t size;
+
+	if (data[offset] != 0xFF)
+	    return 0;
+	marker = data[offset + 1];
+	if (marker == 0xFF) {	/* fill byte */
+	    ++offset;
+	    continue;
+	}
+	if (marker == 0xDA || marker == 0xD9)	/* SOS, EOI */
+	    return 0;
+	size = ((size_t)data[offset + 2] << 8) | data[offset + 3];
+	if (size < 2 || size > length - offset - 2)
+	    return 0;
+	if (marker == JPEG_APP0 + 1
+		&& find_exif_thumbnail(data + offset + 4, size - 2, thumbnail, thumbnail_length))
+	    return 1;
+	offset += 2 + size;
+    }
+    return 0;
+}
+
+static VALUE
+read_header_saving_app1(VALUE arg)
+{
+    struct jpeg_reader_data* reader = (struct jpeg_reader_data*)arg;
+
+    jpeg_save_markers(&reader->cinfo, JPEG_APP0 + 1, 0xFFFF);
+    read_header(reader);
+    reader->app1_saved = 1;
+    return Qnil;
+}
+
+static VALUE
+stop_saving_app1(VALUE arg)
+{
+    struct jpeg_reader_data* reader = (struct jpeg_reader_data*)arg;
+
+    jpeg_save_markers(&reader->cinfo, JPEG_APP0 + 1, 0);
+    return Qnil;
+}
+
+/*
+ * Reads the thumbnail embedded in the Exif segment of the file, which
+ * cameras usually store as a small JPEG of about 160x120, without
+ * decoding the image itself.  Only the header of the file is read.
+ * Returns nil if there is no thumbnail.  The parameters are the same as
+ * read_image's.
+ *
+ * The Exif segment is found in the bytes of a String, an IO::Buffer or a
+ * mapped file.  Otherwise it is saved while the header is read, so it
+ * must be called before the header of a stream is read by other methods.
+ */
+static VALUE
+jpeg_reader_embedded_thumbnail(int argc, VALUE* argv, VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    jpeg_saved_marker_ptr marker;
+    JOCTET const* data = NULL;
+    size_t length = 0;
+    VALUE thumbnail;
+
+    reader = get_jpeg_reader_data(obj);
+    reader_check_initialized(reader);
+    if (reader->state >= READER_FINISHED_DECOMPRESS)
+	rb_raise(eImageFileJpegReaderError, "decompression has already been finished");
+
+    if (reader->source_type == SOURCE_MEMORY || reader->source_type == SOURCE_FILE_MAP) {
+	read_header(reader);
+	if (!find_exif_thumbnail_in_file(reader->memory, reader->memory_length, &data, &length))
+	    return Qnil;
+    }
+    else {
+	if (reader->state < READER_RED_HEADER)
+	    rb_ensure(read_header_saving_app1, (VALUE)reader, stop_saving_app1, (VALUE)reader);
+	else if (!reader->app1_saved)
+	    rb_raise(eImageFileJpegReaderError, "the header has already been read without the Exif segment");
+
+	for (marker = reader->cinfo.marker_list; marker != NULL; marker = marker->next) {
+	    if (marker->marker == JPEG_APP0 + 1
+		    && find_exif_thumbnail(marker->data, marker->data_length, &data, &length))
+		break;
+	}
+	if (marker == NULL)
+	    return Qnil;
+    }
+
+    thumbnail = rb_str_new((char const*)data, (long)length);
+    thumbnail = jpeg_reader_s_from_string(rb_obj_class(obj), thumbnail);
+    return jpeg_reader_read_image(argc, argv, thumbnail);
+}
+
+/*
+ * Reads the next +n+ scanlines, or the rest of them if fewer remain, into
+ * a new image.  Returns nil when all scanlines have been read.  The
+ * parameters are the same as read_image's, and those given to the first
+ * call are used until the end of the image, except for :into.
+ */
+static VALUE
+jpeg_reader_read_scanlines(int argc, VALUE* argv, VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    VALUE n, params, image;
+    long nrows;
+
+    rb_scan_args(argc, argv, "11", &n, &params);
+    nrows = NUM2LONG(n);
+    if (nrows <= 0)
+	rb_raise(rb_eArgError, "zero or negative number of scanlines");
+
+    reader = get_jpeg_reader_data(obj);
+    if (reader->state >= READER_FINISHED_DECOMPRESS)
+	return Qnil;
+
+    if (reader->state < READER_STARTED_DECOMPRESS) {
+	image = prepare_decompress(argc - 1, argv + 1, reader, nrows);
+	if (nrows > remaining_scanlines(reader))
+	    nrows = remaining_scanlines(reader);
+    }
+    else {
+	if (nrows > remaining_scanlines(reader))
+	    nrows = remaining_scanlines(reader);
+	image = new_band_image(reader, nrows,
+		TYPE(params) == T_HASH ? rb_hash_lookup(params, ID2SYM(id_into)) : Qnil);
+    }
+    decompress_into_image(reader, image, nrows);
 
     return image;
 }
 
+#define DEFAULT_SCANLINE_BAND 16
+
+/*
+ * Yields bands of +n+ scanlines, 16 by default, and the index of their
+ * first scanline.  Each band costs a call into libjpeg and a yield, so
+ * small bands make the decoding slower.  The same image is yielded every time and its contents are overwritten
+ * by the next band, so only the pixels of the current band and a few
+ * scanlines of libjpeg's work area are held in memory.
+ */
+static VALUE
+jpeg_reader_each_scanline(int argc, VALUE* argv, VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    VALUE n, params, image;
+    unsigned long generation;
+    long nrows;
+
+    RETURN_ENUMERATOR(obj, argc, argv);
+
+    rb_scan_args(argc, argv, "02", &n, &params);
+    nrows = NIL_P(n) ? DEFAULT_SCANLINE_BAND : NUM2LONG(n);
+    if (nrows <= 0)
+	rb_raise(rb_eArgError, "zero or negative number of scanlines");
+
+    reader = get_jpeg_reader_data(obj);
+    image = prepare_decompress(NIL_P(params) ? 0 : 1, &params, reader, nrows);
+    generation = reader->generation;
+
+    while (reader->state < READER_FINISHED_DECOMPRESS
+	    && remaining_scanlines(reader) > 0) {
+	long const y = (long)reader->cinfo.output_scanline;
+	long const rows = nrows < remaining_scanlines(reader) ? nrows : remaining_scanlines(reader);
+
+	if (!rb_image_file_image_reshape(image, reader->pixel_format,
+		    (long)reader->cinfo.output_width, rows, reader->stride))
+	    rb_bug("failed to reshape a scanline band");
+	decompress_into_image(reader, image, rows);
+	rb_yield_values(2, image, LONG2NUM(y));
+	if (reader->generation != generation)
+	    break; /* reset in the block */
+    }
+
+    return obj;
+}
+
+/*
+ * Decodes in buffered-image mode, and yields the image and the number of
+ * the input scan it shows after each output pass.  For a progressive
+ * JPEG, the first pass is a coarse preview made from the first scan, and
+ * each following pass refines it by one more scan.  The same image is
+ * yielded every time and its contents are overwritten by the next pass.
+ */
+static VALUE
+jpeg_reader_each_progressive_pass(int argc, VALUE* argv, VALUE obj)
+{
+    struct jpeg_reader_data* reader;
+    struct decompress_args args;
+    unsigned long generation;
+    VALUE image;
+
+    RETURN_ENUMERATOR(obj, argc, argv);
+
+    reader = get_jpeg_reader_data(obj);
+    image = prepare_decompress(argc, argv, reader, 0);
+    reader->cinfo.buffered_image = TRUE;
+    generation = reader->generation;
+
+    args.reader = reader;
+    args.image_buffer = RSTRING_PTR(rb_image_file_image_get_buffer(image));
+    args.pixel_format = reader->pixel_format;
+    args.width = (long)reader->cinfo.output_width;
+    args.stride = reader->stride;
+    args.first_row = 0;
+    args.end_row = (long)reader->cinfo.output_height;
+    args.x_offset = 0;
+    args.crop = 0;
+    args.progressive = 1;
+
+    while (reader->state < READER_FINISHED_DECOMPRESS) {
+	args.interrupted = 0;
+	decompress(&args);
+	rb_yield_values(2, image, INT2NUM(reader->cinfo.output_scan_number));
+	if (reader->generation != generation)
+	    break; /* reset in the block */
+    }
+
+    RB_GC_GUARD(image);
+    return obj;
+}
+
+#if defined(USE_NATIVE_FILE_SOURCE) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+enum batch_item_status {
+    BATCH_PENDING = 0,
+    BATCH_RED_HEADER,
+    BATCH_DECOMPRESSED,
+    BATCH_FAILED
+};
+
+struct batch_item {
+    struct jpeg_reader_data reader;
+    char const* path;
+    enum batch_item_status status;
+    struct decompress_args args;
+};
+
+struct batch_data {
+    struct batch_item* items;
+    long num_items;
+    VALUE paths;
+    unsigned int scale_num;
+    unsigned int scale_denom;
+    rb_image_file_image_pixel_format_t pixel_format;
+    int fast;
+    int threads;
+    int volatile interrupted;
+};
+
+static void
+batch_fail(struct batch_item* item, char const* message)
+{
+    snprintf(item->reader.error_message, sizeof(item->reader.error_message), "%s", message);
+    item->status = BATCH_FAILED;
+}
+
+static void
+batch_read_header(struct batch_data* batch, struct batch_item* item)
+{
+    struct jpeg_reader_data* reader = &item->reader;
+    uint64_t start;
+    int fd;
+
+    reader->cinfo.err = init_error_mgr(&reader->error);
+    reader->error.output_message = discard_message;
+    reader->cinfo.client_data = (void*)reader;
+    reader->source = Qnil;
+    reader->buffer = Qnil;
+    reader->fd = -1;
+    reader->without_gvl = 1;
+    if (setjmp(reader->jmpbuf) != 0) {
+	item->status = BATCH_FAILED;
+	return;
+    }
+
+    jpeg_create_decompress(&reader->cinfo);
+    init_source_mgr(reader);
+    reader->state = READER_INITIALIZED;
+
+    fd = open(item->path, O_RDONLY
+#ifdef O_CLOEXEC
+	    | O_CLOEXEC
+#endif
+	    );
+    if (fd < 0) {
+	char message[JMSG_LENGTH_MAX];
+	copy_error_message(errno, message, sizeof(message));
+	batch_fail(item, message);
+	return;
+    }
+    init_file_source_mgr(reader, fd);
+    if (reader->source_type == SOURCE_IO) {
+	close(fd);
+	batch_fail(item, "not a regular file");
+	return;
+    }
+    if (reader->source_type == SOURCE_FILE_MAP) {
+	/* the mapping stays valid without the descriptor */
+	close(fd);
+	reader->fd = -1;
+    }
+
+    start = stats_clock();
+    jpeg_read_header(&reader->cinfo, TRUE);
+    reader->state = READER_RED_HEADER;
+    STATS_ADD(reader, header_nsec, stats_clock() - start);
+
+    if (batch->scale_denom > 0) {
+	reader->cinfo.scale_num = batch->scale_num;
+	reader->cinfo.scale_denom = batch->scale_denom;
+    }
+    if (batch->fast)
+	set_fast_decode(&reader->cinfo);
+    if (batch->pixel_format != RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID) {
+	item->args.pixel_format = batch->pixel_format;
+    }
+    else {
+	item->args.pixel_format = default_pixel_format(reader);
+	if (item->args.pixel_format == RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID) {
+	    char message[JMSG_LENGTH_MAX];
+	    snprintf(message, sizeof(message), "unsupported output color space (%s)",
+		    j_color_space_name(reader->cinfo.out_color_space));
+	    batch_fail(item, message);
+	    return;
+	}
+    }
+
+    select_out_color_space(reader, item->args.pixel_format);
+    item->args.reader = reader;
+    item->args.width = (long)reader->cinfo.output_width;
+    item->args.first_row = 0;
+    item->args.end_row = (long)reader->cinfo.output_height;
+    item->status = BATCH_RED_HEADER;
+}
+
+static void
+batch_decompress(struct batch_item* item)
+{
+    struct jpeg_reader_data* reader = &item->reader;
+
+    if (setjmp(reader->jmpbuf) != 0) {
+	item->status = BATCH_FAILED;
+	return;
+    }
+
+    decompress_scanlines(&item->args);
+    item->status = BATCH_DECOMPRESSED;
+}
+
+static void
+batch_process_item(void* ptr, long const i)
+{
+    struct batch_data* batch = (struct batch_data*)ptr;
+    struct batch_item* item = &batch->items[i];
+
+    if (batch->interrupted)
+	return;
+
+    switch (item->status) {
+	case BATCH_PENDING:
+	    batch_read_header(batch, item);
+	    break;
+
+	case BATCH_RED_HEADER:
+	    if (item->args.image_buffer != NULL)
+		batch_decompress(item);
+	    break;
+
+	default:
+	    break;
+    }
+}
+
+static void*
+batch_process_without_gvl(void* ptr)
+{
+    struct batch_data* batch = (struct batch_data*)ptr;
+    rb_image_file_parallel_for(batch->num_items, batch->threads, batch_process_item, batch);
+    return NULL;
+}
+
+static void
+batch_interrupt(void* ptr)
+{
+    struct batch_data* batch = (struct batch_data*)ptr;
+    batch->interrupted = 1;
+}
+
+/*
+ * Runs one stage over all items on the worker threads.  An interrupt
+ * stops the workers before their next item; the stage is resumed if the
+ * interrupt did not raise.
+ */
+static void
+batch_run_stage(struct batch_data* batch, enum batch_item_status const status)
+{
+    long i;
+
+    for (;;) {
+	batch->interrupted = 0;
+	rb_thread_call_without_gvl(batch_process_without_gvl, batch, batch_interrupt, batch);
+	rb_thread_check_ints();
+	for (i = 0; i < batch->num_items; ++i) {
+	    if (batch->items[i].status == status)
+		break;
+	}
+	if (i == batch->num_items)
+	    return;
+    }
+}
+
+static VALUE
+batch_cleanup(VALUE arg)
+{
+    struct batch_data* batch = (struct batch_data*)arg;
+    long i;
+
+    for (i = 0; i < batch->num_items; ++i) {
+	struct jpeg_reader_data* reader = &batch->items[i].reader;
+#ifdef HAVE_MMAP
+	if (reader->map != NULL)
+	    munmap(reader->map, reader->map_length);
+#endif
+	if (reader->fd >= 0)
+	    close(reader->fd);
+	if (reader->state > READER_ALLOCATED)
+	    jpeg_destroy_decompress(&reader->cinfo);
+	stats_merge(reader);
+    }
+    xfree(batch->items);
+
+    return Qnil;
+}
+
+static VALUE
+batch_run(VALUE arg)
+{
+    struct batch_data* batch = (struct batch_data*)arg;
+    VALUE result;
+    long i;
+
+    batch_run_stage(batch, BATCH_PENDING);
+
+    result = rb_ary_new2(batch->num_items);
+    for (i = 0; i < batch->num_items; ++i) {
+	struct batch_item* item = &batch->items[i];
+	VALUE params, image;
+
+	if (item->status != BATCH_RED_HEADER) {
+	    rb_ary_push(result, Qnil);
+	    continue;
+	}
+
+	params = rb_hash_new();
+	rb_hash_aset(params, ID2SYM(id_pixel_format),
+		rb_image_file_image_pixel_format_to_symbol(item->args.pixel_format));
+	rb_hash_aset(params, ID2SYM(id_width), LONG2NUM(item->args.width));
+	rb_hash_aset(params, ID2SYM(id_height), LONG2NUM(item->args.end_row));
+	image = rb_funcall(cImageFileImage, id_new, 1, params);
+	rb_ary_push(result, image);
+
+	item->args.stride = NUM2LONG(rb_funcall(image, id_row_stride, 0));
+	item->args.image_buffer = RSTRING_PTR(rb_image_file_image_get_buffer(image));
+    }
+
+    batch_run_stage(batch, BATCH_RED_HEADER);
+
+    for (i = 0; i < batch->num_items; ++i) {
+	struct batch_item* item = &batch->items[i];
+	if (item->status == BATCH_FAILED) {
+	    VALUE message = rb_sprintf("%s: %s", item->path, item->reader.error_message);
+	    rb_ary_store(result, i, rb_exc_new_str(eImageFileJpegReaderError, message));
+	}
+    }
+
+    return result;
+}
+
+/*
+ * Decodes the JPEG files at +paths+ on native worker threads, and returns
+ * an array of the decoded images in the same order.  A file that cannot
+ * be decoded gets an instance of ImageFile::JpegReader::Error in place of
+ * its image.
+ *
+ * Recognized parameters are :threads (defaults to the number of
+ * processors), :scale, :pixel_format, and :quality.
+ */
+static VALUE
+image_file_s_decode_batch(int argc, VALUE* argv, VALUE klass ARG_UNUSED)
+{
+    struct batch_data batch;
+    VALUE paths, params, threads, scale, pixel_format, quality, result;
+    long i;
+
+    rb_scan_args(argc, argv, "11", &paths, &params);
+    paths = rb_Array(paths);
+
+    threads = scale = pixel_format = quality = Qnil;
+    if (!NIL_P(params)) {
+	Check_Type(params, T_HASH);
+	threads = rb_hash_lookup(params, ID2SYM(id_threads));
+	scale = rb_hash_lookup(params, ID2SYM(id_scale));
+	pixel_format = rb_hash_lookup(params, ID2SYM(id_pixel_format));
+	quality = rb_hash_lookup(params, ID2SYM(id_quality));
+    }
+
+    batch.num_items = RARRAY_LEN(paths);
+    batch.threads = NIL_P(threads) ? rb_image_file_number_of_processors() : NUM2INT(threads);
+    if (batch.threads < 1)
+	rb_raise(rb_eArgError, "threads must be positive");
+
+    batch.scale_num = batch.scale_denom = 0;
+    if (!NIL_P(scale)) {
+	VALUE r = rb_Rational1(scale);
+	batch.scale_num = NUM2UINT(rb_funcall(r, id_numerator, 0));
+	batch.scale_denom = NUM2UINT(rb_funcall(r, id_denominator, 0));
+    }
+
+    batch.pixel_format = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID;
+    if (!NIL_P(pixel_format)) {
+	batch.pixel_format = rb_image_file_image_symbol_to_pixel_format(pixel_format);
+	if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID == batch.pixel_format)
+	    rb_raise(rb_eArgError, "unknown pixel format");
+    }
+
+    batch.fast = 0;
+    if (!NIL_P(quality)) {
+	Check_Type(quality, T_SYMBOL);
+	if (SYM2ID(quality) == id_fast)
+	    batch.fast = 1;
+	else if (SYM2ID(quality) != id_default)
+	    rb_raise(rb_eArgError, "unknown quality");
+    }
+
+    paths = rb_ary_dup(paths);
+    for (i = 0; i < batch.num_items; ++i) {
+	VALUE path = rb_ary_entry(paths, i);
+	FilePathValue(path);
+	rb_ary_store(paths, i, rb_str_new_frozen(path));
+    }
+
+    batch.items = ALLOC_N(struct batch_item, batch.num_items);
+    MEMZERO(batch.items, struct batch_item, batch.num_items);
+    for (i = 0; i < batch.num_items; ++i) {
+	batch.items[i].path = StringValueCStr(RARRAY_PTR(paths)[i]);
+	/* not opened yet; batch_cleanup must not close stdin */
+	batch.items[i].reader.fd = -1;
+    }
+
+    batch.paths = paths;
+    result = rb_ensure(batch_run, (VALUE)&batch, batch_cleanup, (VALUE)&batch);
+    RB_GC_GUARD(paths);
+    return result;
+}
+#endif
+
 void
 rb_image_file_Init_image_file_jpeg_reader(void)
 {
     cImageFileJpegReader = rb_define_class_under(mImageFile, "JpegReader", rb_cObject);
     rb_define_alloc_func(cImageFileJpegReader, jpeg_reader_alloc);
     rb_define_singleton_method(cImageFileJpegReader, "open", jpeg_reader_s_open, 1);
+    rb_define_singleton_method(cImageFileJpegReader, "from_string", jpeg_reader_s_from_string, 1);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    rb_define_singleton_method(cImageFileJpegReader, "from_buffer", jpeg_reader_s_from_buffer, 1);
+#endif
     rb_define_method(cImageFileJpegReader, "initialize", jpeg_reader_initialize, 1);
+    rb_define_singleton_method(cImageFileJpegReader, "stats", jpeg_reader_s_get_stats, 0);
+    rb_define_singleton_method(cImageFileJpegReader, "reset_stats", jpeg_reader_s_reset_stats, 0);
+
+    rb_define_method(cImageFileJpegReader, "reset", jpeg_reader_reset, 1);
     rb_define_method(cImageFileJpegReader, "source_will_be_closed?", jpeg_reader_source_will_be_closed, 0);
+    rb_define_method(cImageFileJpegReader, "nonblock?", jpeg_reader_is_nonblock, 0);
+    rb_define_method(cImageFileJpegReader, "nonblock=", jpeg_reader_set_nonblock, 1);
 
     rb_define_method(cImageFileJpegReader, "image_width", jpeg_reader_get_image_width, 0);
     rb_define_method(cImageFileJpegReader, "image_height", jpeg_reader_get_image_height, 0);
     rb_define_method(cImageFileJpegReader, "num_components", jpeg_reader_get_num_components, 0);
     rb_define_method(cImageFileJpegReader, "jpeg_color_space", jpeg_reader_get_jpeg_color_space, 0);
+    rb_define_method(cImageFileJpegReader, "restart_interval", jpeg_reader_get_restart_interval, 0);
 
     rb_define_method(cImageFileJpegReader, "out_color_space", jpeg_reader_get_out_color_space, 0);
     rb_define_method(cImageFileJpegReader, "scale", jpeg_reader_get_scale, 0);
@@ -904,19 +3688,35 @@ rb_image_file_Init_image_file_jpeg_reader(void)
     rb_define_method(cImageFileJpegReader, "output_gamma", jpeg_reader_get_output_gamma, 0);
     rb_define_method(cImageFileJpegReader, "output_gamma=", jpeg_reader_set_output_gamma, 1);
     rb_define_method(cImageFileJpegReader, "buffered_image?", jpeg_reader_is_buffered_image, 0);
+    rb_define_method(cImageFileJpegReader, "buffered_image=", jpeg_reader_set_buffered_image, 1);
     rb_define_method(cImageFileJpegReader, "dct_method", jpeg_reader_get_dct_method, 0);
+    rb_define_method(cImageFileJpegReader, "dct_method=", jpeg_reader_set_dct_method, 1);
+    rb_define_method(cImageFileJpegReader, "do_fancy_upsampling?", jpeg_reader_is_do_fancy_upsampling, 0);
+    rb_define_method(cImageFileJpegReader, "do_fancy_upsampling=", jpeg_reader_set_do_fancy_upsampling, 1);
+    rb_define_method(cImageFileJpegReader, "do_block_smoothing?", jpeg_reader_is_do_block_smoothing, 0);
+    rb_define_method(cImageFileJpegReader, "do_block_smoothing=", jpeg_reader_set_do_block_smoothing, 1);
     rb_define_method(cImageFileJpegReader, "quantize_colors?", jpeg_reader_is_quantize_colors, 0);
     rb_define_method(cImageFileJpegReader, "dither_mode", jpeg_reader_get_dither_mode, 0);
 
     rb_define_method(cImageFileJpegReader, "output_width", jpeg_reader_get_output_width, 0);
     rb_define_method(cImageFileJpegReader, "output_height", jpeg_reader_get_output_height, 0);
     rb_define_method(cImageFileJpegReader, "output_components", jpeg_reader_get_output_components, 0);
+    rb_define_method(cImageFileJpegReader, "stats", jpeg_reader_get_stats, 0);
 
     rb_define_method(cImageFileJpegReader, "read_image", jpeg_reader_read_image, -1);
+    rb_define_method(cImageFileJpegReader, "read_thumbnail", jpeg_reader_read_thumbnail, 1);
+    rb_define_method(cImageFileJpegReader, "embedded_thumbnail", jpeg_reader_embedded_thumbnail, -1);
+    rb_define_method(cImageFileJpegReader, "read_scanlines", jpeg_reader_read_scanlines, -1);
+    rb_define_method(cImageFileJpegReader, "each_scanline", jpeg_reader_each_scanline, -1);
+    rb_define_method(cImageFileJpegReader, "each_progressive_pass", jpeg_reader_each_progressive_pass, -1);
 
     eImageFileJpegReaderError = rb_define_class_under(
 	    cImageFileJpegReader, "Error", rb_eStandardError);
 
+#if defined(USE_NATIVE_FILE_SOURCE) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+    rb_define_module_function(mImageFile, "decode_batch", image_file_s_decode_batch, -1);
+#endif
+
     CONST_ID(id_GRAYSCALE, "GRAYSCALE");
     CONST_ID(id_RGB, "RGB");
     CONST_ID(id_YCbCr, "YCbCr");
@@ -931,8 +3731,34 @@ rb_image_file_Init_image_file_jpeg_reader(void)
     CONST_ID(id_new, "new");
     CONST_ID(id_close, "close");
     CONST_ID(id_read, "read");
+    CONST_ID(id_to_path, "to_path");
+    CONST_ID(id_read_nonblock, "read_nonblock");
+    CONST_ID(id_wait_readable, "wait_readable");
+    CONST_ID(id_wait_writable, "wait_writable");
+    CONST_ID(id_exception, "exception");
     CONST_ID(id_pixel_format, "pixel_format");
     CONST_ID(id_width, "width");
     CONST_ID(id_height,"height");
     CONST_ID(id_row_stride, "row_stride");
+    CONST_ID(id_threads, "threads");
+    CONST_ID(id_scale, "scale");
+    CONST_ID(id_quality, "quality");
+    CONST_ID(id_fast, "fast");
+    CONST_ID(id_default, "default");
+    CONST_ID(id_fit, "fit");
+    CONST_ID(id_max_width, "max_width");
+    CONST_ID(id_max_height, "max_height");
+    CONST_ID(id_region, "region");
+    CONST_ID(id_into, "into");
+    CONST_ID(id_bytes_read, "bytes_read");
+    CONST_ID(id_fill_input_buffer_calls, "fill_input_buffer_calls");
+    CONST_ID(id_header_time, "header_time");
+    CONST_ID(id_decompress_time, "decompress_time");
+    CONST_ID(id_convert_time, "convert_time");
+    CONST_ID(id_scanlines, "scanlines");
+    CONST_ID(id_scanline_batches, "scanline_batches");
+    CONST_ID(id_scanlines_per_batch, "scanlines_per_batch");
+    CONST_ID(id_peak_buffer_size, "peak_buffer_size");
+    CONST_ID(id_numerator, "numerator");
+    CONST_ID(id_denominator, "denominator");
 }
@@ -0,0 +1,1016 @@
+#include "internal.h"
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+
+#include <setjmp.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(HAVE_IMMINTRIN_H)
+# define USE_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+#undef EXTERN
+#include <jpeglib.h>
+#include <jerror.h>
+
+static size_t const INITIAL_MEMORY_SIZE = 65536U;
+
+/* number of output block rows transposed at once */
+#define TRANSPOSE_ROWS 8
+
+VALUE cImageFileJpegTransformer = Qnil;
+VALUE eImageFileJpegTransformerError = Qnil;
+
+static ID id_new;
+static ID id_binread;
+static ID id_rotate;
+static ID id_flip;
+static ID id_horizontal;
+static ID id_vertical;
+static ID id_crop;
+static ID id_progressive;
+static ID id_optimize_coding;
+static ID id_copy_markers;
+static ID id_all;
+static ID id_comments;
+static ID id_none;
+
+enum copy_markers {
+    COPY_MARKERS_NONE = 0,
+    COPY_MARKERS_COMMENTS,
+    COPY_MARKERS_ALL
+};
+
+struct jpeg_transformer_data {
+    VALUE source;	/* frozen String of the JPEG file */
+};
+
+static void
+jpeg_transformer_mark(void* ptr)
+{
+    struct jpeg_transformer_data* transformer = (struct jpeg_transformer_data*)ptr;
+    /* rb_gc_mark pins the source, so its bytes never move during a transform */
+    rb_gc_mark(transformer->source);
+}
+
+static void
+jpeg_transformer_free(void* ptr)
+{
+    xfree(ptr);
+}
+
+static size_t
+jpeg_transformer_memsize(void const* ptr)
+{
+    return ptr == NULL ? 0 : sizeof(struct jpeg_transformer_data);
+}
+
+static rb_data_type_t const jpeg_transformer_data_type = {
+    "image_file::jpeg_transformer",
+#if RUBY_VERSION >= 193
+    {
+#endif
+	jpeg_transformer_mark,
+	jpeg_transformer_free,
+	jpeg_transformer_memsize,
+#if RUBY_VERSION >= 193
+    },
+#endif
+};
+
+static VALUE
+jpeg_transformer_alloc(VALUE klass)
+{
+    struct jpeg_transformer_data* transformer;
+    VALUE obj = TypedData_Make_Struct(
+	    klass, struct jpeg_transformer_data, &jpeg_transformer_data_type, transformer);
+    transformer->source = Qnil;
+    return obj;
+}
+
+static struct jpeg_transformer_data*
+get_jpeg_transformer_data(VALUE obj)
+{
+    struct jpeg_transformer_data* transformer;
+    TypedData_Get_Struct(obj, struct jpeg_transformer_data, &jpeg_transformer_data_type, transformer);
+    return transformer;
+}
+
+/*
+ * A transform reads the DCT coefficients of the source with
+ * jpeg_read_coefficients, rearranges the blocks, and compresses them
+ * with jpeg_write_coefficients.  Flips and crops work in place in the
+ * source arrays; only a transposition needs a second set.  Every
+ * rotation and flip is a transposition followed by mirroring of the
+ * output axes, which only moves the blocks, transposes their
+ * coefficients, and negates the odd horizontal or vertical frequencies.
+ * Nothing is dequantized, so the transform is lossless.
+ */
+struct transform {
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct jpeg_error_mgr src_error;
+    struct jpeg_error_mgr dst_error;
+    struct jpeg_source_mgr source_mgr;
+    struct jpeg_destination_mgr destination_mgr;
+    JOCTET const* data;
+    size_t length;
+    JOCTET* memory;
+    size_t memory_length;
+    size_t memory_capacity;
+    jvirt_barray_ptr* src_coefs;
+    jvirt_barray_ptr* dst_coefs;	/* NULL to write the source arrays */
+    long full_width;		/* of the transformed image before cropping */
+    long full_height;
+    long crop_x;		/* aligned to the MCUs of the output */
+    long crop_y;
+    long width;
+    long height;
+    int out_max_h_samp_factor;
+    int out_max_v_samp_factor;
+    int transpose;
+    int mirror_x;
+    int mirror_y;
+    JCOEF block_sign[DCTSIZE2];
+    int progressive;		/* -1 to follow the source */
+    int optimize_coding;
+    enum copy_markers copy_markers;
+    int pass;			/* next pass of transform_coefficients */
+    int volatile interrupted;
+    int completed;
+    jmp_buf jmpbuf;
+    char error_message[JMSG_LENGTH_MAX];
+    unsigned without_gvl: 1;
+    unsigned src_created: 1;
+    unsigned dst_created: 1;
+};
+
+/*
+ * Without the GVL, an error cannot be raised here.  The message is saved
+ * and the control returns to the setjmp point in transform_without_gvl.
+ */
+static void
+error_exit(j_common_ptr cinfo)
+{
+    struct transform* t = (struct transform*)cinfo->client_data;
+    char message[JMSG_LENGTH_MAX];
+
+    if (t->without_gvl) {
+	(* cinfo->err->format_message)(cinfo, t->error_message);
+	longjmp(t->jmpbuf, 1);
+    }
+
+    (* cinfo->err->format_message)(cinfo, message);
+    rb_raise(eImageFileJpegTransformerError, "%s", message);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+output_message_with_gvl(void* message)
+{
+    rb_warning("%s", (char const*)message);
+    return NULL;
+}
+#endif
+
+static void
+output_message(j_common_ptr cinfo)
+{
+    struct transform* t = (struct transform*)cinfo->client_data;
+    char message[JMSG_LENGTH_MAX];
+
+    (* cinfo->err->format_message)(cinfo, message);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (t->without_gvl) {
+	rb_thread_call_with_gvl(output_message_with_gvl, message);
+	return;
+    }
+#else
+    (void)t;
+#endif
+    rb_warning("%s", message);
+}
+
+static struct jpeg_error_mgr*
+init_error_mgr(struct jpeg_error_mgr* err)
+{
+    jpeg_std_error(err);
+    err->error_exit = error_exit;
+    err->output_message = output_message;
+    return err;
+}
+
+static void
+init_source(j_decompress_ptr cinfo ARG_UNUSED)
+{
+}
+
+/* The whole file is in the buffer; a truncated one is ended with a fake EOI. */
+static boolean
+fill_input_buffer(j_decompress_ptr cinfo)
+{
+    static JOCTET const eoi[2] = { 0xFF, JPEG_EOI };
+
+    WARNMS(cinfo, JWRN_JPEG_EOF);
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void
+skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    struct jpeg_source_mgr* src = cinfo->src;
+
+    if (num_bytes <= 0)
+	return;
+    if ((size_t)num_bytes > src->bytes_in_buffer) {
+	(void)(* src->fill_input_buffer)(cinfo);
+	return;
+    }
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= (size_t)num_bytes;
+}
+
+static void
+term_source(j_decompress_ptr cinfo ARG_UNUSED)
+{
+}
+
+/*
+ * The output is compressed into a single block, which is doubled whenever
+ * it is full.  It is allocated by malloc(3) rather than xmalloc, because
+ * it grows without the GVL.
+ */
+static void
+init_memory_destination(j_compress_ptr cinfo)
+{
+    struct transform* t = (struct transform*)cinfo->client_data;
+
+    if (t->memory == NULL) {
+	t->memory = (JOCTET*)malloc(INITIAL_MEMORY_SIZE);
+	if (t->memory == NULL)
+	    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	t->memory_capacity = INITIAL_MEMORY_SIZE;
+    }
+    t->memory_length = 0;
+    cinfo->dest->next_output_byte = t->memory;
+    cinfo->dest->free_in_buffer = t->memory_capacity;
+}
+
+static boolean
+empty_output_buffer_to_memory(j_compress_ptr cinfo)
+{
+    struct transform* t = (struct transform*)cinfo->client_data;
+    size_t const capacity = t->memory_capacity;
+    JOCTET* memory;
+
+    memory = (JOCTET*)realloc(t->memory, 2*capacity);
+    if (memory == NULL)
+	ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+    t->memory = memory;
+    t->memory_capacity = 2*capacity;
+    cinfo->dest->next_output_byte = memory + capacity;
+    cinfo->dest->free_in_buffer = capacity;
+
+    return TRUE;
+}
+
+static void
+term_memory_destination(j_compress_ptr cinfo)
+{
+    struct transform* t = (struct transform*)cinfo->client_data;
+    t->memory_length = t->memory_capacity - cinfo->dest->free_in_buffer;
+}
+
+static inline long
+round_up(long const n, long const unit)
+{
+    return (n + unit - 1) / unit * unit;
+}
+
+/*
+ * Sets the orientation tag in IFD0 of an Exif segment to 1, the top-left,
+ * because a rotated or flipped image is assumed to have been oriented.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void
+reset_exif_orientation(JOCTET* data, size_t const length)
+{
+    JOCTET* tiff = data + 6;
+    size_t const n = length - 6;
+    size_t ifd, count, i;
+    int big_endian;
+
+    if (length < 6 + 8 || memcmp(data, "Exif\0\0", 6) != 0)
+	return;
+    if (tiff[0] == 'M' && tiff[1] == 'M')
+	big_endian = 1;
+    else if (tiff[0] == 'I' && tiff[1] == 'I')
+	big_endian = 0;
+    else
+	return;
+
+    ifd = exif_get32(tiff + 4, big_endian);
+    if (ifd > n - 2)
+	return;
+    count = exif_get16(tiff + ifd, big_endian);
+    for (i = 0; i < count && ifd + 2 + 12*(i + 1) <= n; ++i) {
+	JOCTET* entry = tiff + ifd + 2 + 12*i;
+	if (exif_get16(entry, big_endian) == 0x0112) {
+	    /* a single SHORT, whose value is in the first two bytes */
+	    if (exif_get16(entry + 2, big_endian) != 3 || exif_get32(entry + 4, big_endian) != 1)
+		return;
+	    entry[8] = big_endian ? 0 : 1;
+	    entry[9] = big_endian ? 1 : 0;
+	    return;
+	}
+    }
+}
+
+/*
+ * The saved markers are written after the SOI and the JFIF or Adobe
+ * marker of the output, which are skipped if libjpeg writes them itself.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void
+write_saved_markers(struct transform* t)
+{
+    jpeg_saved_marker_ptr marker;
+
+    for (marker = t->src.marker_list; marker != NULL; marker = marker->next) {
+	if (t->dst.write_JFIF_header && marker->marker == JPEG_APP0
+		&& marker->data_length >= 5 && memcmp(marker->data, "JFIF", 5) == 0)
+	    continue;
+	if (t->dst.write_Adobe_marker && marker->marker == JPEG_APP0 + 14
+		&& marker->data_length >= 5 && memcmp(marker->data, "Adobe", 5) == 0)
+	    continue;
+	if (marker->marker == JPEG_APP0 + 1 && (t->transpose || t->mirror_x || t->mirror_y))
+	    reset_exif_orientation(marker->data, marker->data_length);
+	jpeg_write_marker(&t->dst, marker->marker, marker->data, marker->data_length);
+    }
+}
+
+/*
+ * Sets up the sign of each coefficient of an output block, 0 to keep or
+ * -1 to negate it.
+ */
+static void
+setup_block_signs(struct transform* t)
+{
+    int u, v;
+
+    for (v = 0; v < DCTSIZE; ++v) {
+	for (u = 0; u < DCTSIZE; ++u) {
+	    int const negate = (t->mirror_x && (u & 1)) ^ (t->mirror_y && (v & 1));
+	    t->block_sign[v*DCTSIZE + u] = negate ? -1 : 0;
+	}
+    }
+}
+
+/* This function doesn't use any Ruby API. */
+static inline void
+mirror_block(JCOEF const* src, JCOEF* dst, JCOEF const* sign)
+{
+    int i;
+    for (i = 0; i < DCTSIZE2; ++i)
+	dst[i] = (JCOEF)((src[i] ^ sign[i]) - sign[i]);
+}
+
+#ifdef USE_X86_SIMD
+/* SSE2 is a part of x86_64, so this needs no check of the CPU. */
+static inline void
+transpose_block(JCOEF const* src, JCOEF* dst, JCOEF const* sign)
+{
+    __m128i const* const s = (__m128i const*)src;
+    __m128i const* const m = (__m128i const*)sign;
+    __m128i* const d = (__m128i*)dst;
+    __m128i const t0 = _mm_unpacklo_epi16(_mm_loadu_si128(s + 0), _mm_loadu_si128(s + 1));
+    __m128i const t1 = _mm_unpackhi_epi16(_mm_loadu_si128(s + 0), _mm_loadu_si128(s + 1));
+    __m128i const t2 = _mm_unpacklo_epi16(_mm_loadu_si128(s + 2), _mm_loadu_si128(s + 3));
+    __m128i const t3 = _mm_unpackhi_epi16(_mm_loadu_si128(s + 2), _mm_loadu_si128(s + 3));
+    __m128i const t4 = _mm_unpacklo_epi16(_mm_loadu_si128(s + 4), _mm_loadu_si128(s + 5));
+    __m128i const t5 = _mm_unpackhi_epi16(_mm_loadu_si128(s + 4), _mm_loadu_si128(s + 5));
+    __m128i const t6 = _mm_unpacklo_epi16(_mm_loadu_si128(s + 6), _mm_loadu_si128(s + 7));
+    __m128i const t7 = _mm_unpackhi_epi16(_mm_loadu_si128(s + 6), _mm_loadu_si128(s + 7));
+    __m128i const u0 = _mm_unpacklo_epi32(t0, t2);
+    __m128i const u1 = _mm_unpackhi_epi32(t0, t2);
+    __m128i const u2 = _mm_unpacklo_epi32(t1, t3);
+    __m128i const u3 = _mm_unpackhi_epi32(t1, t3);
+    __m128i const u4 = _mm_unpacklo_epi32(t4, t6);
+    __m128i const u5 = _mm_unpackhi_epi32(t4, t6);
+    __m128i const u6 = _mm_unpacklo_epi32(t5, t7);
+    __m128i const u7 = _mm_unpackhi_epi32(t5, t7);
+    __m128i c[8];
+    int v;
+
+    c[0] = _mm_unpacklo_epi64(u0, u4);
+    c[1] = _mm_unpackhi_epi64(u0, u4);
+    c[2] = _mm_unpacklo_epi64(u1, u5);
+    c[3] = _mm_unpackhi_epi64(u1, u5);
+    c[4] = _mm_unpacklo_epi64(u2, u6);
+    c[5] = _mm_unpackhi_epi64(u2, u6);
+    c[6] = _mm_unpacklo_epi64(u3, u7);
+    c[7] = _mm_unpackhi_epi64(u3, u7);
+    for (v = 0; v < DCTSIZE; ++v) {
+	__m128i const sv = _mm_loadu_si128(m + v);
+	_mm_storeu_si128(d + v, _mm_sub_epi16(_mm_xor_si128(c[v], sv), sv));
+    }
+}
+#else
+/* This function doesn't use any Ruby API. */
+static inline void
+transpose_block(JCOEF const* src, JCOEF* dst, JCOEF const* sign)
+{
+    int u, v;
+    for (v = 0; v < DCTSIZE; ++v) {
+	for (u = 0; u < DCTSIZE; ++u) {
+	    int const i = v*DCTSIZE + u;
+	    dst[i] = (JCOEF)((src[u*DCTSIZE + v] ^ sign[i]) - sign[i]);
+	}
+    }
+}
+#endif
+
+/* The extents and offsets of a component in blocks. */
+struct component_geometry {
+    long out_width;
+    long out_height;
+    long crop_x;
+    long crop_y;
+    long full_width;		/* exact along the mirrored axes, whose extents are whole MCUs */
+    long full_height;
+    long src_width;
+    long src_height;
+};
+
+static void
+get_component_geometry(struct transform const* t, int const ci, struct component_geometry* g)
+{
+    jpeg_component_info const* comp = &t->src.comp_info[ci];
+    long const h = t->transpose ? comp->v_samp_factor : comp->h_samp_factor;
+    long const v = t->transpose ? comp->h_samp_factor : comp->v_samp_factor;
+    long const mcu_width = DCTSIZE * t->out_max_h_samp_factor;
+    long const mcu_height = DCTSIZE * t->out_max_v_samp_factor;
+
+    g->out_width = (t->width + mcu_width - 1) / mcu_width * h;
+    g->out_height = (t->height + mcu_height - 1) / mcu_height * v;
+    g->crop_x = t->crop_x / mcu_width * h;
+    g->crop_y = t->crop_y / mcu_height * v;
+    g->full_width = t->full_width / mcu_width * h;
+    g->full_height = t->full_height / mcu_height * v;
+    g->src_width = round_up((long)comp->width_in_blocks, comp->h_samp_factor);
+    g->src_height = round_up((long)comp->height_in_blocks, comp->v_samp_factor);
+}
+
+/*
+ * Fills the transposed output blocks of component +ci+, TRANSPOSE_ROWS
+ * rows at a time so that a source row, which gives a column of the
+ * output, is accessed once for all of them.  The blocks outside of the
+ * source, which are only the padding of the edge MCUs, are zeroed.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void
+transpose_component(struct transform* t, jvirt_barray_ptr* src_coefs, int const ci)
+{
+    j_common_ptr const cinfo = (j_common_ptr)&t->src;
+    struct component_geometry g;
+    long ox, oy, k;
+
+    get_component_geometry(t, ci, &g);
+    for (oy = 0; oy < g.out_height; oy += TRANSPOSE_ROWS) {
+	long const n = g.out_height - oy < TRANSPOSE_ROWS ? g.out_height - oy : TRANSPOSE_ROWS;
+	JBLOCKARRAY rows = (* cinfo->mem->access_virt_barray)(
+		cinfo, t->dst_coefs[ci], (JDIMENSION)oy, (JDIMENSION)n, TRUE);
+
+	for (ox = 0; ox < g.out_width; ++ox) {
+	    long const sy = t->mirror_x ? g.full_width - 1 - (ox + g.crop_x) : ox + g.crop_x;
+	    JBLOCKROW src_row = NULL;
+
+	    if (0 <= sy && sy < g.src_height)
+		src_row = (* cinfo->mem->access_virt_barray)(
+			cinfo, src_coefs[ci], (JDIMENSION)sy, 1, FALSE)[0];
+	    for (k = 0; k < n; ++k) {
+		long const sx = t->mirror_y ? g.full_height - 1 - (oy + k + g.crop_y) : oy + k + g.crop_y;
+		if (src_row == NULL || sx < 0 || g.src_width <= sx)
+		    memset(rows[k][ox], 0, sizeof(JBLOCK));
+		else
+		    transpose_block(src_row[sx], rows[k][ox], t->block_sign);
+	    }
+	}
+    }
+}
+
+/* This function doesn't use any Ruby API. */
+static void
+transform_row(struct transform const* t, struct component_geometry const* g,
+	JBLOCKROW src, JBLOCKROW dst)
+{
+    long ox;
+
+    if (!t->mirror_x && !t->mirror_y) {
+	long n = g->src_width - g->crop_x;
+	if (n > g->out_width)
+	    n = g->out_width;
+	memcpy(dst, src + g->crop_x, (size_t)n * sizeof(JBLOCK));
+	memset(dst + n, 0, (size_t)(g->out_width - n) * sizeof(JBLOCK));
+	return;
+    }
+    for (ox = 0; ox < g->out_width; ++ox) {
+	long const x = t->mirror_x ? g->full_width - 1 - (ox + g->crop_x) : ox + g->crop_x;
+	if (x < 0 || g->src_width <= x)
+	    memset(dst[ox], 0, sizeof(JBLOCK));
+	else
+	    mirror_block(src[x], dst[ox], t->block_sign);
+    }
+}
+
+/*
+ * Flips and crops component +ci+ in the source arrays, which saves a
+ * second set of arrays.  A source row is copied before it is written, and
+ * the rows that mirroring exchanges are swapped in pairs.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void
+transform_component_in_place(struct transform* t, jvirt_barray_ptr* src_coefs, int const ci)
+{
+    j_common_ptr const cinfo = (j_common_ptr)&t->src;
+    struct component_geometry g;
+    JBLOCKROW saved, pair;
+    long oy;
+
+    get_component_geometry(t, ci, &g);
+    saved = (JBLOCKROW)(* cinfo->mem->alloc_large)(
+	    cinfo, JPOOL_IMAGE, 2 * (size_t)g.src_width * sizeof(JBLOCK));
+    pair = saved + g.src_width;
+
+    for (oy = 0; oy < g.out_height; ++oy) {
+	long const y = t->mirror_y ? g.full_height - 1 - (oy + g.crop_y) : oy + g.crop_y;
+	JBLOCKROW row;
+
+	if (y < 0 || g.src_height <= y) {
+	    row = (* cinfo->mem->access_virt_barray)(cinfo, src_coefs[ci], (JDIMENSION)oy, 1, TRUE)[0];
+	    memset(row, 0, (size_t)g.out_width * sizeof(JBLOCK));
+	    continue;
+	}
+	if (t->mirror_y && y < g.out_height && y != oy) {
+	    /* row y is the output of the source row oy */
+	    if (y < oy)
+		continue;
+	    memcpy(pair, (* cinfo->mem->access_virt_barray)(
+			cinfo, src_coefs[ci], (JDIMENSION)oy, 1, FALSE)[0],
+		    (size_t)g.src_width * sizeof(JBLOCK));
+	    row = (* cinfo->mem->access_virt_barray)(cinfo, src_coefs[ci], (JDIMENSION)y, 1, TRUE)[0];
+	    memcpy(saved, row, (size_t)g.src_width * sizeof(JBLOCK));
+	    transform_row(t, &g, pair, row);
+	    row = (* cinfo->mem->access_virt_barray)(cinfo, src_coefs[ci], (JDIMENSION)oy, 1, TRUE)[0];
+	    transform_row(t, &g, saved, row);
+	    continue;
+	}
+	/* otherwise the source row is not the output of any later row */
+	memcpy(saved, (* cinfo->mem->access_virt_barray)(
+		    cinfo, src_coefs[ci], (JDIMENSION)y, 1, FALSE)[0],
+		(size_t)g.src_width * sizeof(JBLOCK));
+	row = (* cinfo->mem->access_virt_barray)(cinfo, src_coefs[ci], (JDIMENSION)oy, 1, TRUE)[0];
+	transform_row(t, &g, saved, row);
+    }
+}
+
+/* Reads the coefficients of the source, and sets up the output after them. */
+static void
+start_transform(struct transform* t)
+{
+    j_compress_ptr const dst = &t->dst;
+    int ci;
+
+    t->src_coefs = jpeg_read_coefficients(&t->src);
+
+    jpeg_copy_critical_parameters(&t->src, dst);
+    dst->image_width = (JDIMENSION)t->width;
+    dst->image_height = (JDIMENSION)t->height;
+    if (t->transpose) {
+	UINT16 density = dst->X_density;
+	int i, u, v;
+
+	dst->X_density = dst->Y_density;
+	dst->Y_density = density;
+	for (ci = 0; ci < dst->num_components; ++ci) {
+	    int const samp = dst->comp_info[ci].h_samp_factor;
+	    dst->comp_info[ci].h_samp_factor = dst->comp_info[ci].v_samp_factor;
+	    dst->comp_info[ci].v_samp_factor = samp;
+	}
+	/* the quantization tables follow the transposed coefficients */
+	for (i = 0; i < NUM_QUANT_TBLS; ++i) {
+	    JQUANT_TBL* table = dst->quant_tbl_ptrs[i];
+	    if (table == NULL)
+		continue;
+	    for (v = 0; v < DCTSIZE; ++v) {
+		for (u = v + 1; u < DCTSIZE; ++u) {
+		    UINT16 const q = table->quantval[v*DCTSIZE + u];
+		    table->quantval[v*DCTSIZE + u] = table->quantval[u*DCTSIZE + v];
+		    table->quantval[u*DCTSIZE + v] = q;
+		}
+	    }
+	}
+    }
+    if (t->progressive < 0 ? t->src.progressive_mode : t->progressive)
+	jpeg_simple_progression(dst);
+    dst->optimize_coding = t->optimize_coding ? TRUE : FALSE;
+
+    setup_block_signs(t);
+}
+
+/*
+ * Runs the passes of the transform from t->pass: reading the source, one
+ * pass per component, and compressing the output.  A pending interrupt
+ * stops it between the passes; the next call resumes it.
+ *
+ * This function doesn't use any Ruby API.
+ */
+static void
+transform_coefficients(struct transform* t)
+{
+    while (!t->completed) {
+	int const ci = t->pass - 1;
+
+	if (t->interrupted)
+	    return;
+
+	if (t->pass == 0)
+	    start_transform(t);
+	else if (ci < t->src.num_components) {
+	    if (t->transpose)
+		transpose_component(t, t->src_coefs, ci);
+	    else if (t->mirror_x || t->mirror_y || t->crop_x > 0 || t->crop_y > 0)
+		transform_component_in_place(t, t->src_coefs, ci);
+	}
+	else {
+	    jpeg_write_coefficients(&t->dst, t->dst_coefs != NULL ? t->dst_coefs : t->src_coefs);
+	    write_saved_markers(t);
+	    jpeg_finish_compress(&t->dst);
+	    jpeg_finish_decompress(&t->src);
+	    t->completed = 1;
+	}
+	++t->pass;
+    }
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+transform_without_gvl(void* ptr)
+{
+    struct transform* t = (struct transform*)ptr;
+
+    t->without_gvl = 1;
+    if (setjmp(t->jmpbuf) == 0)
+	transform_coefficients(t);
+    t->without_gvl = 0;
+
+    return NULL;
+}
+
+static void
+interrupt_transform(void* ptr)
+{
+    struct transform* t = (struct transform*)ptr;
+    t->interrupted = 1;
+}
+#endif
+
+static void
+init_transform_source(struct transform* t)
+{
+    j_decompress_ptr const src = &t->src;
+    int m;
+
+    t->src.err = init_error_mgr(&t->src_error);
+    t->src.client_data = (void*)t;
+    jpeg_create_decompress(src);
+    t->src_created = 1;
+
+    t->source_mgr.init_source = init_source;
+    t->source_mgr.fill_input_buffer = fill_input_buffer;
+    t->source_mgr.skip_input_data = skip_input_data;
+    t->source_mgr.resync_to_restart = jpeg_resync_to_restart;
+    t->source_mgr.term_source = term_source;
+    t->source_mgr.next_input_byte = t->data;
+    t->source_mgr.bytes_in_buffer = t->length;
+    src->src = &t->source_mgr;
+
+    if (t->copy_markers != COPY_MARKERS_NONE)
+	jpeg_save_markers(src, JPEG_COM, 0xFFFF);
+    if (t->copy_markers == COPY_MARKERS_ALL) {
+	for (m = 0; m < 16; ++m)
+	    jpeg_save_markers(src, JPEG_APP0 + m, 0xFFFF);
+    }
+
+    jpeg_read_header(src, TRUE);
+}
+
+static void
+init_transform_destination(struct transform* t)
+{
+    t->dst.err = init_error_mgr(&t->dst_error);
+    t->dst.client_data = (void*)t;
+    jpeg_create_compress(&t->dst);
+    t->dst_created = 1;
+
+    t->destination_mgr.init_destination = init_memory_destination;
+    t->destination_mgr.empty_output_buffer = empty_output_buffer_to_memory;
+    t->destination_mgr.term_destination = term_memory_destination;
+    t->dst.dest = &t->destination_mgr;
+}
+
+/*
+ * Trims the partial MCUs at the edges that mirroring would move to the
+ * top or the left, where they cannot be, and aligns the crop region to
+ * the MCUs of the output.
+ */
+static void
+setup_transform_geometry(struct transform* t, VALUE crop)
+{
+    j_decompress_ptr const src = &t->src;
+    long const src_mcu_width = DCTSIZE * src->max_h_samp_factor;
+    long const src_mcu_height = DCTSIZE * src->max_v_samp_factor;
+    long width = (long)src->image_width;
+    long height = (long)src->image_height;
+    long x = 0, y = 0, w, h, unit;
+
+    if (t->transpose ? t->mirror_y : t->mirror_x)
+	width -= width % src_mcu_width;
+    if (t->transpose ? t->mirror_x : t->mirror_y)
+	height -= height % src_mcu_height;
+    if (width == 0 || height == 0)
+	rb_raise(eImageFileJpegTransformerError, "image is smaller than an MCU");
+
+    t->full_width = t->transpose ? height : width;
+    t->full_height = t->transpose ? width : height;
+    t->out_max_h_samp_factor = t->transpose ? src->max_v_samp_factor : src->max_h_samp_factor;
+    t->out_max_v_samp_factor = t->transpose ? src->max_h_samp_factor : src->max_v_samp_factor;
+
+    w = t->full_width;
+    h = t->full_height;
+    if (!NIL_P(crop)) {
+	crop = rb_convert_type(crop, T_ARRAY, "Array", "to_ary");
+	if (RARRAY_LEN(crop) != 4)
+	    rb_raise(rb_eArgError, "crop must be [x, y, width, height]");
+	x = NUM2LONG(RARRAY_PTR(crop)[0]);
+	y = NUM2LONG(RARRAY_PTR(crop)[1]);
+	w = NUM2LONG(RARRAY_PTR(crop)[2]);
+	h = NUM2LONG(RARRAY_PTR(crop)[3]);
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 || w > t->full_width - x || h > t->full_height - y)
+	    rb_raise(rb_eArgError, "crop region must be in the image");
+    }
+    unit = DCTSIZE * t->out_max_h_samp_factor;
+    t->crop_x = x - x % unit;
+    t->width = w + x % unit;
+    unit = DCTSIZE * t->out_max_v_samp_factor;
+    t->crop_y = y - y % unit;
+    t->height = h + y % unit;
+}
+
+/*
+ * Only a transposition needs arrays for the output, which are realized by
+ * jpeg_read_coefficients along with those of the source.
+ */
+static void
+request_output_arrays(struct transform* t)
+{
+    j_decompress_ptr const src = &t->src;
+    long const mcu_width = DCTSIZE * t->out_max_h_samp_factor;
+    long const mcu_height = DCTSIZE * t->out_max_v_samp_factor;
+    int ci;
+
+    if (!t->transpose) {
+	t->dst_coefs = NULL;
+	return;
+    }
+
+    t->dst_coefs = (jvirt_barray_ptr*)(* src->mem->alloc_small)(
+	    (j_common_ptr)src, JPOOL_IMAGE, sizeof(jvirt_barray_ptr) * (size_t)src->num_components);
+    for (ci = 0; ci < src->num_components; ++ci) {
+	jpeg_component_info const* comp = &src->comp_info[ci];
+	long const h = t->transpose ? comp->v_samp_factor : comp->h_samp_factor;
+	long const v = t->transpose ? comp->h_samp_factor : comp->v_samp_factor;
+	t->dst_coefs[ci] = (* src->mem->request_virt_barray)(
+		(j_common_ptr)src, JPOOL_IMAGE, FALSE,
+		(JDIMENSION)((t->width + mcu_width - 1) / mcu_width * h),
+		(JDIMENSION)((t->height + mcu_height - 1) / mcu_height * v),
+		(JDIMENSION)TRANSPOSE_ROWS);
+    }
+}
+
+struct transform_call {
+    struct transform* t;
+    VALUE source;
+    VALUE crop;
+    int transpose;
+    int mirror_x;
+    int mirror_y;
+    int progressive;
+    int optimize_coding;
+    enum copy_markers copy_markers;
+};
+
+static VALUE
+run_transform(VALUE arg)
+{
+    struct transform_call* call = (struct transform_call*)arg;
+    struct transform* t;
+
+    t = call->t = ALLOC(struct transform);
+    MEMZERO(t, struct transform, 1);
+    t->data = (JOCTET const*)RSTRING_PTR(call->source);
+    t->length = (size_t)RSTRING_LEN(call->source);
+    t->transpose = call->transpose;
+    t->mirror_x = call->mirror_x;
+    t->mirror_y = call->mirror_y;
+    t->progressive = call->progressive;
+    t->optimize_coding = call->optimize_coding;
+    t->copy_markers = call->copy_markers;
+
+    init_transform_source(t);
+    setup_transform_geometry(t, call->crop);
+    request_output_arrays(t);
+    init_transform_destination(t);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    while (!t->completed) {
+	t->interrupted = 0;
+	rb_thread_call_without_gvl(transform_without_gvl, t, interrupt_transform, t);
+	if (t->error_message[0] != '\0')
+	    rb_raise(eImageFileJpegTransformerError, "%s", t->error_message);
+	rb_thread_check_ints();
+    }
+#else
+    transform_coefficients(t);
+#endif
+
+    return rb_str_new((char const*)t->memory, (long)t->memory_length);
+}
+
+static VALUE
+cleanup_transform(VALUE arg)
+{
+    struct transform_call* call = (struct transform_call*)arg;
+    struct transform* t = call->t;
+
+    if (t == NULL)
+	return Qnil;
+    if (t->dst_created)
+	jpeg_destroy_compress(&t->dst);
+    if (t->src_created)
+	jpeg_destroy_decompress(&t->src);
+    free(t->memory);
+    xfree(t);
+
+    return Qnil;
+}
+
+/* +data+ is the content of a JPEG file. */
+static VALUE
+jpeg_transformer_initialize(VALUE obj, VALUE data)
+{
+    struct jpeg_transformer_data* transformer;
+
+    StringValue(data);
+    transformer = get_jpeg_transformer_data(obj);
+    transformer->source = rb_str_new_frozen(data);
+
+    return obj;
+}
+
+static VALUE
+jpeg_transformer_s_open(VALUE klass, VALUE path)
+{
+    VALUE data = rb_funcall(rb_cFile, id_binread, 1, path);
+    return rb_funcall(klass, id_new, 1, data);
+}
+
+static void
+set_rotation(struct transform_call* call, VALUE rotate, VALUE flip)
+{
+    int degrees = 0;
+
+    if (!NIL_P(rotate)) {
+	degrees = NUM2INT(rotate) % 360;
+	if (degrees < 0)
+	    degrees += 360;
+	if (degrees % 90 != 0)
+	    rb_raise(rb_eArgError, "rotate must be a multiple of 90");
+    }
+    /* clockwise */
+    call->transpose = degrees == 90 || degrees == 270;
+    call->mirror_x = degrees == 90 || degrees == 180;
+    call->mirror_y = degrees == 180 || degrees == 270;
+
+    if (!NIL_P(flip)) {
+	Check_Type(flip, T_SYMBOL);
+	if (SYM2ID(flip) == id_horizontal)
+	    call->mirror_x = !call->mirror_x;
+	else if (SYM2ID(flip) == id_vertical)
+	    call->mirror_y = !call->mirror_y;
+	else
+	    rb_raise(rb_eArgError, "unknown flip");
+    }
+}
+
+/*
+ * Returns the transformed JPEG file as a String.  The parameters are
+ * :rotate, clockwise by a multiple of 90 degrees, :flip, :horizontal or
+ * :vertical after the rotation, and :crop, [x, y, width, height] of the
+ * rotated image.  The partial MCUs that a rotation or flip would move to
+ * the top or the left are trimmed, and x and y of :crop are rounded down
+ * to the MCU boundaries, as the blocks cannot be split.
+ *
+ * The output is progressive if the source is, or with :progressive, and
+ * has optimized Huffman tables with :optimize_coding.  :copy_markers is
+ * :all (by default), :comments or :none.  The orientation of a copied
+ * Exif segment is reset to the top-left by a rotation or flip.
+ */
+static VALUE
+jpeg_transformer_transform(int argc, VALUE* argv, VALUE obj)
+{
+    struct jpeg_transformer_data* transformer;
+    struct transform_call call;
+    VALUE params, progressive = Qnil, copy_markers = Qnil;
+
+    rb_scan_args(argc, argv, "01", &params);
+    transformer = get_jpeg_transformer_data(obj);
+    if (NIL_P(transformer->source))
+	rb_raise(eImageFileJpegTransformerError, "transformer not initialized");
+
+    call.t = NULL;
+    call.source = transformer->source;
+    call.crop = Qnil;
+    call.optimize_coding = 0;
+    set_rotation(&call, Qnil, Qnil);
+    if (TYPE(params) == T_HASH) {
+	set_rotation(&call, rb_hash_lookup(params, ID2SYM(id_rotate)), rb_hash_lookup(params, ID2SYM(id_flip)));
+	call.crop = rb_hash_lookup(params, ID2SYM(id_crop));
+	call.optimize_coding = RTEST(rb_hash_lookup(params, ID2SYM(id_optimize_coding)));
+	progressive = rb_hash_lookup(params, ID2SYM(id_progressive));
+	copy_markers = rb_hash_lookup(params, ID2SYM(id_copy_markers));
+    }
+    call.progressive = NIL_P(progressive) ? -1 : RTEST(progressive);
+
+    call.copy_markers = COPY_MARKERS_ALL;
+    if (!NIL_P(copy_markers)) {
+	Check_Type(copy_markers, T_SYMBOL);
+	if (SYM2ID(copy_markers) == id_comments)
+	    call.copy_markers = COPY_MARKERS_COMMENTS;
+	else if (SYM2ID(copy_markers) == id_none)
+	    call.copy_markers = COPY_MARKERS_NONE;
+	else if (SYM2ID(copy_markers) != id_all)
+	    rb_raise(rb_eArgError, "unknown copy_markers");
+    }
+
+    return rb_ensure(run_transform, (VALUE)&call, cleanup_transform, (VALUE)&call);
+}
+
+/* Same as JpegTransformer.new(data).transform(params). */
+static VALUE
+jpeg_transformer_s_transform(int argc, VALUE* argv, VALUE klass)
+{
+    VALUE data, params, obj;
+
+    rb_scan_args(argc, argv, "11", &data, &params);
+    obj = rb_funcall(klass, id_new, 1, data);
+    return jpeg_transformer_transform(argc - 1, argv + 1, obj);
+}
+
+void
+rb_image_file_Init_image_file_jpeg_transformer(void)
+{
+    cImageFileJpegTransformer = rb_define_class_under(mImageFile, "JpegTransformer", rb_cObject);
+    rb_define_alloc_func(cImageFileJpegTransformer, jpeg_transformer_alloc);
+    rb_define_singleton_method(cImageFileJpegTransformer, "open", jpeg_transformer_s_open, 1);
+    rb_define_singleton_method(cImageFileJpegTransformer, "transform", jpeg_transformer_s_transform, -1);
+    rb_define_method(cImageFileJpegTransformer, "initialize", jpeg_transformer_initialize, 1);
+
+    rb_define_method(cImageFileJpegTransformer, "transform", jpeg_transformer_transform, -1);
+
+    eImageFileJpegTransformerError = rb_define_class_under(
+	    cImageFileJpegTransformer, "Error", rb_eStandardError);
+
+    CONST_ID(id_new, "new");
+    CONST_ID(id_binread, "binread");
+    CONST_ID(id_rotate, "rotate");
+    CONST_ID(id_flip, "flip");
+    CONST_ID(id_horizontal, "horizontal");
+    CONST_ID(id_vertical, "vertical");
+    CONST_ID(id_crop, "crop");
+    CONST_ID(id_progressive, "progressive");
+    CONST_ID(id_optimize_coding, "optimize_coding");
+    CONST_ID(id_copy_markers, "copy_markers");
+    CONST_ID(id_all, "all");
+    CONST_ID(id_comments, "comments");
+    CONST_ID(id_none, "none");
+}
@@ -0,0 +1,985 @@
+#include "internal.h"
+#include <ruby/io.h>
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+
+#include <setjmp.h>
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#undef EXTERN
+#include <jpeglib.h>
+#include <jerror.h>
+
+#ifdef HAVE_UNISTD_H
+# define USE_NATIVE_FILE_DESTINATION 1
+#endif
+
+static size_t const OUTPUT_BUFFER_SIZE = 65536U;
+static size_t const INITIAL_MEMORY_SIZE = 65536U;
+
+/* number of scanlines passed to jpeg_write_scanlines at once */
+#define BAND_HEIGHT 16
+
+VALUE cImageFileJpegWriter = Qnil;
+VALUE eImageFileJpegWriterError = Qnil;
+
+static ID id_new;
+static ID id_write;
+static ID id_close;
+static ID id_pixel_format;
+static ID id_width;
+static ID id_height;
+static ID id_row_stride;
+static ID id_quality;
+static ID id_progressive;
+static ID id_optimize_coding;
+static ID id_restart_interval;
+
+/*
+ * Returns the extended color space of libjpeg-turbo whose memory layout
+ * is the same as the pixel format, so that the rows of an image are
+ * compressed in place, or JCS_RGB if the rows must be converted.  The
+ * alpha channel of ARGB32 is ignored.
+ */
+static J_COLOR_SPACE
+image_pixel_format_to_in_color_space(rb_image_file_image_pixel_format_t const pf)
+{
+    switch (pf) {
+#ifdef JCS_EXTENSIONS
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32:
+	case RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24:
+# ifdef WORDS_BIGENDIAN
+	    return JCS_EXT_XRGB;
+# else
+	    return JCS_EXT_BGRX;
+# endif
+#endif
+
+	default:
+	    break;
+    }
+    return JCS_RGB;
+}
+
+enum jpeg_writer_state {
+    WRITER_ALLOCATED = 0,
+    WRITER_INITIALIZED,
+    WRITER_STARTED_COMPRESS,
+    WRITER_FINISHED_COMPRESS,
+    WRITER_FAILED
+};
+
+enum jpeg_writer_destination_type {
+    DESTINATION_IO = 0,	/* Ruby IO object, written via IO#write */
+    DESTINATION_FILE,	/* regular file written by write(2) */
+    DESTINATION_MEMORY	/* buffer grown by realloc(3), returned as a String */
+};
+
+struct jpeg_writer_data {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr error;
+    VALUE destination;
+    enum jpeg_writer_state state;
+    enum jpeg_writer_destination_type destination_type;
+    int fd;
+    JOCTET* output_buffer;
+    JOCTET* memory;
+    size_t memory_length;
+    size_t memory_capacity;
+    JSAMPARRAY band;
+    JSAMPARRAY converted;	/* rows converted to RGB, or NULL */
+    rb_image_file_image_pixel_format_t pixel_format;
+    long width;
+    jmp_buf jmpbuf;
+    char error_message[JMSG_LENGTH_MAX];
+    unsigned close_destination: 1;
+    unsigned without_gvl: 1;
+    unsigned busy: 1;		/* a thread is writing with it */
+};
+
+static void
+jpeg_writer_mark(void* ptr)
+{
+    struct jpeg_writer_data* writer = (struct jpeg_writer_data*)ptr;
+    rb_gc_mark(writer->destination);
+}
+
+static void
+jpeg_writer_free(void* ptr)
+{
+    struct jpeg_writer_data* writer = (struct jpeg_writer_data*)ptr;
+
+    if (writer->memory != NULL) {
+	free(writer->memory);
+	writer->memory = NULL;
+    }
+    writer->destination = Qnil;
+    jpeg_destroy_compress(&writer->cinfo);
+    xfree(ptr);
+}
+
+static size_t
+jpeg_writer_memsize(void const* ptr)
+{
+    if (ptr == NULL)
+	return 0;
+    return sizeof(struct jpeg_writer_data) + ((struct jpeg_writer_data const*)ptr)->memory_capacity;
+}
+
+static rb_data_type_t const jpeg_writer_data_type = {
+    "image_file::jpeg_writer",
+#if RUBY_VERSION >= 193
+    {
+#endif
+	jpeg_writer_mark,
+	jpeg_writer_free,
+	jpeg_writer_memsize,
+#if RUBY_VERSION >= 193
+    },
+#endif
+};
+
+static VALUE
+jpeg_writer_alloc(VALUE klass)
+{
+    struct jpeg_writer_data* writer;
+    VALUE obj = TypedData_Make_Struct(
+	    klass, struct jpeg_writer_data, &jpeg_writer_data_type, writer);
+    writer->destination = Qnil;
+    writer->state = WRITER_ALLOCATED;
+    writer->destination_type = DESTINATION_IO;
+    writer->fd = -1;
+    writer->output_buffer = NULL;
+    writer->memory = NULL;
+    writer->memory_length = 0;
+    writer->memory_capacity = 0;
+    writer->band = NULL;
+    writer->converted = NULL;
+    writer->pixel_format = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID;
+    writer->width = 0;
+    writer->close_destination = 0;
+    writer->without_gvl = 0;
+    writer->busy = 0;
+    return obj;
+}
+
+static struct jpeg_writer_data*
+get_jpeg_writer_data(VALUE obj)
+{
+    struct jpeg_writer_data* writer;
+    TypedData_Get_Struct(obj, struct jpeg_writer_data, &jpeg_writer_data_type, writer);
+    return writer;
+}
+
+static inline void
+writer_check_not_busy(struct jpeg_writer_data* writer)
+{
+    assert(writer != NULL);
+    if (writer->busy) {
+	rb_raise(eImageFileJpegWriterError, "writer is in use by another thread");
+    }
+}
+
+/*
+ * Without the GVL, an error cannot be raised here.  The message is saved
+ * and the control returns to the setjmp point in compress_without_gvl.
+ */
+static void
+error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_writer_data* writer = (struct jpeg_writer_data*)cinfo->client_data;
+    char message[JMSG_LENGTH_MAX];
+
+    if (writer != NULL && writer->without_gvl) {
+	(* cinfo->err->format_message)(cinfo, writer->error_message);
+	longjmp(writer->jmpbuf, 1);
+    }
+
+    (* cinfo->err->format_message)(cinfo, message);
+    rb_raise(eImageFileJpegWriterError, "%s", message);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+output_message_with_gvl(void* message)
+{
+    rb_warning("%s", (char const*)message);
+    return NULL;
+}
+#endif
+
+static void
+output_message(j_common_ptr cinfo)
+{
+    struct jpeg_writer_data* writer = (struct jpeg_writer_data*)cinfo->client_data;
+    char message[JMSG_LENGTH_MAX];
+
+    (* cinfo->err->format_message)(cinfo, message);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (writer != NULL && writer->without_gvl) {
+	rb_thread_call_with_gvl(output_message_with_gvl, message);
+	return;
+    }
+#else
+    (void)writer;
+#endif
+    rb_warning("%s", message);
+}
+
+static struct jpeg_error_mgr*
+init_error_mgr(struct jpeg_error_mgr* err)
+{
+    jpeg_std_error(err);
+    err->error_exit = error_exit;
+    err->output_message = output_message;
+    return err;
+}
+
+static void
+init_destination(j_compress_ptr cinfo)
+{
+    struct jpeg_writer_data* writer;
+
+    assert(cinfo != NULL);
+
+    writer = (struct jpeg_writer_data*)cinfo->client_data;
+    cinfo->dest->next_output_byte = writer->output_buffer;
+    cinfo->dest->free_in_buffer = OUTPUT_BUFFER_SIZE;
+}
+
+static void
+write_to_io(struct jpeg_writer_data* writer, size_t const length)
+{
+    if (length > 0) {
+	rb_funcall(writer->destination, id_write, 1,
+		rb_str_new((char const*)writer->output_buffer, (long)length));
+    }
+}
+
+/* libjpeg requires the whole buffer to be written, regardless of free_in_buffer. */
+static boolean
+empty_output_buffer(j_compress_ptr cinfo)
+{
+    struct jpeg_writer_data* writer;
+
+    assert(cinfo != NULL);
+
+    writer = (struct jpeg_writer_data*)cinfo->client_data;
+    write_to_io(writer, OUTPUT_BUFFER_SIZE);
+    cinfo->dest->next_output_byte = writer->output_buffer;
+    cinfo->dest->free_in_buffer = OUTPUT_BUFFER_SIZE;
+
+    return TRUE;
+}
+
+static void
+term_destination(j_compress_ptr cinfo)
+{
+    struct jpeg_writer_data* writer;
+
+    assert(cinfo != NULL);
+
+    writer = (struct jpeg_writer_data*)cinfo->client_data;
+    write_to_io(writer, OUTPUT_BUFFER_SIZE - cinfo->dest->free_in_buffer);
+}
+
+#ifdef USE_NATIVE_FILE_DESTINATION
+static void
+write_to_fd(j_compress_ptr cinfo, size_t const length)
+{
+    struct jpeg_writer_data* writer = (struct jpeg_writer_data*)cinfo->client_data;
+    JOCTET const* p = writer->output_buffer;
+    size_t rest = length;
+
+    while (rest > 0) {
+	ssize_t const len = write(writer->fd, p, rest);
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    ERREXIT(cinfo, JERR_FILE_WRITE);
+	}
+	p += len;
+	rest -= (size_t)len;
+    }
+}
+
+static boolean
+empty_output_buffer_to_fd(j_compress_ptr cinfo)
+{
+    struct jpeg_writer_data* writer;
+
+    assert(cinfo != NULL);
+
+    writer = (struct jpeg_writer_data*)cinfo->client_data;
+    write_to_fd(cinfo, OUTPUT_BUFFER_SIZE);
+    cinfo->dest->next_output_byte = writer->output_buffer;
+    cinfo->dest->free_in_buffer = OUTPUT_BUFFER_SIZE;
+
+    return TRUE;
+}
+
+static void
+term_destination_to_fd(j_compress_ptr cinfo)
+{
+    write_to_fd(cinfo, OUTPUT_BUFFER_SIZE - cinfo->dest->free_in_buffer);
+}
+#endif /* USE_NATIVE_FILE_DESTINATION */
+
+/*
+ * The memory destination compresses into a single block, which is doubled
+ * whenever it is full.  It is allocated by malloc(3) rather than xmalloc,
+ * because it may grow without the GVL.
+ */
+static void
+init_memory_destination(j_compress_ptr cinfo)
+{
+    struct jpeg_writer_data* writer;
+
+    assert(cinfo != NULL);
+
+    writer = (struct jpeg_writer_data*)cinfo->client_data;
+    if (writer->memory == NULL) {
+	writer->memory = (JOCTET*)malloc(INITIAL_MEMORY_SIZE);
+	if (writer->memory == NULL)
+	    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	writer->memory_capacity = INITIAL_MEMORY_SIZE;
+    }
+    writer->memory_length = 0;
+    cinfo->dest->next_output_byte = writer->memory;
+    cinfo->dest->free_in_buffer = writer->memory_capacity;
+}
+
+static boolean
+empty_output_buffer_to_memory(j_compress_ptr cinfo)
+{
+    struct jpeg_writer_data* writer;
+    size_t capacity;
+    JOCTET* memory;
+
+    assert(cinfo != NULL);
+
+    writer = (struct jpeg_writer_data*)cinfo->client_data;
+    capacity = writer->memory_capacity;
+    memory = (JOCTET*)realloc(writer->memory, 2*capacity);
+    if (memory == NULL)
+	ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+    writer->memory = memory;
+    writer->memory_capacity = 2*capacity;
+    cinfo->dest->next_output_byte = memory + capacity;
+    cinfo->dest->free_in_buffer = capacity;
+
+    return TRUE;
+}
+
+static void
+term_memory_destination(j_compress_ptr cinfo)
+{
+    struct jpeg_writer_data* writer;
+
+    assert(cinfo != NULL);
+
+    writer = (struct jpeg_writer_data*)cinfo->client_data;
+    writer->memory_length = writer->memory_capacity - cinfo->dest->free_in_buffer;
+}
+
+static void
+init_destination_mgr(struct jpeg_writer_data* writer)
+{
+    struct jpeg_destination_mgr* dest = NULL;
+
+    assert(writer != NULL);
+
+    if (writer->cinfo.dest == NULL) {
+	writer->cinfo.dest = (struct jpeg_destination_mgr*)
+	    (* writer->cinfo.mem->alloc_small)(
+		    (j_common_ptr)&writer->cinfo,
+		    JPOOL_PERMANENT,
+		    sizeof(struct jpeg_destination_mgr));
+    }
+    if (writer->output_buffer == NULL) {
+	writer->output_buffer = (JOCTET*)
+	    (* writer->cinfo.mem->alloc_small)(
+		    (j_common_ptr)&writer->cinfo,
+		    JPOOL_PERMANENT,
+		    OUTPUT_BUFFER_SIZE);
+    }
+
+    dest = writer->cinfo.dest;
+    dest->init_destination = init_destination;
+    dest->empty_output_buffer = empty_output_buffer;
+    dest->term_destination = term_destination;
+    dest->next_output_byte = NULL;
+    dest->free_in_buffer = 0;
+    writer->destination_type = DESTINATION_IO;
+}
+
+static void
+init_memory_destination_mgr(struct jpeg_writer_data* writer)
+{
+    struct jpeg_destination_mgr* dest;
+
+    assert(writer != NULL);
+    assert(writer->cinfo.dest != NULL);
+
+    dest = writer->cinfo.dest;
+    dest->init_destination = init_memory_destination;
+    dest->empty_output_buffer = empty_output_buffer_to_memory;
+    dest->term_destination = term_memory_destination;
+    writer->destination_type = DESTINATION_MEMORY;
+}
+
+#ifdef USE_NATIVE_FILE_DESTINATION
+/*
+ * Switches the destination manager to write the regular file +fd+
+ * directly, without calling IO#write.  Other kinds of files are left to
+ * the Ruby IO destination manager.
+ */
+static void
+init_file_destination_mgr(struct jpeg_writer_data* writer, int const fd)
+{
+    struct jpeg_destination_mgr* dest;
+    struct stat st;
+
+    assert(writer != NULL);
+    assert(writer->cinfo.dest != NULL);
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+	return;
+
+    dest = writer->cinfo.dest;
+    dest->empty_output_buffer = empty_output_buffer_to_fd;
+    dest->term_destination = term_destination_to_fd;
+    writer->fd = fd;
+    writer->destination_type = DESTINATION_FILE;
+}
+#endif
+
+static void
+writer_init(struct jpeg_writer_data* writer, VALUE destination)
+{
+    writer->cinfo.err = init_error_mgr(&writer->error);
+    writer->cinfo.client_data = (void*)writer;
+    jpeg_create_compress(&writer->cinfo);
+    init_destination_mgr(writer);
+    writer->destination = destination;
+    writer->state = WRITER_INITIALIZED;
+}
+
+/* The compressed data are written to +destination+ by its write method. */
+static VALUE
+jpeg_writer_initialize(VALUE obj, VALUE destination)
+{
+    struct jpeg_writer_data* writer;
+
+    if (!rb_respond_to(destination, id_write))
+	rb_raise(rb_eTypeError, "wrong argument type %s (expected an IO)",
+		rb_obj_classname(destination));
+
+    writer = get_jpeg_writer_data(obj);
+    writer_check_not_busy(writer);
+    writer_init(writer, destination);
+    return obj;
+}
+
+static VALUE
+jpeg_writer_s_open(VALUE klass, VALUE path)
+{
+    struct jpeg_writer_data* writer;
+    VALUE obj, io;
+
+    io = rb_file_open_str(path, "wb");
+    obj = rb_funcall(klass, id_new, 1, io);
+    writer = get_jpeg_writer_data(obj);
+    writer->close_destination = 1;
+#ifdef USE_NATIVE_FILE_DESTINATION
+    init_file_destination_mgr(writer, rb_image_file_io_descriptor(io));
+#endif
+
+    return obj;
+}
+
+static VALUE
+jpeg_writer_destination_will_be_closed(VALUE obj)
+{
+    struct jpeg_writer_data* writer;
+    writer = get_jpeg_writer_data(obj);
+    return writer->close_destination ? Qtrue : Qfalse;
+}
+
+static VALUE
+jpeg_writer_is_finished(VALUE obj)
+{
+    struct jpeg_writer_data* writer;
+    writer = get_jpeg_writer_data(obj);
+    return writer->state == WRITER_FINISHED_COMPRESS ? Qtrue : Qfalse;
+}
+
+static inline void
+writer_check_initialized(struct jpeg_writer_data* writer)
+{
+    assert(writer != NULL);
+    writer_check_not_busy(writer);
+    if (writer->state < WRITER_INITIALIZED) {
+	rb_raise(eImageFileJpegWriterError, "writer not initialized");
+    }
+    if (writer->state == WRITER_FAILED) {
+	rb_raise(eImageFileJpegWriterError, "compression has failed");
+    }
+}
+
+static inline void
+writer_check_not_finished(struct jpeg_writer_data* writer)
+{
+    assert(writer != NULL);
+    if (writer->state >= WRITER_FINISHED_COMPRESS) {
+	rb_raise(eImageFileJpegWriterError, "compression has already been finished");
+    }
+}
+
+static void
+check_image(VALUE image)
+{
+    if (!RTEST(rb_obj_is_kind_of(image, cImageFileImage)))
+	rb_raise(rb_eTypeError, "wrong argument type %s (expected ImageFile::Image)",
+		rb_obj_classname(image));
+}
+
+static rb_image_file_image_pixel_format_t
+image_pixel_format(VALUE image)
+{
+    return rb_image_file_image_symbol_to_pixel_format(rb_funcall(image, id_pixel_format, 0));
+}
+
+static void
+xrgb32_to_rgb(uint32_t const* src, JSAMPROW dst, long const n)
+{
+    long i;
+    for (i = 0; i < n; ++i, dst += 3) {
+	uint32_t const p = src[i];
+	dst[0] = (JSAMPLE)((p >> 16) & 0xFF);
+	dst[1] = (JSAMPLE)((p >> 8) & 0xFF);
+	dst[2] = (JSAMPLE)(p & 0xFF);
+    }
+}
+
+static void
+rgb16_565_to_rgb(uint16_t const* src, JSAMPROW dst, long const n)
+{
+    long i;
+    for (i = 0; i < n; ++i, dst += 3) {
+	uint16_t const p = src[i];
+	unsigned int const r = (p >> 11) & 0x1F;
+	unsigned int const g = (p >> 5) & 0x3F;
+	unsigned int const b = p & 0x1F;
+	dst[0] = (JSAMPLE)((r << 3) | (r >> 2));
+	dst[1] = (JSAMPLE)((g << 2) | (g >> 4));
+	dst[2] = (JSAMPLE)((b << 3) | (b >> 2));
+    }
+}
+
+/*
+ * Processes the parameters of write_image, and starts compression of an
+ * image of +height+ scanlines that have the width and the pixel format
+ * of +image+.
+ */
+static void
+start_compress(struct jpeg_writer_data* writer, VALUE image, VALUE params, long const height)
+{
+    j_compress_ptr const cinfo = &writer->cinfo;
+    rb_image_file_image_pixel_format_t const pf = image_pixel_format(image);
+    long const width = NUM2LONG(rb_funcall(image, id_width, 0));
+    J_COLOR_SPACE const in_color_space = image_pixel_format_to_in_color_space(pf);
+    VALUE quality = Qnil;
+    VALUE progressive = Qnil;
+    VALUE optimize_coding = Qnil;
+    VALUE restart_interval = Qnil;
+    int q = 75;
+    long ri = 0;
+
+    if (TYPE(params) == T_HASH) {
+	quality = rb_hash_lookup(params, ID2SYM(id_quality));
+	progressive = rb_hash_lookup(params, ID2SYM(id_progressive));
+	optimize_coding = rb_hash_lookup(params, ID2SYM(id_optimize_coding));
+	restart_interval = rb_hash_lookup(params, ID2SYM(id_restart_interval));
+    }
+    if (!NIL_P(quality)) {
+	q = NUM2INT(quality);
+	if (q < 0 || 100 < q)
+	    rb_raise(rb_eArgError, "quality must be in 0..100");
+    }
+    if (!NIL_P(restart_interval)) {
+	ri = NUM2LONG(restart_interval);
+	if (ri < 0 || 65535 < ri)
+	    rb_raise(rb_eArgError, "restart_interval must be in 0..65535");
+    }
+
+    cinfo->image_width = (JDIMENSION)width;
+    cinfo->image_height = (JDIMENSION)height;
+    cinfo->in_color_space = in_color_space;
+    cinfo->input_components = JCS_RGB == in_color_space ? 3 : 4;
+    writer->state = WRITER_STARTED_COMPRESS;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, q, TRUE);
+    if (RTEST(progressive))
+	jpeg_simple_progression(cinfo);
+    cinfo->optimize_coding = RTEST(optimize_coding) ? TRUE : FALSE;
+    cinfo->restart_interval = (unsigned int)ri;
+    jpeg_start_compress(cinfo, TRUE);
+
+    writer->band = (JSAMPARRAY)
+	(* cinfo->mem->alloc_small)(
+		(j_common_ptr)cinfo, JPOOL_IMAGE, BAND_HEIGHT*sizeof(JSAMPROW));
+    if (JCS_RGB == in_color_space) {
+	writer->converted = (* cinfo->mem->alloc_sarray)(
+		(j_common_ptr)cinfo, JPOOL_IMAGE, (JDIMENSION)width*3, BAND_HEIGHT);
+    }
+    else
+	writer->converted = NULL;
+    writer->pixel_format = pf;
+    writer->width = width;
+}
+
+struct compress_args {
+    struct jpeg_writer_data* writer;
+    char const* image_buffer;
+    long stride;
+    long nrows;
+    long row;			/* next row of the image to be written */
+    int volatile interrupted;
+    int completed;
+};
+
+/*
+ * The rows are handed to libjpeg directly from the buffer of the image if
+ * its layout is an input color space of libjpeg; otherwise only a band of
+ * BAND_HEIGHT rows is converted at a time.
+ *
+ * This function must not call any Ruby API; it may run without the GVL.
+ */
+static void
+compress_scanlines(struct compress_args* args)
+{
+    struct jpeg_writer_data* writer = args->writer;
+    j_compress_ptr const cinfo = &writer->cinfo;
+    long const row_size = args->stride*pixel_format_size(writer->pixel_format);
+
+    while (args->row < args->nrows) {
+	char const* src = args->image_buffer + args->row*row_size;
+	long nrows = args->nrows - args->row;
+	long i;
+
+	if (args->interrupted)
+	    return;
+
+	if (nrows > BAND_HEIGHT)
+	    nrows = BAND_HEIGHT;
+
+	for (i = 0; i < nrows; ++i, src += row_size) {
+	    if (writer->converted == NULL) {
+		writer->band[i] = (JSAMPROW)src;
+		continue;
+	    }
+	    if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == writer->pixel_format)
+		rgb16_565_to_rgb((uint16_t const*)src, writer->converted[i], writer->width);
+	    else
+		xrgb32_to_rgb((uint32_t const*)src, writer->converted[i], writer->width);
+	    writer->band[i] = writer->converted[i];
+	}
+	args->row += (long)jpeg_write_scanlines(cinfo, writer->band, (JDIMENSION)nrows);
+    }
+
+    if (cinfo->next_scanline >= cinfo->image_height) {
+	jpeg_finish_compress(cinfo);
+	writer->band = NULL;
+	writer->converted = NULL;
+	writer->state = WRITER_FINISHED_COMPRESS;
+    }
+    args->completed = 1;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+compress_without_gvl(void* ptr)
+{
+    struct compress_args* args = (struct compress_args*)ptr;
+    struct jpeg_writer_data* writer = args->writer;
+
+    writer->without_gvl = 1;
+    if (setjmp(writer->jmpbuf) == 0)
+	compress_scanlines(args);
+    else
+	args->interrupted = -1;
+    writer->without_gvl = 0;
+
+    return NULL;
+}
+
+static void
+interrupt_compress(void* ptr)
+{
+    struct compress_args* args = (struct compress_args*)ptr;
+    args->interrupted = 1;
+}
+#endif
+
+/*
+ * Native destinations never call back into Ruby, so they are compressed
+ * without the GVL.  A pending interrupt stops compression between bands;
+ * it is resumed if the interrupt did not raise.
+ */
+static void
+compress(struct compress_args* args)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    struct jpeg_writer_data* writer = args->writer;
+
+    args->completed = 0;
+    if (writer->destination_type != DESTINATION_IO) {
+	while (!args->completed) {
+	    args->interrupted = 0;
+	    rb_thread_call_without_gvl(compress_without_gvl, args, interrupt_compress, args);
+	    if (args->interrupted < 0)
+		rb_raise(eImageFileJpegWriterError, "%s", writer->error_message);
+	    rb_thread_check_ints();
+	}
+	return;
+    }
+#endif
+    compress_scanlines(args);
+}
+
+/* Compresses all the scanlines of +image+, and closes the destination after the last one. */
+static void
+compress_image(struct jpeg_writer_data* writer, VALUE image, long const nrows)
+{
+    struct compress_args args;
+
+    args.writer = writer;
+    args.image_buffer = RSTRING_PTR(rb_image_file_image_get_buffer(image));
+    args.stride = NUM2LONG(rb_funcall(image, id_row_stride, 0));
+    args.nrows = nrows;
+    args.row = 0;
+    args.interrupted = 0;
+    compress(&args);
+
+    RB_GC_GUARD(image);
+
+    if (writer->state == WRITER_FINISHED_COMPRESS && writer->close_destination) {
+	rb_funcall(writer->destination, id_close, 0);
+    }
+}
+
+static VALUE
+writer_clear_busy(VALUE arg)
+{
+    ((struct jpeg_writer_data*)arg)->busy = 0;
+    return Qnil;
+}
+
+/*
+ * Runs +func+ while the writer is busy.  Compression may release the GVL
+ * or call IO#write, so other threads can run; they get an error instead
+ * of touching the compressor.
+ */
+static VALUE
+writer_run_busy(struct jpeg_writer_data* writer, VALUE (*func)(VALUE), VALUE arg)
+{
+    writer_check_not_busy(writer);
+    writer->busy = 1;
+    return rb_ensure(func, arg, writer_clear_busy, (VALUE)writer);
+}
+
+struct write_args {
+    struct jpeg_writer_data* writer;
+    VALUE image;
+    VALUE params;
+    long height;		/* of the file, used when compression is started */
+    long nrows;
+};
+
+static VALUE
+write_0(VALUE arg)
+{
+    struct write_args* args = (struct write_args*)arg;
+
+    if (args->writer->state < WRITER_STARTED_COMPRESS)
+	start_compress(args->writer, args->image, args->params, args->height);
+    compress_image(args->writer, args->image, args->nrows);
+    return Qnil;
+}
+
+/*
+ * Starts compression if needed and compresses the rows of the image.  An
+ * error of libjpeg, of IO#write or an interrupt may leave libjpeg in the
+ * middle of the image, so compression is aborted and the writer fails.
+ */
+static void
+write_rows(struct write_args* args)
+{
+    struct jpeg_writer_data* writer = args->writer;
+    int status = 0;
+
+    rb_protect(write_0, (VALUE)args, &status);
+    if (status) {
+	if (writer->state == WRITER_STARTED_COMPRESS) {
+	    jpeg_abort_compress(&writer->cinfo);
+	    writer->band = NULL;
+	    writer->converted = NULL;
+	    writer->state = WRITER_FAILED;
+	}
+	rb_jump_tag(status);
+    }
+}
+
+static VALUE
+write_image_0(VALUE arg)
+{
+    struct write_args* args = (struct write_args*)arg;
+
+    if (args->writer->state >= WRITER_STARTED_COMPRESS) {
+	rb_raise(eImageFileJpegWriterError, "compression has already been started");
+    }
+    args->height = args->nrows = NUM2LONG(rb_funcall(args->image, id_height, 0));
+    write_rows(args);
+    return Qnil;
+}
+
+/*
+ * Compresses +image+ as a whole JPEG file.  The parameters are :quality
+ * (0..100, 75 by default), :progressive, :optimize_coding and
+ * :restart_interval, the number of MCUs between restart markers (none by
+ * default).
+ */
+static VALUE
+jpeg_writer_write_image(int argc, VALUE* argv, VALUE obj)
+{
+    struct write_args args;
+
+    rb_scan_args(argc, argv, "11", &args.image, &args.params);
+    check_image(args.image);
+
+    args.writer = get_jpeg_writer_data(obj);
+    writer_check_initialized(args.writer);
+    writer_run_busy(args.writer, write_image_0, (VALUE)&args);
+
+    return obj;
+}
+
+static VALUE
+write_scanlines_0(VALUE arg)
+{
+    struct write_args* args = (struct write_args*)arg;
+    struct jpeg_writer_data* writer = args->writer;
+    VALUE height = Qnil;
+    long rest;
+
+    writer_check_not_finished(writer);
+
+    args->nrows = NUM2LONG(rb_funcall(args->image, id_height, 0));
+    if (writer->state < WRITER_STARTED_COMPRESS) {
+	if (TYPE(args->params) == T_HASH)
+	    height = rb_hash_lookup(args->params, ID2SYM(id_height));
+	args->height = NIL_P(height) ? args->nrows : NUM2LONG(height);
+	rest = args->height;
+    }
+    else {
+	if (image_pixel_format(args->image) != writer->pixel_format
+		|| NUM2LONG(rb_funcall(args->image, id_width, 0)) != writer->width) {
+	    rb_raise(rb_eArgError, "the image must have the same width and pixel format as the first one");
+	}
+	rest = (long)(writer->cinfo.image_height - writer->cinfo.next_scanline);
+    }
+    if (args->nrows > rest)
+	rb_raise(rb_eArgError, "too many scanlines (%ld for %ld)", args->nrows, rest);
+
+    write_rows(args);
+    return Qnil;
+}
+
+/*
+ * Appends the rows of +image+ to the file.  The first call starts the
+ * compression with the parameters of write_image and :height, the height
+ * of the whole file, which defaults to the height of +image+.  The
+ * following images must have the same width and pixel format.  The file
+ * is finished by the last scanline.  If compression fails, the writer
+ * can no longer be used.
+ */
+static VALUE
+jpeg_writer_write_scanlines(int argc, VALUE* argv, VALUE obj)
+{
+    struct write_args args;
+
+    rb_scan_args(argc, argv, "11", &args.image, &args.params);
+    check_image(args.image);
+
+    args.writer = get_jpeg_writer_data(obj);
+    writer_check_initialized(args.writer);
+    writer_run_busy(args.writer, write_scanlines_0, (VALUE)&args);
+
+    return obj;
+}
+
+/*
+ * Returns the JPEG file of +image+ as a String.  The parameters are the
+ * same as write_image.  The image is compressed into memory without the
+ * GVL.
+ */
+static VALUE
+jpeg_writer_s_encode(int argc, VALUE* argv, VALUE klass)
+{
+    struct jpeg_writer_data* writer;
+    VALUE obj, result;
+
+    obj = rb_obj_alloc(klass);
+    writer = get_jpeg_writer_data(obj);
+    writer_init(writer, Qnil);
+    init_memory_destination_mgr(writer);
+
+    jpeg_writer_write_image(argc, argv, obj);
+    result = rb_str_new((char const*)writer->memory, (long)writer->memory_length);
+
+    free(writer->memory);
+    writer->memory = NULL;
+    writer->memory_length = 0;
+    writer->memory_capacity = 0;
+
+    return result;
+}
+
+void
+rb_image_file_Init_image_file_jpeg_writer(void)
+{
+    cImageFileJpegWriter = rb_define_class_under(mImageFile, "JpegWriter", rb_cObject);
+    rb_define_alloc_func(cImageFileJpegWriter, jpeg_writer_alloc);
+    rb_define_singleton_method(cImageFileJpegWriter, "open", jpeg_writer_s_open, 1);
+    rb_define_singleton_method(cImageFileJpegWriter, "encode", jpeg_writer_s_encode, -1);
+    rb_define_method(cImageFileJpegWriter, "initialize", jpeg_writer_initialize, 1);
+
+    rb_define_method(cImageFileJpegWriter, "destination_will_be_closed?", jpeg_writer_destination_will_be_closed, 0);
+    rb_define_method(cImageFileJpegWriter, "finished?", jpeg_writer_is_finished, 0);
+
+    rb_define_method(cImageFileJpegWriter, "write_image", jpeg_writer_write_image, -1);
+    rb_define_method(cImageFileJpegWriter, "write_scanlines", jpeg_writer_write_scanlines, -1);
+
+    eImageFileJpegWriterError = rb_define_class_under(
+	    cImageFileJpegWriter, "Error", rb_eStandardError);
+
+    CONST_ID(id_new, "new");
+    CONST_ID(id_write, "write");
+    CONST_ID(id_close, "close");
+    CONST_ID(id_pixel_format, "pixel_format");
+    CONST_ID(id_width, "width");
+    CONST_ID(id_height, "height");
+    CONST_ID(id_row_stride, "row_stride");
+    CONST_ID(id_quality, "quality");
+    CONST_ID(id_progressive, "progressive");
+    CONST_ID(id_optimize_coding, "optimize_coding");
+    CONST_ID(id_restart_interval, "restart_interval");
+}
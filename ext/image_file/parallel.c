@@ -0,0 +1,99 @@
+#include "internal.h"
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#define MAX_THREADS 64
+
+struct parallel_for_data {
+    long n;
+    long next;
+    rb_image_file_parallel_func_t* func;
+    void* data;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+};
+
+static void*
+parallel_for_worker(void* ptr)
+{
+    struct parallel_for_data* pfd = (struct parallel_for_data*)ptr;
+    long i;
+
+    for (;;) {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&pfd->lock);
+	i = pfd->next++;
+	pthread_mutex_unlock(&pfd->lock);
+#else
+	i = pfd->next++;
+#endif
+	if (i >= pfd->n)
+	    break;
+	(* pfd->func)(pfd->data, i);
+    }
+
+    return NULL;
+}
+
+int
+rb_image_file_number_of_processors(void)
+{
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+    long const n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+	return n < MAX_THREADS ? (int)n : MAX_THREADS;
+#endif
+    return 1;
+}
+
+/*
+ * Calls func(data, i) for every i in [0, n) on at most +threads+ native
+ * threads, including the calling one, and returns when all calls have
+ * finished.  No Ruby API may be used in func, and the caller usually
+ * releases the GVL before calling this.
+ */
+void
+rb_image_file_parallel_for(long const n, int threads,
+	rb_image_file_parallel_func_t* func, void* data)
+{
+    struct parallel_for_data pfd;
+#ifdef HAVE_PTHREAD_H
+    pthread_t workers[MAX_THREADS];
+    int i, nworkers = 0;
+#endif
+
+    if (n <= 0)
+	return;
+    if (threads > MAX_THREADS)
+	threads = MAX_THREADS;
+    if (threads > n)
+	threads = (int)n;
+
+    pfd.n = n;
+    pfd.next = 0;
+    pfd.func = func;
+    pfd.data = data;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&pfd.lock, NULL);
+    for (i = 1; i < threads; ++i) {
+	if (pthread_create(&workers[nworkers], NULL, parallel_for_worker, &pfd) != 0)
+	    break;
+	++nworkers;
+    }
+#endif
+
+    parallel_for_worker(&pfd);
+
+#ifdef HAVE_PTHREAD_H
+    for (i = 0; i < nworkers; ++i)
+	pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&pfd.lock);
+#endif
+}
@@ -0,0 +1,703 @@
+#include "internal.h"
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(HAVE_IMMINTRIN_H)
+# define USE_X86_SIMD 1
+# include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(HAVE_ARM_NEON_H)
+# define USE_NEON 1
+# include <arm_neon.h>
+#endif
+
+/*
+ * Converters from the samples libjpeg produces into the native-endian
+ * pixels of Image, and between the pixel formats of Image.  The CMYK ones
+ * compute R = C*K/255 and so on for inverted (Adobe) CMYK; other CMYK
+ * samples are inverted first.  All the
+ * arithmetic is done in 16-bit fixed-point with exact rounding, so every
+ * variant below produces the same pixels as the portable one.
+ *
+ * The +dither+ of xrgb32_to_rgb16_565 is NULL or the biases added, with
+ * saturation, to the four pixels of each group of four before the low bits
+ * are dropped; it is a row of an ordered-dither matrix.
+ */
+
+rb_image_file_pixel_converter_t rb_image_file_pixel_converter;
+
+static inline unsigned int
+div255(unsigned int v)
+{
+    v += 128;
+    return (v + (v >> 8)) >> 8;
+}
+
+static inline uint16_t
+xrgb32_to_rgb16_565(uint32_t const p)
+{
+    return (uint16_t)(((p >> 8) & 0xF800U) | ((p >> 5) & 0x07E0U) | ((p >> 3) & 0x001FU));
+}
+
+static inline uint32_t
+cmyk_to_xrgb32(unsigned char const* const cmyk, unsigned int const x)
+{
+    unsigned int const k = cmyk[3] ^ x;
+    uint32_t const r = div255((cmyk[0] ^ x) * k);
+    uint32_t const g = div255((cmyk[1] ^ x) * k);
+    uint32_t const b = div255((cmyk[2] ^ x) * k);
+    return (r << 16) | (g << 8) | b;
+}
+
+static void
+rgb_to_xrgb32_generic(unsigned char const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    long j;
+    for (j = 0; j < n; ++j, src += 3)
+	*dst++ = ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | src[2] | alpha;
+}
+
+static void
+rgb_to_rgb16_565_generic(unsigned char const* src, uint16_t* dst, long const n)
+{
+    long j;
+    for (j = 0; j < n; ++j, src += 3)
+	*dst++ = (uint16_t)(((src[0] >> 3) << 11) | ((src[1] >> 2) << 5) | (src[2] >> 3));
+}
+
+static void
+cmyk_to_xrgb32_generic(unsigned char const* src, uint32_t* dst, long const n,
+	uint32_t const alpha, int const inverted)
+{
+    unsigned int const x = inverted ? 0 : 0xFF;
+    long j;
+    for (j = 0; j < n; ++j, src += 4)
+	*dst++ = cmyk_to_xrgb32(src, x) | alpha;
+}
+
+static void
+cmyk_to_rgb16_565_generic(unsigned char const* src, uint16_t* dst, long const n, int const inverted)
+{
+    unsigned int const x = inverted ? 0 : 0xFF;
+    long j;
+    for (j = 0; j < n; ++j, src += 4)
+	*dst++ = xrgb32_to_rgb16_565(cmyk_to_xrgb32(src, x));
+}
+
+static inline uint32_t
+adds_xrgb32(uint32_t const p, uint32_t const d)
+{
+    uint32_t r = ((p >> 16) & 0xFF) + ((d >> 16) & 0xFF);
+    uint32_t g = ((p >> 8) & 0xFF) + ((d >> 8) & 0xFF);
+    uint32_t b = (p & 0xFF) + (d & 0xFF);
+    if (r > 0xFF) r = 0xFF;
+    if (g > 0xFF) g = 0xFF;
+    if (b > 0xFF) b = 0xFF;
+    return (r << 16) | (g << 8) | b;
+}
+
+static inline uint32_t
+rgb16_565_to_xrgb32(uint16_t const p)
+{
+    uint32_t const r = (p >> 11) & 0x1F;
+    uint32_t const g = (p >> 5) & 0x3F;
+    uint32_t const b = p & 0x1F;
+    return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+}
+
+static void
+xrgb32_to_xrgb32_generic(uint32_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    long j;
+    for (j = 0; j < n; ++j)
+	dst[j] = src[j] | alpha;
+}
+
+static void
+xrgb32_to_rgb16_565_generic(uint32_t const* src, uint16_t* dst, long const n, uint32_t const* dither)
+{
+    long j;
+    if (dither) {
+	for (j = 0; j < n; ++j)
+	    dst[j] = xrgb32_to_rgb16_565(adds_xrgb32(src[j], dither[j & 3]));
+    }
+    else {
+	for (j = 0; j < n; ++j)
+	    dst[j] = xrgb32_to_rgb16_565(src[j]);
+    }
+}
+
+static void
+rgb16_565_to_xrgb32_generic(uint16_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    long j;
+    for (j = 0; j < n; ++j)
+	dst[j] = rgb16_565_to_xrgb32(src[j]) | alpha;
+}
+
+#ifdef USE_X86_SIMD
+/* SSE2 is always available on x86_64 */
+
+static inline __m128i
+cmyk_mul_k_sse2(__m128i const v)
+{
+    /* v holds two pixels as C, M, Y, K 16-bit words */
+    __m128i const k = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xFF), 0xFF);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(v, k), _mm_set1_epi16(128));
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    /* swap C and Y so that the bytes are in B, G, R, A order */
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(t, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+static inline __m128i
+cmyk_pixels_sse2(__m128i v, __m128i const x, __m128i const alpha)
+{
+    __m128i const zero = _mm_setzero_si128();
+    v = _mm_xor_si128(v, x);
+    v = _mm_packus_epi16(cmyk_mul_k_sse2(_mm_unpacklo_epi8(v, zero)),
+			 cmyk_mul_k_sse2(_mm_unpackhi_epi8(v, zero)));
+    return _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0x00FFFFFF)), alpha);
+}
+
+static inline __m128i
+pack_rgb16_565_sse2(__m128i const a, __m128i const b)
+{
+    __m128i const mr = _mm_set1_epi32(0xF800);
+    __m128i const mg = _mm_set1_epi32(0x07E0);
+    __m128i const mb = _mm_set1_epi32(0x001F);
+    __m128i p = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(a, 8), mr),
+		_mm_or_si128(_mm_and_si128(_mm_srli_epi32(a, 5), mg),
+			     _mm_and_si128(_mm_srli_epi32(a, 3), mb)));
+    __m128i q = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(b, 8), mr),
+		_mm_or_si128(_mm_and_si128(_mm_srli_epi32(b, 5), mg),
+			     _mm_and_si128(_mm_srli_epi32(b, 3), mb)));
+    /* sign-extend so that packs does not saturate */
+    p = _mm_srai_epi32(_mm_slli_epi32(p, 16), 16);
+    q = _mm_srai_epi32(_mm_slli_epi32(q, 16), 16);
+    return _mm_packs_epi32(p, q);
+}
+
+static void
+cmyk_to_xrgb32_sse2(unsigned char const* src, uint32_t* dst, long const n,
+	uint32_t const alpha, int const inverted)
+{
+    __m128i const x = _mm_set1_epi8(inverted ? 0 : (char)0xFF);
+    __m128i const a = _mm_set1_epi32((int)alpha);
+    long j;
+
+    for (j = 0; j + 4 <= n; j += 4) {
+	__m128i const v = _mm_loadu_si128((__m128i const*)(src + 4*j));
+	_mm_storeu_si128((__m128i*)(dst + j), cmyk_pixels_sse2(v, x, a));
+    }
+    cmyk_to_xrgb32_generic(src + 4*j, dst + j, n - j, alpha, inverted);
+}
+
+static void
+cmyk_to_rgb16_565_sse2(unsigned char const* src, uint16_t* dst, long const n, int const inverted)
+{
+    __m128i const x = _mm_set1_epi8(inverted ? 0 : (char)0xFF);
+    __m128i const a = _mm_setzero_si128();
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	__m128i const v0 = _mm_loadu_si128((__m128i const*)(src + 4*j));
+	__m128i const v1 = _mm_loadu_si128((__m128i const*)(src + 4*j + 16));
+	_mm_storeu_si128((__m128i*)(dst + j),
+		pack_rgb16_565_sse2(cmyk_pixels_sse2(v0, x, a),
+					 cmyk_pixels_sse2(v1, x, a)));
+    }
+    cmyk_to_rgb16_565_generic(src + 4*j, dst + j, n - j, inverted);
+}
+
+static void
+xrgb32_to_xrgb32_sse2(uint32_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    __m128i const a = _mm_set1_epi32((int)alpha);
+    long j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+	_mm_storeu_si128((__m128i*)(dst + j), _mm_or_si128(_mm_loadu_si128((__m128i const*)(src + j)), a));
+    xrgb32_to_xrgb32_generic(src + j, dst + j, n - j, alpha);
+}
+
+static void
+xrgb32_to_rgb16_565_sse2(uint32_t const* src, uint16_t* dst, long const n, uint32_t const* dither)
+{
+    __m128i const d = dither ? _mm_loadu_si128((__m128i const*)dither) : _mm_setzero_si128();
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	__m128i const a = _mm_adds_epu8(_mm_loadu_si128((__m128i const*)(src + j)), d);
+	__m128i const b = _mm_adds_epu8(_mm_loadu_si128((__m128i const*)(src + j + 4)), d);
+	_mm_storeu_si128((__m128i*)(dst + j), pack_rgb16_565_sse2(a, b));
+    }
+    /* j is a multiple of four, so the phase of the dither is kept */
+    xrgb32_to_rgb16_565_generic(src + j, dst + j, n - j, dither);
+}
+
+static inline __m128i
+expand_bits_sse2(__m128i const v, int const bits)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8 - bits), _mm_srli_epi16(v, 2*bits - 8));
+}
+
+static void
+rgb16_565_to_xrgb32_sse2(uint16_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    __m128i const a = _mm_set1_epi16((short)((alpha >> 16) & 0xFF00));
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	__m128i const p = _mm_loadu_si128((__m128i const*)(src + j));
+	__m128i const r = expand_bits_sse2(_mm_srli_epi16(p, 11), 5);
+	__m128i const g = expand_bits_sse2(_mm_and_si128(_mm_srli_epi16(p, 5), _mm_set1_epi16(0x3F)), 6);
+	__m128i const b = expand_bits_sse2(_mm_and_si128(p, _mm_set1_epi16(0x1F)), 5);
+	__m128i const bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	__m128i const ra = _mm_or_si128(r, a);
+	_mm_storeu_si128((__m128i*)(dst + j), _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i*)(dst + j + 4), _mm_unpackhi_epi16(bg, ra));
+    }
+    rgb16_565_to_xrgb32_generic(src + j, dst + j, n - j, alpha);
+}
+
+/* packed RGB needs a byte shuffle, which SSE2 does not have */
+
+#define RGB_TO_XRGB32_SHUFFLE \
+    2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128
+
+__attribute__((target("ssse3")))
+static void
+rgb_to_xrgb32_ssse3(unsigned char const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    __m128i const m = _mm_setr_epi8(RGB_TO_XRGB32_SHUFFLE);
+    __m128i const a = _mm_set1_epi32((int)alpha);
+    long j;
+
+    for (j = 0; j + 16 <= n; j += 16) {
+	__m128i const v0 = _mm_loadu_si128((__m128i const*)(src + 3*j));
+	__m128i const v1 = _mm_loadu_si128((__m128i const*)(src + 3*j + 16));
+	__m128i const v2 = _mm_loadu_si128((__m128i const*)(src + 3*j + 32));
+	_mm_storeu_si128((__m128i*)(dst + j), _mm_or_si128(_mm_shuffle_epi8(v0, m), a));
+	_mm_storeu_si128((__m128i*)(dst + j + 4),
+		_mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(v1, v0, 12), m), a));
+	_mm_storeu_si128((__m128i*)(dst + j + 8),
+		_mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(v2, v1, 8), m), a));
+	_mm_storeu_si128((__m128i*)(dst + j + 12),
+		_mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(v2, 4), m), a));
+    }
+    rgb_to_xrgb32_generic(src + 3*j, dst + j, n - j, alpha);
+}
+
+__attribute__((target("ssse3")))
+static void
+rgb_to_rgb16_565_ssse3(unsigned char const* src, uint16_t* dst, long const n)
+{
+    __m128i const m = _mm_setr_epi8(RGB_TO_XRGB32_SHUFFLE);
+    long j;
+
+    for (j = 0; j + 16 <= n; j += 16) {
+	__m128i const v0 = _mm_loadu_si128((__m128i const*)(src + 3*j));
+	__m128i const v1 = _mm_loadu_si128((__m128i const*)(src + 3*j + 16));
+	__m128i const v2 = _mm_loadu_si128((__m128i const*)(src + 3*j + 32));
+	_mm_storeu_si128((__m128i*)(dst + j),
+		pack_rgb16_565_sse2(_mm_shuffle_epi8(v0, m),
+					 _mm_shuffle_epi8(_mm_alignr_epi8(v1, v0, 12), m)));
+	_mm_storeu_si128((__m128i*)(dst + j + 8),
+		pack_rgb16_565_sse2(_mm_shuffle_epi8(_mm_alignr_epi8(v2, v1, 8), m),
+					 _mm_shuffle_epi8(_mm_srli_si128(v2, 4), m)));
+    }
+    rgb_to_rgb16_565_generic(src + 3*j, dst + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+cmyk_mul_k_avx2(__m256i const v)
+{
+    __m256i const k = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, 0xFF), 0xFF);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(v, k), _mm256_set1_epi16(128));
+    t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(t, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+cmyk_pixels_avx2(__m256i v, __m256i const x, __m256i const alpha)
+{
+    __m256i const zero = _mm256_setzero_si256();
+    v = _mm256_xor_si256(v, x);
+    v = _mm256_packus_epi16(cmyk_mul_k_avx2(_mm256_unpacklo_epi8(v, zero)),
+			    cmyk_mul_k_avx2(_mm256_unpackhi_epi8(v, zero)));
+    return _mm256_or_si256(_mm256_and_si256(v, _mm256_set1_epi32(0x00FFFFFF)), alpha);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+pack_rgb16_565_avx2(__m256i const a, __m256i const b)
+{
+    __m256i const mr = _mm256_set1_epi32(0xF800);
+    __m256i const mg = _mm256_set1_epi32(0x07E0);
+    __m256i const mb = _mm256_set1_epi32(0x001F);
+    __m256i p = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(a, 8), mr),
+		_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(a, 5), mg),
+				_mm256_and_si256(_mm256_srli_epi32(a, 3), mb)));
+    __m256i q = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(b, 8), mr),
+		_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(b, 5), mg),
+				_mm256_and_si256(_mm256_srli_epi32(b, 3), mb)));
+    p = _mm256_srai_epi32(_mm256_slli_epi32(p, 16), 16);
+    q = _mm256_srai_epi32(_mm256_slli_epi32(q, 16), 16);
+    /* packs works within 128-bit lanes */
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(p, q), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+load_rgb_avx2(unsigned char const* const src, __m256i const m)
+{
+    /* four pixels in the lower 12 bytes of each lane */
+    __m256i const v = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(_mm_loadu_si128((__m128i const*)src)),
+	    _mm_loadu_si128((__m128i const*)(src + 12)), 1);
+    return _mm256_shuffle_epi8(v, m);
+}
+
+__attribute__((target("avx2")))
+static void
+cmyk_to_xrgb32_avx2(unsigned char const* src, uint32_t* dst, long const n,
+	uint32_t const alpha, int const inverted)
+{
+    __m256i const x = _mm256_set1_epi8(inverted ? 0 : (char)0xFF);
+    __m256i const a = _mm256_set1_epi32((int)alpha);
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	__m256i const v = _mm256_loadu_si256((__m256i const*)(src + 4*j));
+	_mm256_storeu_si256((__m256i*)(dst + j), cmyk_pixels_avx2(v, x, a));
+    }
+    cmyk_to_xrgb32_generic(src + 4*j, dst + j, n - j, alpha, inverted);
+}
+
+__attribute__((target("avx2")))
+static void
+cmyk_to_rgb16_565_avx2(unsigned char const* src, uint16_t* dst, long const n, int const inverted)
+{
+    __m256i const x = _mm256_set1_epi8(inverted ? 0 : (char)0xFF);
+    __m256i const a = _mm256_setzero_si256();
+    long j;
+
+    for (j = 0; j + 16 <= n; j += 16) {
+	__m256i const v0 = _mm256_loadu_si256((__m256i const*)(src + 4*j));
+	__m256i const v1 = _mm256_loadu_si256((__m256i const*)(src + 4*j + 32));
+	_mm256_storeu_si256((__m256i*)(dst + j),
+		pack_rgb16_565_avx2(cmyk_pixels_avx2(v0, x, a),
+					 cmyk_pixels_avx2(v1, x, a)));
+    }
+    cmyk_to_rgb16_565_generic(src + 4*j, dst + j, n - j, inverted);
+}
+
+__attribute__((target("avx2")))
+static void
+rgb_to_xrgb32_avx2(unsigned char const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    __m256i const m = _mm256_setr_epi8(RGB_TO_XRGB32_SHUFFLE, RGB_TO_XRGB32_SHUFFLE);
+    __m256i const a = _mm256_set1_epi32((int)alpha);
+    long j;
+
+    /* each iteration reads 28 bytes, 4 more than the 8 pixels it converts */
+    for (j = 0; j + 10 <= n; j += 8)
+	_mm256_storeu_si256((__m256i*)(dst + j), _mm256_or_si256(load_rgb_avx2(src + 3*j, m), a));
+    rgb_to_xrgb32_generic(src + 3*j, dst + j, n - j, alpha);
+}
+
+__attribute__((target("avx2")))
+static void
+rgb_to_rgb16_565_avx2(unsigned char const* src, uint16_t* dst, long const n)
+{
+    __m256i const m = _mm256_setr_epi8(RGB_TO_XRGB32_SHUFFLE, RGB_TO_XRGB32_SHUFFLE);
+    long j;
+
+    for (j = 0; j + 18 <= n; j += 16) {
+	_mm256_storeu_si256((__m256i*)(dst + j),
+		pack_rgb16_565_avx2(load_rgb_avx2(src + 3*j, m),
+					 load_rgb_avx2(src + 3*j + 24, m)));
+    }
+    rgb_to_rgb16_565_generic(src + 3*j, dst + j, n - j);
+}
+__attribute__((target("avx2")))
+static void
+xrgb32_to_xrgb32_avx2(uint32_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    __m256i const a = _mm256_set1_epi32((int)alpha);
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+	_mm256_storeu_si256((__m256i*)(dst + j), _mm256_or_si256(_mm256_loadu_si256((__m256i const*)(src + j)), a));
+    xrgb32_to_xrgb32_generic(src + j, dst + j, n - j, alpha);
+}
+
+__attribute__((target("avx2")))
+static void
+xrgb32_to_rgb16_565_avx2(uint32_t const* src, uint16_t* dst, long const n, uint32_t const* dither)
+{
+    __m256i const d = dither
+	? _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const*)dither))
+	: _mm256_setzero_si256();
+    long j;
+
+    for (j = 0; j + 16 <= n; j += 16) {
+	__m256i const a = _mm256_adds_epu8(_mm256_loadu_si256((__m256i const*)(src + j)), d);
+	__m256i const b = _mm256_adds_epu8(_mm256_loadu_si256((__m256i const*)(src + j + 8)), d);
+	_mm256_storeu_si256((__m256i*)(dst + j), pack_rgb16_565_avx2(a, b));
+    }
+    xrgb32_to_rgb16_565_generic(src + j, dst + j, n - j, dither);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+expand_bits_avx2(__m256i const v, int const bits)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(v, 8 - bits), _mm256_srli_epi16(v, 2*bits - 8));
+}
+
+__attribute__((target("avx2")))
+static void
+rgb16_565_to_xrgb32_avx2(uint16_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    __m256i const a = _mm256_set1_epi16((short)((alpha >> 16) & 0xFF00));
+    long j;
+
+    for (j = 0; j + 16 <= n; j += 16) {
+	/* unpack works within 128-bit lanes, so the quarters are put in order first */
+	__m256i const p = _mm256_permute4x64_epi64(
+		_mm256_loadu_si256((__m256i const*)(src + j)), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i const r = expand_bits_avx2(_mm256_srli_epi16(p, 11), 5);
+	__m256i const g = expand_bits_avx2(_mm256_and_si256(_mm256_srli_epi16(p, 5), _mm256_set1_epi16(0x3F)), 6);
+	__m256i const b = expand_bits_avx2(_mm256_and_si256(p, _mm256_set1_epi16(0x1F)), 5);
+	__m256i const bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+	__m256i const ra = _mm256_or_si256(r, a);
+	_mm256_storeu_si256((__m256i*)(dst + j), _mm256_unpacklo_epi16(bg, ra));
+	_mm256_storeu_si256((__m256i*)(dst + j + 8), _mm256_unpackhi_epi16(bg, ra));
+    }
+    rgb16_565_to_xrgb32_generic(src + j, dst + j, n - j, alpha);
+}
+#endif /* USE_X86_SIMD */
+
+#ifdef USE_NEON
+static inline uint8x8_t
+div255_neon(uint16x8_t const t)
+{
+    return vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+}
+
+static inline uint16x8_t
+pack_rgb16_565_neon(uint8x8_t const r, uint8x8_t const g, uint8x8_t const b)
+{
+    uint16x8_t p = vshll_n_u8(r, 8);
+    p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+    return vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+}
+
+static void
+rgb_to_xrgb32_neon(unsigned char const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    uint8x8_t const a = vdup_n_u8((uint8_t)(alpha >> 24));
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	uint8x8x3_t const v = vld3_u8(src + 3*j);
+	uint8x8x4_t w;
+	w.val[0] = v.val[2];
+	w.val[1] = v.val[1];
+	w.val[2] = v.val[0];
+	w.val[3] = a;
+	vst4_u8((uint8_t*)(dst + j), w);
+    }
+    rgb_to_xrgb32_generic(src + 3*j, dst + j, n - j, alpha);
+}
+
+static void
+rgb_to_rgb16_565_neon(unsigned char const* src, uint16_t* dst, long const n)
+{
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	uint8x8x3_t const v = vld3_u8(src + 3*j);
+	vst1q_u16(dst + j, pack_rgb16_565_neon(v.val[0], v.val[1], v.val[2]));
+    }
+    rgb_to_rgb16_565_generic(src + 3*j, dst + j, n - j);
+}
+
+static void
+cmyk_to_xrgb32_neon(unsigned char const* src, uint32_t* dst, long const n,
+	uint32_t const alpha, int const inverted)
+{
+    uint8x8_t const x = vdup_n_u8(inverted ? 0 : 0xFF);
+    uint8x8_t const a = vdup_n_u8((uint8_t)(alpha >> 24));
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	uint8x8x4_t const v = vld4_u8(src + 4*j);
+	uint8x8_t const k = veor_u8(v.val[3], x);
+	uint8x8x4_t w;
+	w.val[0] = div255_neon(vmull_u8(veor_u8(v.val[2], x), k));
+	w.val[1] = div255_neon(vmull_u8(veor_u8(v.val[1], x), k));
+	w.val[2] = div255_neon(vmull_u8(veor_u8(v.val[0], x), k));
+	w.val[3] = a;
+	vst4_u8((uint8_t*)(dst + j), w);
+    }
+    cmyk_to_xrgb32_generic(src + 4*j, dst + j, n - j, alpha, inverted);
+}
+
+static void
+cmyk_to_rgb16_565_neon(unsigned char const* src, uint16_t* dst, long const n, int const inverted)
+{
+    uint8x8_t const x = vdup_n_u8(inverted ? 0 : 0xFF);
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	uint8x8x4_t const v = vld4_u8(src + 4*j);
+	uint8x8_t const k = veor_u8(v.val[3], x);
+	vst1q_u16(dst + j, pack_rgb16_565_neon(
+		    div255_neon(vmull_u8(veor_u8(v.val[0], x), k)),
+		    div255_neon(vmull_u8(veor_u8(v.val[1], x), k)),
+		    div255_neon(vmull_u8(veor_u8(v.val[2], x), k))));
+    }
+    cmyk_to_rgb16_565_generic(src + 4*j, dst + j, n - j, inverted);
+}
+static void
+xrgb32_to_xrgb32_neon(uint32_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    uint32x4_t const a = vdupq_n_u32(alpha);
+    long j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+	vst1q_u32(dst + j, vorrq_u32(vld1q_u32(src + j), a));
+    xrgb32_to_xrgb32_generic(src + j, dst + j, n - j, alpha);
+}
+
+static void
+xrgb32_to_rgb16_565_neon(uint32_t const* src, uint16_t* dst, long const n, uint32_t const* dither)
+{
+    uint32_t biases[8] = { 0 };
+    uint8x8x4_t d;
+    long j;
+
+    if (dither) {
+	memcpy(biases, dither, 4*sizeof(uint32_t));
+	memcpy(biases + 4, dither, 4*sizeof(uint32_t));
+    }
+    d = vld4_u8((uint8_t const*)biases);
+    for (j = 0; j + 8 <= n; j += 8) {
+	uint8x8x4_t const v = vld4_u8((uint8_t const*)(src + j));
+	vst1q_u16(dst + j, pack_rgb16_565_neon(
+		    vqadd_u8(v.val[2], d.val[2]),
+		    vqadd_u8(v.val[1], d.val[1]),
+		    vqadd_u8(v.val[0], d.val[0])));
+    }
+    xrgb32_to_rgb16_565_generic(src + j, dst + j, n - j, dither);
+}
+
+static void
+rgb16_565_to_xrgb32_neon(uint16_t const* src, uint32_t* dst, long const n, uint32_t const alpha)
+{
+    uint8x8_t const a = vdup_n_u8((uint8_t)(alpha >> 24));
+    long j;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+	uint16x8_t const p = vld1q_u16(src + j);
+	uint8x8_t const r = vmovn_u16(vshrq_n_u16(p, 11));
+	uint8x8_t const g = vmovn_u16(vandq_u16(vshrq_n_u16(p, 5), vdupq_n_u16(0x3F)));
+	uint8x8_t const b = vmovn_u16(vandq_u16(p, vdupq_n_u16(0x1F)));
+	uint8x8x4_t w;
+	w.val[0] = vorr_u8(vshl_n_u8(b, 3), vshr_n_u8(b, 2));
+	w.val[1] = vorr_u8(vshl_n_u8(g, 2), vshr_n_u8(g, 4));
+	w.val[2] = vorr_u8(vshl_n_u8(r, 3), vshr_n_u8(r, 2));
+	w.val[3] = a;
+	vst4_u8((uint8_t*)(dst + j), w);
+    }
+    rgb16_565_to_xrgb32_generic(src + j, dst + j, n - j, alpha);
+}
+#endif /* USE_NEON */
+
+#if !defined(USE_X86_SIMD) && !defined(USE_NEON)
+static rb_image_file_pixel_converter_t const generic_converter = {
+    "generic",
+    rgb_to_xrgb32_generic,
+    rgb_to_rgb16_565_generic,
+    cmyk_to_xrgb32_generic,
+    cmyk_to_rgb16_565_generic,
+    xrgb32_to_xrgb32_generic,
+    xrgb32_to_rgb16_565_generic,
+    rgb16_565_to_xrgb32_generic,
+};
+#endif
+
+#ifdef USE_X86_SIMD
+static rb_image_file_pixel_converter_t const sse2_converter = {
+    "sse2",
+    rgb_to_xrgb32_generic,
+    rgb_to_rgb16_565_generic,
+    cmyk_to_xrgb32_sse2,
+    cmyk_to_rgb16_565_sse2,
+    xrgb32_to_xrgb32_sse2,
+    xrgb32_to_rgb16_565_sse2,
+    rgb16_565_to_xrgb32_sse2,
+};
+
+static rb_image_file_pixel_converter_t const ssse3_converter = {
+    "ssse3",
+    rgb_to_xrgb32_ssse3,
+    rgb_to_rgb16_565_ssse3,
+    cmyk_to_xrgb32_sse2,
+    cmyk_to_rgb16_565_sse2,
+    xrgb32_to_xrgb32_sse2,
+    xrgb32_to_rgb16_565_sse2,
+    rgb16_565_to_xrgb32_sse2,
+};
+
+static rb_image_file_pixel_converter_t const avx2_converter = {
+    "avx2",
+    rgb_to_xrgb32_avx2,
+    rgb_to_rgb16_565_avx2,
+    cmyk_to_xrgb32_avx2,
+    cmyk_to_rgb16_565_avx2,
+    xrgb32_to_xrgb32_avx2,
+    xrgb32_to_rgb16_565_avx2,
+    rgb16_565_to_xrgb32_avx2,
+};
+#endif
+
+#ifdef USE_NEON
+static rb_image_file_pixel_converter_t const neon_converter = {
+    "neon",
+    rgb_to_xrgb32_neon,
+    rgb_to_rgb16_565_neon,
+    cmyk_to_xrgb32_neon,
+    cmyk_to_rgb16_565_neon,
+    xrgb32_to_xrgb32_neon,
+    xrgb32_to_rgb16_565_neon,
+    rgb16_565_to_xrgb32_neon,
+};
+#endif
+
+static rb_image_file_pixel_converter_t const*
+select_pixel_converter(void)
+{
+#if defined(USE_X86_SIMD) && defined(HAVE___BUILTIN_CPU_SUPPORTS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return &avx2_converter;
+    if (__builtin_cpu_supports("ssse3"))
+	return &ssse3_converter;
+    return &sse2_converter;
+#elif defined(USE_X86_SIMD)
+    return &sse2_converter;
+#elif defined(USE_NEON)
+    return &neon_converter;
+#else
+    return &generic_converter;
+#endif
+}
+
+void
+rb_image_file_Init_image_file_pixel_convert(void)
+{
+    rb_image_file_pixel_converter = *select_pixel_converter();
+}
@@ -0,0 +1,990 @@
+#include "internal.h"
+#include <ruby/io.h>
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if defined(HAVE_PNG_H) && defined(HAVE_PNG_PROCESS_DATA_PAUSE)
+#include <png.h>
+
+#ifdef HAVE_UNISTD_H
+# define USE_NATIVE_FILE_SOURCE 1
+#endif
+
+/*
+ * PngReader drives the progressive reader of libpng: the source is fed to
+ * png_process_data piece by piece, and every row libpng produces is
+ * combined into the buffer of the image by the row callback.  The header
+ * is read by pausing libpng in the info callback, so the transformations
+ * can be chosen after the header getters are called.
+ */
+
+static size_t const INPUT_BUFFER_SIZE = 4096U;
+static size_t const FILE_INPUT_BUFFER_SIZE = 65536U;
+
+VALUE cImageFilePngReader = Qnil;
+VALUE eImageFilePngReaderError = Qnil;
+
+static ID id_GRAY;
+static ID id_GRAY_ALPHA;
+static ID id_RGB;
+static ID id_RGB_ALPHA;
+static ID id_PALETTE;
+static ID id_new;
+static ID id_close;
+static ID id_read;
+static ID id_pixel_format;
+static ID id_width;
+static ID id_height;
+static ID id_row_stride;
+static ID id_into;
+
+static VALUE
+color_type_to_symbol(int const color_type)
+{
+    switch (color_type) {
+	case PNG_COLOR_TYPE_GRAY:
+	    return ID2SYM(id_GRAY);
+
+	case PNG_COLOR_TYPE_GRAY_ALPHA:
+	    return ID2SYM(id_GRAY_ALPHA);
+
+	case PNG_COLOR_TYPE_RGB:
+	    return ID2SYM(id_RGB);
+
+	case PNG_COLOR_TYPE_RGB_ALPHA:
+	    return ID2SYM(id_RGB_ALPHA);
+
+	case PNG_COLOR_TYPE_PALETTE:
+	    return ID2SYM(id_PALETTE);
+
+	default:
+	    break;
+    }
+    return Qnil;
+}
+
+enum png_reader_state {
+    READER_ALLOCATED = 0,
+    READER_INITIALIZED,
+    READER_RED_HEADER,
+    READER_STARTED_DECOMPRESS,
+    READER_FINISHED_DECOMPRESS,
+    READER_FAILED
+};
+
+enum png_reader_source_type {
+    SOURCE_IO = 0,	/* Ruby IO object, read via IO#read */
+    SOURCE_FILE,	/* regular file read by read(2) */
+    SOURCE_MEMORY	/* bytes of a frozen String */
+};
+
+struct png_reader_data {
+    png_structp png;
+    png_infop info;
+    VALUE source;
+    VALUE buffer;
+    enum png_reader_state state;
+    enum png_reader_source_type source_type;
+    int fd;
+    png_bytep file_buffer;
+    png_const_bytep memory;
+    size_t memory_length;
+    png_const_bytep input;	/* the bytes not yet processed by libpng */
+    size_t input_length;
+    size_t paused_rest;
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;
+    int interlace_type;
+    char* image_buffer;
+    long row_size;
+    png_bytep converted_row;	/* RGB row of an RGB16_565 image, or NULL */
+    int premultiply;
+    rb_image_file_image_pixel_format_t pixel_format;
+    char error_message[256];
+    unsigned close_source: 1;
+    unsigned start_of_file: 1;
+    unsigned without_gvl: 1;
+    unsigned has_alpha: 1;
+    unsigned header_done: 1;
+    unsigned end_done: 1;
+    unsigned busy: 1;		/* libpng runs on it where other threads can run */
+};
+
+static void
+png_reader_mark(void* ptr)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)ptr;
+    /* rb_gc_mark pins the source, so the bytes of a memory source never move */
+    rb_gc_mark(reader->source);
+    rb_gc_mark(reader->buffer);
+}
+
+static void
+png_reader_free(void* ptr)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)ptr;
+
+    if (reader->png != NULL)
+	png_destroy_read_struct(&reader->png, &reader->info, NULL);
+    if (reader->file_buffer != NULL)
+	xfree(reader->file_buffer);
+    if (reader->converted_row != NULL)
+	xfree(reader->converted_row);
+    reader->source = Qnil;
+    xfree(ptr);
+}
+
+static size_t
+png_reader_memsize(void const* ptr)
+{
+    return ptr ? sizeof(struct png_reader_data) : 0;
+}
+
+static rb_data_type_t const png_reader_data_type = {
+    "image_file::png_reader",
+#if RUBY_VERSION >= 193
+    {
+#endif
+	png_reader_mark,
+	png_reader_free,
+	png_reader_memsize,
+#if RUBY_VERSION >= 193
+    },
+#endif
+};
+
+static VALUE
+png_reader_alloc(VALUE klass)
+{
+    struct png_reader_data* reader;
+    VALUE obj = TypedData_Make_Struct(
+	    klass, struct png_reader_data, &png_reader_data_type, reader);
+    reader->png = NULL;
+    reader->info = NULL;
+    reader->source = Qnil;
+    reader->buffer = Qnil;
+    reader->state = READER_ALLOCATED;
+    reader->source_type = SOURCE_IO;
+    reader->fd = -1;
+    reader->file_buffer = NULL;
+    reader->memory = NULL;
+    reader->memory_length = 0;
+    reader->input = NULL;
+    reader->input_length = 0;
+    reader->paused_rest = 0;
+    reader->image_buffer = NULL;
+    reader->row_size = 0;
+    reader->converted_row = NULL;
+    reader->premultiply = 0;
+    reader->pixel_format = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID;
+    reader->error_message[0] = '\0';
+    reader->close_source = 0;
+    reader->start_of_file = 1;
+    reader->without_gvl = 0;
+    reader->has_alpha = 0;
+    reader->header_done = 0;
+    reader->end_done = 0;
+    reader->busy = 0;
+    return obj;
+}
+
+static struct png_reader_data*
+get_png_reader_data(VALUE obj)
+{
+    struct png_reader_data* reader;
+    TypedData_Get_Struct(obj, struct png_reader_data, &png_reader_data_type, reader);
+    return reader;
+}
+
+/*
+ * An error cannot be raised in the callbacks of libpng, which may run
+ * without the GVL.  The message is saved and the control returns to the
+ * setjmp point in process_input.
+ */
+static void PNGCBAPI
+error_fn(png_structp png, png_const_charp message)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)png_get_error_ptr(png);
+    snprintf(reader->error_message, sizeof(reader->error_message), "%s", message);
+    png_longjmp(png, 1);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+warning_fn_with_gvl(void* message)
+{
+    rb_warning("%s", (char const*)message);
+    return NULL;
+}
+#endif
+
+static void PNGCBAPI
+warning_fn(png_structp png, png_const_charp message)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)png_get_error_ptr(png);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (reader != NULL && reader->without_gvl) {
+	rb_thread_call_with_gvl(warning_fn_with_gvl, (void*)message);
+	return;
+    }
+#else
+    (void)reader;
+#endif
+    rb_warning("%s", message);
+}
+
+static void PNGCBAPI
+info_callback(png_structp png, png_infop info)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)png_get_progressive_ptr(png);
+
+    png_get_IHDR(png, info, &reader->width, &reader->height, &reader->bit_depth,
+	    &reader->color_type, &reader->interlace_type, NULL, NULL);
+    reader->has_alpha = (reader->color_type & PNG_COLOR_MASK_ALPHA)
+	|| png_get_valid(png, info, PNG_INFO_tRNS);
+    reader->header_done = 1;
+    /* stop here; the transformations are set by read_image */
+    reader->paused_rest = png_process_data_pause(png, 0);
+}
+
+static void
+expand_rgb16_565_row(uint16_t const* src, png_bytep dst, long const n)
+{
+    long i;
+    for (i = 0; i < n; ++i, dst += 3) {
+	uint16_t const p = src[i];
+	unsigned int const r = (p >> 11) & 0x1F;
+	unsigned int const g = (p >> 5) & 0x3F;
+	unsigned int const b = p & 0x1F;
+	dst[0] = (png_byte)((r << 3) | (r >> 2));
+	dst[1] = (png_byte)((g << 2) | (g >> 4));
+	dst[2] = (png_byte)((b << 3) | (b >> 2));
+    }
+}
+
+#ifdef WORDS_BIGENDIAN
+# define ALPHA_INDEX 0
+# define COLOR_INDEX 1
+#else
+# define ALPHA_INDEX 3
+# define COLOR_INDEX 0
+#endif
+
+static inline png_byte
+multiply_alpha(unsigned int const c, unsigned int const a)
+{
+    unsigned int const v = c*a + 128;
+    return (png_byte)((v + (v >> 8)) >> 8);
+}
+
+/* Premultiplies the samples by alpha as cairo expects, without gamma correction. */
+static void
+premultiply_row(png_bytep row, long const n)
+{
+    long i;
+    for (i = 0; i < n; ++i, row += 4) {
+	unsigned int const a = row[ALPHA_INDEX];
+	if (a == 0xFF)
+	    continue;
+	row[COLOR_INDEX + 0] = multiply_alpha(row[COLOR_INDEX + 0], a);
+	row[COLOR_INDEX + 1] = multiply_alpha(row[COLOR_INDEX + 1], a);
+	row[COLOR_INDEX + 2] = multiply_alpha(row[COLOR_INDEX + 2], a);
+    }
+}
+
+/*
+ * Combines the row into the image in place.  The row of libpng has the
+ * full width even for the passes of an interlaced file, so it is
+ * premultiplied before it is combined.  An RGB16_565 row goes
+ * through converted_row; for an interlaced file, the pixels of the
+ * earlier passes are expanded back into it first, which is lossless.
+ */
+static void PNGCBAPI
+row_callback(png_structp png, png_bytep new_row, png_uint_32 row_num, int pass ARG_UNUSED)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)png_get_progressive_ptr(png);
+    char* dst;
+
+    if (new_row == NULL || row_num >= reader->height)
+	return;
+
+    dst = reader->image_buffer + (long)row_num*reader->row_size;
+    if (reader->premultiply)
+	premultiply_row(new_row, (long)reader->width);
+    if (reader->converted_row == NULL) {
+	png_progressive_combine_row(png, (png_bytep)dst, new_row);
+	return;
+    }
+
+    if (reader->interlace_type != PNG_INTERLACE_NONE)
+	expand_rgb16_565_row((uint16_t const*)dst, reader->converted_row, (long)reader->width);
+    png_progressive_combine_row(png, reader->converted_row, new_row);
+    rb_image_file_pixel_converter.rgb_to_rgb16_565(
+	    reader->converted_row, (uint16_t*)dst, (long)reader->width);
+}
+
+static void PNGCBAPI
+end_callback(png_structp png, png_infop info ARG_UNUSED)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)png_get_progressive_ptr(png);
+    reader->end_done = 1;
+}
+
+/* Returns the number of bytes read, 0 at EOF, or -1 on error. */
+static long
+fill_input_from_io(struct png_reader_data* reader)
+{
+    reader->buffer = rb_funcall(reader->source, id_read, 1, INT2FIX(INPUT_BUFFER_SIZE));
+    if (NIL_P(reader->buffer))
+	return 0;
+    StringValue(reader->buffer);
+    reader->input = (png_const_bytep)RSTRING_PTR(reader->buffer);
+    reader->input_length = (size_t)RSTRING_LEN(reader->buffer);
+    return (long)reader->input_length;
+}
+
+/* The whole memory block is handed to libpng at the first request. */
+static long
+fill_input_from_memory(struct png_reader_data* reader)
+{
+    if (!reader->start_of_file)
+	return 0;
+    reader->input = reader->memory;
+    reader->input_length = reader->memory_length;
+    return (long)reader->input_length;
+}
+
+#ifdef USE_NATIVE_FILE_SOURCE
+static long
+fill_input_from_fd(struct png_reader_data* reader)
+{
+    ssize_t len;
+
+    do {
+	len = read(reader->fd, reader->file_buffer, FILE_INPUT_BUFFER_SIZE);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+	char message[128];
+	copy_error_message(errno, message, sizeof(message));
+	snprintf(reader->error_message, sizeof(reader->error_message),
+		"read error: %s", message);
+	return -1;
+    }
+    reader->input = reader->file_buffer;
+    reader->input_length = (size_t)len;
+    return (long)len;
+}
+#endif
+
+/* This function doesn't call any Ruby API unless the source is an IO. */
+static long
+fill_input(struct png_reader_data* reader)
+{
+    long len;
+
+    switch (reader->source_type) {
+	case SOURCE_MEMORY:
+	    len = fill_input_from_memory(reader);
+	    break;
+#ifdef USE_NATIVE_FILE_SOURCE
+	case SOURCE_FILE:
+	    len = fill_input_from_fd(reader);
+	    break;
+#endif
+	default:
+	    len = fill_input_from_io(reader);
+	    break;
+    }
+
+    if (len == 0) {
+	snprintf(reader->error_message, sizeof(reader->error_message),
+		reader->start_of_file ? "empty input file" : "premature end of PNG file");
+	return -1;
+    }
+    if (len > 0)
+	reader->start_of_file = 0;
+    return len;
+}
+
+struct process_args {
+    struct png_reader_data* reader;
+    int until_end;
+    int volatile interrupted;
+    int completed;
+    int failed;
+};
+
+/*
+ * Feeds the source to libpng until the header or the end of the file.
+ * The bytes left by a pause of libpng are fed again by the next call.
+ *
+ * This function must not call any Ruby API unless the source is an IO;
+ * it may run without the GVL.
+ */
+static void
+process_input(struct process_args* args)
+{
+    struct png_reader_data* reader = args->reader;
+
+    while (!(args->until_end ? reader->end_done : reader->header_done)) {
+	if (args->interrupted)
+	    return;
+
+	if (reader->input_length == 0 && fill_input(reader) < 0) {
+	    args->failed = 1;
+	    return;
+	}
+
+	if (setjmp(png_jmpbuf(reader->png))) {
+	    args->failed = 1;
+	    return;
+	}
+	reader->paused_rest = 0;
+	png_process_data(reader->png, reader->info,
+		(png_bytep)reader->input, reader->input_length);
+	reader->input += reader->input_length - reader->paused_rest;
+	reader->input_length = reader->paused_rest;
+    }
+    args->completed = 1;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void*
+process_without_gvl(void* ptr)
+{
+    struct process_args* args = (struct process_args*)ptr;
+
+    args->reader->without_gvl = 1;
+    process_input(args);
+    args->reader->without_gvl = 0;
+
+    return NULL;
+}
+
+static void
+interrupt_process(void* ptr)
+{
+    struct process_args* args = (struct process_args*)ptr;
+    args->interrupted = 1;
+}
+#endif
+
+static inline void
+reader_check_not_busy(struct png_reader_data* reader)
+{
+    assert(reader != NULL);
+    if (reader->busy) {
+	rb_raise(eImageFilePngReaderError, "reader is in use by another thread");
+    }
+}
+
+static inline void
+reader_check_initialized(struct png_reader_data* reader)
+{
+    assert(reader != NULL);
+    reader_check_not_busy(reader);
+    if (reader->state < READER_INITIALIZED) {
+	rb_raise(eImageFilePngReaderError, "reader not initialized");
+    }
+    if (reader->state == READER_FAILED) {
+	rb_raise(eImageFilePngReaderError, "%s", reader->error_message);
+    }
+}
+
+/*
+ * Native sources never call back into Ruby, so they are processed
+ * without the GVL.  A pending interrupt stops processing between the
+ * pieces of the source; it is resumed if the interrupt did not raise.
+ * libpng cannot continue after an error, so the reader keeps failing.
+ */
+static void
+process(struct png_reader_data* reader, int const until_end)
+{
+    struct process_args args;
+
+    args.reader = reader;
+    args.until_end = until_end;
+    args.interrupted = 0;
+    args.completed = 0;
+    args.failed = 0;
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (reader->source_type != SOURCE_IO) {
+	while (!args.completed && !args.failed) {
+	    args.interrupted = 0;
+	    rb_thread_call_without_gvl(process_without_gvl, &args, interrupt_process, &args);
+	    if (!args.failed)
+		rb_thread_check_ints();
+	}
+    }
+    else
+#endif
+	process_input(&args);
+
+    if (args.failed) {
+	reader->state = READER_FAILED;
+	rb_raise(eImageFilePngReaderError, "%s", reader->error_message);
+    }
+}
+
+static VALUE
+reader_clear_busy(VALUE arg)
+{
+    ((struct png_reader_data*)arg)->busy = 0;
+    return Qnil;
+}
+
+/* Other threads get an error while +func+ feeds libpng. */
+static VALUE
+reader_run_busy(struct png_reader_data* reader, VALUE (*func)(VALUE), VALUE arg)
+{
+    reader_check_not_busy(reader);
+    reader->busy = 1;
+    return rb_ensure(func, arg, reader_clear_busy, (VALUE)reader);
+}
+
+/* The reader must be busy. */
+static VALUE
+read_header_0(VALUE arg)
+{
+    struct png_reader_data* reader = (struct png_reader_data*)arg;
+
+    if (reader->state < READER_RED_HEADER) {
+	process(reader, 0);
+	reader->state = READER_RED_HEADER;
+    }
+    return Qnil;
+}
+
+static void
+read_header(struct png_reader_data* reader)
+{
+    reader_check_initialized(reader);
+    if (reader->state < READER_RED_HEADER)
+	reader_run_busy(reader, read_header_0, (VALUE)reader);
+}
+
+/* A reader is initialized only once; its source cannot be replaced. */
+static VALUE
+png_reader_initialize(VALUE obj, VALUE source)
+{
+    struct png_reader_data* reader;
+
+    reader = get_png_reader_data(obj);
+    if (reader->state != READER_ALLOCATED)
+	rb_raise(eImageFilePngReaderError, "reader has already been initialized");
+    reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, reader, error_fn, warning_fn);
+    if (reader->png == NULL)
+	rb_memerror();
+    reader->info = png_create_info_struct(reader->png);
+    if (reader->info == NULL)
+	rb_memerror();
+    png_set_progressive_read_fn(reader->png, reader, info_callback, row_callback, end_callback);
+    reader->source = source;
+    reader->state = READER_INITIALIZED;
+    return obj;
+}
+
+static VALUE
+png_reader_s_open(VALUE klass, VALUE path)
+{
+    struct png_reader_data* reader;
+    VALUE obj, io;
+#ifdef USE_NATIVE_FILE_SOURCE
+    struct stat st;
+    int fd;
+#endif
+
+    io = rb_file_open_str(path, "rb");
+    obj = rb_funcall(klass, id_new, 1, io);
+    reader = get_png_reader_data(obj);
+    reader->close_source = 1;
+#ifdef USE_NATIVE_FILE_SOURCE
+    fd = rb_image_file_io_descriptor(io);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+	reader->fd = fd;
+	reader->file_buffer = ALLOC_N(png_byte, FILE_INPUT_BUFFER_SIZE);
+	reader->source_type = SOURCE_FILE;
+    }
+#endif
+
+    return obj;
+}
+
+/*
+ * The reader decodes the bytes of +string+ in place.  An unfrozen string
+ * is replaced by a frozen one sharing the same bytes, so later changes to
+ * +string+ do not affect the reader.
+ */
+static VALUE
+png_reader_s_from_string(VALUE klass, VALUE string)
+{
+    struct png_reader_data* reader;
+    VALUE obj;
+
+    StringValue(string);
+    string = rb_str_new_frozen(string);
+    obj = rb_funcall(klass, id_new, 1, string);
+    reader = get_png_reader_data(obj);
+    reader->memory = (png_const_bytep)RSTRING_PTR(string);
+    reader->memory_length = (size_t)RSTRING_LEN(string);
+    reader->source_type = SOURCE_MEMORY;
+
+    return obj;
+}
+
+static VALUE
+png_reader_source_will_be_closed(VALUE obj)
+{
+    struct png_reader_data* reader;
+    reader = get_png_reader_data(obj);
+    return reader->close_source ? Qtrue : Qfalse;
+}
+
+static VALUE
+png_reader_get_image_width(VALUE obj)
+{
+    struct png_reader_data* reader;
+    reader = get_png_reader_data(obj);
+    read_header(reader);
+    return ULONG2NUM(reader->width);
+}
+
+static VALUE
+png_reader_get_image_height(VALUE obj)
+{
+    struct png_reader_data* reader;
+    reader = get_png_reader_data(obj);
+    read_header(reader);
+    return ULONG2NUM(reader->height);
+}
+
+static VALUE
+png_reader_get_bit_depth(VALUE obj)
+{
+    struct png_reader_data* reader;
+    reader = get_png_reader_data(obj);
+    read_header(reader);
+    return INT2FIX(reader->bit_depth);
+}
+
+static VALUE
+png_reader_get_color_type(VALUE obj)
+{
+    struct png_reader_data* reader;
+    reader = get_png_reader_data(obj);
+    read_header(reader);
+    return color_type_to_symbol(reader->color_type);
+}
+
+static VALUE
+png_reader_is_interlaced(VALUE obj)
+{
+    struct png_reader_data* reader;
+    reader = get_png_reader_data(obj);
+    read_header(reader);
+    return reader->interlace_type != PNG_INTERLACE_NONE ? Qtrue : Qfalse;
+}
+
+/* Whether the file has an alpha channel or a transparent color. */
+static VALUE
+png_reader_has_alpha(VALUE obj)
+{
+    struct png_reader_data* reader;
+    reader = get_png_reader_data(obj);
+    read_header(reader);
+    return reader->has_alpha ? Qtrue : Qfalse;
+}
+
+static void
+check_into(VALUE into)
+{
+    if (!RTEST(rb_obj_is_kind_of(into, cImageFileImage)))
+	rb_raise(rb_eTypeError, "wrong argument type %s (expected ImageFile::Image)",
+		rb_obj_classname(into));
+}
+
+static void
+process_arguments_of_read_image(int argc, VALUE* argv, struct png_reader_data* reader,
+	VALUE* params_ptr,
+	VALUE* into_ptr,
+	rb_image_file_image_pixel_format_t* pixel_format_ptr,
+	long* stride_ptr
+	)
+{
+    VALUE params;
+    VALUE pixel_format = Qnil;
+    VALUE stride = Qnil;
+    VALUE into = Qnil;
+
+    rb_image_file_image_pixel_format_t pf;
+    long st;
+
+    assert(reader != NULL);
+
+    rb_scan_args(argc, argv, "01", &params);
+    if (TYPE(params) == T_HASH) {
+	pixel_format = rb_hash_lookup(params, ID2SYM(id_pixel_format));
+	stride = rb_hash_lookup(params, ID2SYM(id_row_stride));
+	into = rb_hash_lookup(params, ID2SYM(id_into));
+	params = rb_hash_dup(params);
+	rb_hash_delete(params, ID2SYM(id_into));
+    }
+    else {
+	if (!NIL_P(params))
+	    rb_warning("invalid arguments are ignored.");
+	params = rb_hash_new();
+    }
+
+    /* the image to be reused keeps its pixel format and row-stride by default */
+    if (!NIL_P(into)) {
+	check_into(into);
+	if (NIL_P(pixel_format))
+	    pixel_format = rb_funcall(into, id_pixel_format, 0);
+	if (NIL_P(stride))
+	    stride = rb_funcall(into, id_row_stride, 0);
+    }
+
+    if (!NIL_P(pixel_format) && TYPE(pixel_format) != T_SYMBOL) {
+	rb_warning("pixel_format is not a symbol.");
+	pixel_format = Qnil;
+    }
+    if (!NIL_P(pixel_format)) {
+	pf = rb_image_file_image_symbol_to_pixel_format(pixel_format);
+	if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_INVALID == pf) {
+	    VALUE str = rb_id2str(SYM2ID(pixel_format));
+	    rb_warning("invalid pixel_format (%s), use default instead.", StringValueCStr(str));
+	    pixel_format = Qnil;
+	}
+    }
+
+    if (!NIL_P(stride) && TYPE(stride) != T_FIXNUM && TYPE(stride) != T_BIGNUM) {
+	rb_warning("stride is not an integer.");
+	stride = Qnil;
+    }
+
+    read_header_0((VALUE)reader);
+    if (reader->state >= READER_STARTED_DECOMPRESS) {
+	rb_raise(eImageFilePngReaderError, "decompression has already been started");
+    }
+
+    if (NIL_P(pixel_format)) {
+	pf = reader->has_alpha
+	    ? RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32
+	    : RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB24;
+	pixel_format = rb_image_file_image_pixel_format_to_symbol(pf);
+    }
+
+    st = NIL_P(stride) ? (long)reader->width : NUM2LONG(stride);
+    if (st < (long)reader->width) {
+	rb_warning("the given row-stride is less than the image width.");
+	st = (long)reader->width;
+    }
+
+    rb_hash_aset(params, ID2SYM(id_pixel_format), pixel_format);
+    rb_hash_aset(params, ID2SYM(id_width), ULONG2NUM(reader->width));
+    rb_hash_aset(params, ID2SYM(id_height), ULONG2NUM(reader->height));
+    rb_hash_aset(params, ID2SYM(id_row_stride), LONG2NUM(st));
+
+    *params_ptr = params;
+    *into_ptr = into;
+    *pixel_format_ptr = pf;
+    *stride_ptr = st;
+}
+
+/*
+ * Sets the transformations of libpng that produce the pixels of +pf+:
+ * 8-bit BGRX or BGRA in memory for ARGB32 and RGB24 on little-endian, or
+ * 8-bit RGB for RGB16_565.  ARGB32 of a file with alpha is premultiplied
+ * by the row callback, and the alpha is stripped from the other formats.
+ */
+static void
+set_transformations(struct png_reader_data* reader, rb_image_file_image_pixel_format_t const pf)
+{
+    png_structp const png = reader->png;
+    int const keep_alpha = reader->has_alpha && RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_ARGB32 == pf;
+
+    if (reader->color_type == PNG_COLOR_TYPE_PALETTE)
+	png_set_palette_to_rgb(png);
+    if (!(reader->color_type & PNG_COLOR_MASK_COLOR)) {
+	if (reader->bit_depth < 8)
+	    png_set_expand_gray_1_2_4_to_8(png);
+	png_set_gray_to_rgb(png);
+    }
+    if (png_get_valid(png, reader->info, PNG_INFO_tRNS))
+	png_set_tRNS_to_alpha(png);
+    if (reader->bit_depth == 16)
+	png_set_scale_16(png);
+
+    if (reader->has_alpha && !keep_alpha)
+	png_set_strip_alpha(png);
+    reader->premultiply = keep_alpha;
+
+    if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 != pf) {
+#ifdef WORDS_BIGENDIAN
+	if (keep_alpha)
+	    png_set_swap_alpha(png);
+	else
+	    png_set_filler(png, 0xFF, PNG_FILLER_BEFORE);
+#else
+	png_set_bgr(png);
+	if (!keep_alpha)
+	    png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+#endif
+    }
+
+    if (reader->interlace_type != PNG_INTERLACE_NONE)
+	png_set_interlace_handling(png);
+}
+
+/* libpng may raise an error while it applies the transformations. */
+static void
+start_decompress(struct png_reader_data* reader, rb_image_file_image_pixel_format_t const pf)
+{
+    size_t const row_bytes = RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == pf
+	? (size_t)reader->width*3 : (size_t)reader->width*4;
+
+    if (setjmp(png_jmpbuf(reader->png))) {
+	reader->state = READER_FAILED;
+	rb_raise(eImageFilePngReaderError, "%s", reader->error_message);
+    }
+    set_transformations(reader, pf);
+    png_read_update_info(reader->png, reader->info);
+
+    if (png_get_rowbytes(reader->png, reader->info) != row_bytes) {
+	reader->state = READER_FAILED;
+	snprintf(reader->error_message, sizeof(reader->error_message),
+		"unexpected row size (%lu for %lu)",
+		(unsigned long)png_get_rowbytes(reader->png, reader->info),
+		(unsigned long)row_bytes);
+	rb_raise(eImageFilePngReaderError, "%s", reader->error_message);
+    }
+
+    if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == pf)
+	reader->converted_row = ALLOC_N(png_byte, row_bytes);
+    reader->pixel_format = pf;
+    reader->state = READER_STARTED_DECOMPRESS;
+}
+
+struct read_image_args {
+    struct png_reader_data* reader;
+    int argc;
+    VALUE* argv;
+};
+
+static VALUE
+read_image_0(VALUE arg)
+{
+    struct read_image_args* args = (struct read_image_args*)arg;
+    struct png_reader_data* reader = args->reader;
+    VALUE params, into, image;
+    rb_image_file_image_pixel_format_t pf;
+    long st, pad, y;
+
+    process_arguments_of_read_image(args->argc, args->argv, reader, &params, &into, &pf, &st);
+    if (NIL_P(into))
+	image = rb_funcall(cImageFileImage, id_new, 1, params);
+    else {
+	if (!rb_image_file_image_reshape(into, pf, (long)reader->width, (long)reader->height, st))
+	    rb_raise(rb_eArgError, "the buffer of the image is too small for %lux%lu pixels",
+		    (unsigned long)reader->width, (unsigned long)reader->height);
+	rb_str_modify(rb_image_file_image_get_buffer(into));
+	image = into;
+    }
+
+    start_decompress(reader, pf);
+    reader->image_buffer = RSTRING_PTR(rb_image_file_image_get_buffer(image));
+    reader->row_size = st*pixel_format_size(pf);
+    pad = (st - (long)reader->width)*pixel_format_size(pf);
+    if (pad > 0) {
+	for (y = 0; y < (long)reader->height; ++y)
+	    memset(reader->image_buffer + y*reader->row_size + reader->row_size - pad, 0, pad);
+    }
+
+    process(reader, 1);
+    reader->image_buffer = NULL;
+    reader->state = READER_FINISHED_DECOMPRESS;
+    if (reader->converted_row != NULL) {
+	xfree(reader->converted_row);
+	reader->converted_row = NULL;
+    }
+    if (reader->close_source) {
+	reader->fd = -1;
+	rb_funcall(reader->source, id_close, 0);
+    }
+
+    RB_GC_GUARD(image);
+    return image;
+}
+
+/*
+ * Reads the whole file into a new image.  The parameters are
+ * :pixel_format, ARGB32 for a file with alpha and RGB24 otherwise by
+ * default, and :row_stride.  With :into, the image is reshaped and its
+ * buffer is reused as JpegReader#read_image does.
+ */
+static VALUE
+png_reader_read_image(int argc, VALUE* argv, VALUE obj)
+{
+    struct read_image_args args;
+
+    args.reader = get_png_reader_data(obj);
+    reader_check_initialized(args.reader);
+    args.argc = argc;
+    args.argv = argv;
+    return reader_run_busy(args.reader, read_image_0, (VALUE)&args);
+}
+#endif /* HAVE_PNG_H && HAVE_PNG_PROCESS_DATA_PAUSE */
+
+void
+rb_image_file_Init_image_file_png_reader(void)
+{
+#if defined(HAVE_PNG_H) && defined(HAVE_PNG_PROCESS_DATA_PAUSE)
+    cImageFilePngReader = rb_define_class_under(mImageFile, "PngReader", rb_cObject);
+    rb_define_alloc_func(cImageFilePngReader, png_reader_alloc);
+    rb_define_singleton_method(cImageFilePngReader, "open", png_reader_s_open, 1);
+    rb_define_singleton_method(cImageFilePngReader, "from_string", png_reader_s_from_string, 1);
+    rb_define_method(cImageFilePngReader, "initialize", png_reader_initialize, 1);
+
+    rb_define_method(cImageFilePngReader, "source_will_be_closed?", png_reader_source_will_be_closed, 0);
+
+    rb_define_method(cImageFilePngReader, "image_width", png_reader_get_image_width, 0);
+    rb_define_method(cImageFilePngReader, "image_height", png_reader_get_image_height, 0);
+    rb_define_method(cImageFilePngReader, "bit_depth", png_reader_get_bit_depth, 0);
+    rb_define_method(cImageFilePngReader, "color_type", png_reader_get_color_type, 0);
+    rb_define_method(cImageFilePngReader, "interlaced?", png_reader_is_interlaced, 0);
+    rb_define_method(cImageFilePngReader, "alpha?", png_reader_has_alpha, 0);
+
+    rb_define_method(cImageFilePngReader, "read_image", png_reader_read_image, -1);
+
+    eImageFilePngReaderError = rb_define_class_under(
+	    cImageFilePngReader, "Error", rb_eStandardError);
+
+    CONST_ID(id_GRAY, "GRAY");
+    CONST_ID(id_GRAY_ALPHA, "GRAY_ALPHA");
+    CONST_ID(id_RGB, "RGB");
+    CONST_ID(id_RGB_ALPHA, "RGB_ALPHA");
+    CONST_ID(id_PALETTE, "PALETTE");
+    CONST_ID(id_new, "new");
+    CONST_ID(id_close, "close");
+    CONST_ID(id_read, "read");
+    CONST_ID(id_pixel_format, "pixel_format");
+    CONST_ID(id_width, "width");
+    CONST_ID(id_height, "height");
+    CONST_ID(id_row_stride, "row_stride");
+    CONST_ID(id_into, "into");
+#endif
+}
@@ -0,0 +1,475 @@
+#include "internal.h"
+
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+/*
+ * Reads the dimensions and the color space of a JPEG file from its marker
+ * stream, without creating a decompressor.  Only the segment headers up
+ * to the SOF marker are read; the data of APPn segments other than JFIF
+ * and Adobe ones is skipped over.
+ */
+
+#define PROBE_WINDOW_SIZE 4096
+
+enum probe_color_space {
+    PROBE_UNKNOWN = 0,
+    PROBE_GRAYSCALE,
+    PROBE_RGB,
+    PROBE_YCbCr,
+    PROBE_CMYK,
+    PROBE_YCCK
+};
+
+struct probe_result {
+    long width;
+    long height;
+    int components;
+    enum probe_color_space color_space;
+    int progressive;
+    char const* error;
+    char error_buffer[128];	/* for the message of errno */
+};
+
+struct probe_source {
+    int fd;
+    unsigned char const* data;	/* the whole file when probing a string */
+    size_t length;
+    unsigned char window[PROBE_WINDOW_SIZE];
+    size_t window_offset;
+    size_t window_length;
+};
+
+static ID id_width;
+static ID id_height;
+static ID id_components;
+static ID id_color_space;
+static ID id_progressive;
+static ID id_threads;
+static ID id_to_path;
+static ID id_GRAYSCALE;
+static ID id_RGB;
+static ID id_YCbCr;
+static ID id_CMYK;
+static ID id_YCCK;
+static ID id_UNKNOWN;
+
+/* Returns the address of +n+ bytes at +offset+, or NULL at the end of file. */
+static unsigned char const*
+probe_fetch(struct probe_source* src, size_t const offset, size_t const n)
+{
+    if (src->data != NULL)
+	return offset + n <= src->length ? src->data + offset : NULL;
+
+    if (offset < src->window_offset
+	    || offset + n > src->window_offset + src->window_length) {
+	ssize_t len;
+#ifdef HAVE_PREAD
+	do {
+	    len = pread(src->fd, src->window, PROBE_WINDOW_SIZE, (off_t)offset);
+	} while (len < 0 && errno == EINTR);
+#else
+	if (lseek(src->fd, (off_t)offset, SEEK_SET) < 0)
+	    return NULL;
+	len = read(src->fd, src->window, PROBE_WINDOW_SIZE);
+#endif
+	if (len < 0)
+	    return NULL;
+	src->window_offset = offset;
+	src->window_length = (size_t)len;
+	if (n > src->window_length)
+	    return NULL;
+    }
+    return src->window + (offset - src->window_offset);
+}
+
+static inline unsigned int
+get_uint16(unsigned char const* p)
+{
+    return ((unsigned int)p[0] << 8) | p[1];
+}
+
+/* The default color space libjpeg infers from the markers. */
+static enum probe_color_space
+guess_color_space(int const components, unsigned char const* ids,
+	int const saw_jfif, int const adobe_transform)
+{
+    switch (components) {
+	case 1:
+	    return PROBE_GRAYSCALE;
+
+	case 3:
+	    if (saw_jfif)
+		return PROBE_YCbCr;
+	    if (adobe_transform >= 0)
+		return adobe_transform == 0 ? PROBE_RGB : PROBE_YCbCr;
+	    if (ids[0] == 'R' && ids[1] == 'G' && ids[2] == 'B')
+		return PROBE_RGB;
+	    return PROBE_YCbCr;
+
+	case 4:
+	    return adobe_transform == 2 ? PROBE_YCCK : PROBE_CMYK;
+
+	default:
+	    break;
+    }
+    return PROBE_UNKNOWN;
+}
+
+static void
+probe_markers(struct probe_source* src, struct probe_result* result)
+{
+    unsigned char const* p;
+    size_t offset = 2;
+    int saw_jfif = 0;
+    int adobe_transform = -1;
+
+    p = probe_fetch(src, 0, 2);
+    if (p == NULL || p[0] != 0xFF || p[1] != 0xD8) {
+	result->error = "not a JPEG file";
+	return;
+    }
+
+    for (;;) {
+	unsigned int marker, length;
+
+	if ((p = probe_fetch(src, offset, 1)) == NULL)
+	    goto premature_end;
+	if (p[0] != 0xFF) {
+	    result->error = "invalid JPEG marker";
+	    return;
+	}
+	/* a marker may be preceded by any number of fill bytes */
+	do {
+	    if ((p = probe_fetch(src, ++offset, 1)) == NULL)
+		goto premature_end;
+	} while (p[0] == 0xFF);
+	marker = p[0];
+	offset += 1;
+
+	if (marker == 0x01 || (0xD0 <= marker && marker <= 0xD7))
+	    continue;
+	if (marker == 0xD9 || marker == 0xDA) {
+	    result->error = "no SOF marker before image data";
+	    return;
+	}
+
+	if ((p = probe_fetch(src, offset, 2)) == NULL)
+	    goto premature_end;
+	length = get_uint16(p);
+	if (length < 2) {
+	    result->error = "invalid JPEG marker length";
+	    return;
+	}
+
+	switch (marker) {
+	    case 0xC0: case 0xC1: case 0xC2: case 0xC3:
+	    case 0xC5: case 0xC6: case 0xC7:
+	    case 0xC9: case 0xCA: case 0xCB:
+	    case 0xCD: case 0xCE: case 0xCF: {
+		unsigned char ids[4] = { 0, 0, 0, 0 };
+		int i;
+
+		if (length < 8 || (p = probe_fetch(src, offset + 2, 6)) == NULL)
+		    goto premature_end;
+		result->height = (long)get_uint16(p + 1);
+		result->width = (long)get_uint16(p + 3);
+		result->components = p[5];
+		result->progressive = (marker & 0x03) == 0x02;
+		for (i = 0; i < result->components && i < 4; ++i) {
+		    if ((p = probe_fetch(src, offset + 8 + 3*i, 1)) == NULL)
+			goto premature_end;
+		    ids[i] = p[0];
+		}
+		result->color_space = guess_color_space(result->components, ids,
+			saw_jfif, adobe_transform);
+		return;
+	    }
+
+	    case 0xE0:
+		if (length >= 7 && (p = probe_fetch(src, offset + 2, 5)) != NULL
+			&& memcmp(p, "JFIF", 5) == 0)
+		    saw_jfif = 1;
+		break;
+
+	    case 0xEE:
+		if (length >= 14 && (p = probe_fetch(src, offset + 2, 12)) != NULL
+			&& memcmp(p, "Adobe", 5) == 0)
+		    adobe_transform = p[11];
+		break;
+
+	    default:
+		break;
+	}
+	offset += length;
+    }
+
+premature_end:
+    result->error = "premature end of JPEG file";
+}
+
+static void
+probe_file(char const* path, struct probe_result* result)
+{
+    struct probe_source src;
+
+    memset(&src, 0, sizeof(src));
+    src.fd = open(path, O_RDONLY
+#ifdef O_CLOEXEC
+	    | O_CLOEXEC
+#endif
+	    );
+    if (src.fd < 0) {
+	copy_error_message(errno, result->error_buffer, sizeof(result->error_buffer));
+	result->error = result->error_buffer;
+	return;
+    }
+    probe_markers(&src, result);
+    close(src.fd);
+}
+
+static VALUE
+color_space_to_symbol(enum probe_color_space const color_space)
+{
+    switch (color_space) {
+	case PROBE_GRAYSCALE:
+	    return ID2SYM(id_GRAYSCALE);
+	case PROBE_RGB:
+	    return ID2SYM(id_RGB);
+	case PROBE_YCbCr:
+	    return ID2SYM(id_YCbCr);
+	case PROBE_CMYK:
+	    return ID2SYM(id_CMYK);
+	case PROBE_YCCK:
+	    return ID2SYM(id_YCCK);
+	default:
+	    break;
+    }
+    return ID2SYM(id_UNKNOWN);
+}
+
+static VALUE
+probe_result_to_hash(struct probe_result const* result)
+{
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(id_width), LONG2NUM(result->width));
+    rb_hash_aset(hash, ID2SYM(id_height), LONG2NUM(result->height));
+    rb_hash_aset(hash, ID2SYM(id_components), INT2NUM(result->components));
+    rb_hash_aset(hash, ID2SYM(id_color_space), color_space_to_symbol(result->color_space));
+    rb_hash_aset(hash, ID2SYM(id_progressive), result->progressive ? Qtrue : Qfalse);
+    return hash;
+}
+
+static VALUE
+probe_error(VALUE path, struct probe_result const* result)
+{
+    if (NIL_P(path))
+	return rb_exc_new_cstr(eImageFileJpegReaderError, result->error);
+    return rb_exc_new_str(eImageFileJpegReaderError,
+	    rb_sprintf("%"PRIsVALUE": %s", path, result->error));
+}
+
+struct probe_batch_item {
+    char const* path;
+    struct probe_result result;
+    int done;
+};
+
+struct probe_batch {
+    VALUE paths;
+    struct probe_batch_item* items;
+    long num_items;
+    int threads;
+    int volatile interrupted;
+};
+
+static void
+probe_batch_process_item(void* data, long const index)
+{
+    struct probe_batch* batch = (struct probe_batch*)data;
+    struct probe_batch_item* item = &batch->items[index];
+
+    if (item->done || batch->interrupted)
+	return;
+    probe_file(item->path, &item->result);
+    item->done = 1;
+}
+
+static void*
+probe_batch_without_gvl(void* ptr)
+{
+    struct probe_batch* batch = (struct probe_batch*)ptr;
+    rb_image_file_parallel_for(batch->num_items, batch->threads,
+	    probe_batch_process_item, batch);
+    return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void
+probe_batch_interrupt(void* ptr)
+{
+    struct probe_batch* batch = (struct probe_batch*)ptr;
+    batch->interrupted = 1;
+}
+#endif
+
+static VALUE
+probe_batch_run(VALUE arg)
+{
+    struct probe_batch* batch = (struct probe_batch*)arg;
+    VALUE result;
+    long i;
+
+    for (;;) {
+	batch->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl(probe_batch_without_gvl, batch, probe_batch_interrupt, batch);
+	rb_thread_check_ints();
+#else
+	probe_batch_without_gvl(batch);
+#endif
+	for (i = 0; i < batch->num_items; ++i) {
+	    if (!batch->items[i].done)
+		break;
+	}
+	if (i == batch->num_items)
+	    break;
+    }
+
+    result = rb_ary_new2(batch->num_items);
+    for (i = 0; i < batch->num_items; ++i) {
+	struct probe_result const* r = &batch->items[i].result;
+	rb_ary_push(result, r->error != NULL
+		? probe_error(rb_ary_entry(batch->paths, i), r) : probe_result_to_hash(r));
+    }
+    return result;
+}
+
+static VALUE
+probe_batch_cleanup(VALUE arg)
+{
+    struct probe_batch* batch = (struct probe_batch*)arg;
+    xfree(batch->items);
+    return Qnil;
+}
+
+static void*
+probe_file_without_gvl(void* ptr)
+{
+    struct probe_batch_item* item = (struct probe_batch_item*)ptr;
+    probe_file(item->path, &item->result);
+    return NULL;
+}
+
+/*
+ * Reads the header of a JPEG file, given either its path or its content
+ * as a string, and returns a hash of :width, :height, :components,
+ * :color_space and :progressive.  Raises ImageFile::JpegReader::Error if
+ * it is not a JPEG file.
+ */
+static VALUE
+image_file_s_probe(VALUE klass ARG_UNUSED, VALUE source)
+{
+    struct probe_batch_item item;
+
+    memset(&item, 0, sizeof(item));
+    if (jpeg_data_p(source)) {
+	struct probe_source src;
+	memset(&src, 0, sizeof(src));
+	src.fd = -1;
+	src.data = (unsigned char const*)RSTRING_PTR(source);
+	src.length = (size_t)RSTRING_LEN(source);
+	probe_markers(&src, &item.result);
+	RB_GC_GUARD(source);
+	source = Qnil;
+    }
+    else {
+	if (rb_respond_to(source, id_to_path))
+	    source = rb_funcall(source, id_to_path, 0);
+	source = rb_str_new_frozen(StringValue(source));
+	item.path = StringValueCStr(source);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl(probe_file_without_gvl, &item, RUBY_UBF_IO, NULL);
+#else
+	probe_file_without_gvl(&item);
+#endif
+    }
+
+    if (item.result.error != NULL)
+	rb_exc_raise(probe_error(source, &item.result));
+    return probe_result_to_hash(&item.result);
+}
+
+/*
+ * Probes the JPEG files at +paths+ on native worker threads, and returns
+ * an array of the hashes ImageFile.probe returns.  A file that cannot be
+ * probed gets an instance of ImageFile::JpegReader::Error instead.
+ *
+ * The only recognized parameter is :threads, which defaults to the number
+ * of processors.
+ */
+static VALUE
+image_file_s_probe_batch(int argc, VALUE* argv, VALUE klass ARG_UNUSED)
+{
+    struct probe_batch batch;
+    VALUE paths, params, threads;
+    long i;
+
+    rb_scan_args(argc, argv, "11", &paths, &params);
+    paths = rb_Array(paths);
+
+    threads = Qnil;
+    if (!NIL_P(params)) {
+	Check_Type(params, T_HASH);
+	threads = rb_hash_lookup(params, ID2SYM(id_threads));
+    }
+    batch.threads = NIL_P(threads) ? rb_image_file_number_of_processors() : NUM2INT(threads);
+    if (batch.threads < 1)
+	rb_raise(rb_eArgError, "threads must be positive");
+
+    paths = rb_ary_dup(paths);
+    for (i = 0; i < RARRAY_LEN(paths); ++i) {
+	VALUE path = rb_ary_entry(paths, i);
+	FilePathValue(path);
+	rb_ary_store(paths, i, rb_str_new_frozen(path));
+    }
+
+    batch.num_items = RARRAY_LEN(paths);
+    batch.items = ALLOC_N(struct probe_batch_item, batch.num_items);
+    MEMZERO(batch.items, struct probe_batch_item, batch.num_items);
+    for (i = 0; i < batch.num_items; ++i)
+	batch.items[i].path = StringValueCStr(RARRAY_PTR(paths)[i]);
+
+    batch.paths = paths;
+    RB_GC_GUARD(paths);
+    return rb_ensure(probe_batch_run, (VALUE)&batch, probe_batch_cleanup, (VALUE)&batch);
+}
+
+void
+rb_image_file_Init_image_file_probe(void)
+{
+    rb_define_module_function(mImageFile, "probe", image_file_s_probe, 1);
+    rb_define_module_function(mImageFile, "probe_batch", image_file_s_probe_batch, -1);
+
+    CONST_ID(id_width, "width");
+    CONST_ID(id_height, "height");
+    CONST_ID(id_components, "components");
+    CONST_ID(id_color_space, "color_space");
+    CONST_ID(id_progressive, "progressive");
+    CONST_ID(id_threads, "threads");
+    CONST_ID(id_to_path, "to_path");
+    CONST_ID(id_GRAYSCALE, "GRAYSCALE");
+    CONST_ID(id_RGB, "RGB");
+    CONST_ID(id_YCbCr, "YCbCr");
+    CONST_ID(id_CMYK, "CMYK");
+    CONST_ID(id_YCCK, "YCCK");
+    CONST_ID(id_UNKNOWN, "UNKNOWN");
+}
@@ -0,0 +1,544 @@
+#include "internal.h"
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+
+#include <math.h>
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(HAVE_IMMINTRIN_H)
+# define USE_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+/*
+ * Separable resampling of 4-byte and RGB16_565 pixels.  Each output pixel
+ * is a weighted sum of a run of input pixels, computed first along rows
+ * into an intermediate image and then along columns.  The weights are
+ * fixed-point numbers whose sum is 1 << WEIGHT_BITS, and the sums are
+ * accumulated in 32 bits, which is enough even for the negative lobes of
+ * Lanczos; so every variant below produces the same pixels.
+ */
+
+#define WEIGHT_BITS 22
+
+/* rows of the output computed by a call of the parallel loop */
+#define BAND_HEIGHT 64
+
+struct resize_contrib {
+    long first;
+    long count;
+    int* weights;
+};
+
+struct resize_kernel {
+    long size;			/* number of output pixels */
+    long max_count;
+    struct resize_contrib* contribs;
+    int* weights;
+};
+
+static void
+alloc_kernel(struct resize_kernel* kernel, long const out_size, long const max_count)
+{
+    kernel->size = out_size;
+    kernel->max_count = max_count;
+    kernel->contribs = ALLOC_N(struct resize_contrib, out_size);
+    kernel->weights = ALLOC_N(int, out_size * max_count);
+}
+
+/* Converts the weights of +c+ to fixed-point numbers whose sum is exact. */
+static void
+set_fixed_weights(struct resize_contrib* c, double const* w, double const total)
+{
+    int fixed_total = 0;
+    long j;
+
+    for (j = 0; j < c->count; ++j) {
+	c->weights[j] = total != 0 ? (int)floor(w[j] / total * (1 << WEIGHT_BITS) + 0.5) : 0;
+	fixed_total += c->weights[j];
+    }
+    /* let the largest weight absorb the rounding error */
+    if (c->count > 0) {
+	long k = 0;
+	for (j = 1; j < c->count; ++j)
+	    if (c->weights[j] > c->weights[k])
+		k = j;
+	c->weights[k] += (1 << WEIGHT_BITS) - fixed_total;
+    }
+}
+
+/* Weights of the area (box) filter: each input pixel contributes by the
+ * length of its overlap with the span of the output pixel. */
+static void
+compute_area_kernel(struct resize_kernel* kernel, long const in_size, long const out_size)
+{
+    double const scale = (double)in_size / (double)out_size;
+    long const max_count = (long)ceil(scale) + 1;
+    double* w = ALLOC_N(double, max_count);
+    long i, j;
+
+    alloc_kernel(kernel, out_size, max_count);
+
+    for (i = 0; i < out_size; ++i) {
+	struct resize_contrib* c = &kernel->contribs[i];
+	double const x0 = i * scale;
+	double const x1 = x0 + scale;
+	long first = (long)floor(x0);
+	long last = (long)ceil(x1);
+	double total = 0;
+
+	if (last > in_size)
+	    last = in_size;
+	if (last - first > max_count)
+	    last = first + max_count;
+	for (j = first; j < last; ++j) {
+	    double const lo = j < x0 ? x0 : j;
+	    double const hi = j + 1 > x1 ? x1 : j + 1;
+	    w[j - first] = hi > lo ? hi - lo : 0;
+	    total += w[j - first];
+	}
+
+	c->first = first;
+	c->count = last - first;
+	c->weights = kernel->weights + i * max_count;
+	set_fixed_weights(c, w, total);
+    }
+
+    xfree(w);
+}
+
+static double
+bilinear_filter(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static inline double
+sinc(double const x)
+{
+    double const px = M_PI * x;
+    return x == 0.0 ? 1.0 : sin(px) / px;
+}
+
+static double
+lanczos3_filter(double const x)
+{
+    return -3.0 < x && x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+/*
+ * Weights of a convolution filter of +support+ centered on each output
+ * pixel.  The filter is stretched by the scale when downscaling, so that
+ * it also works as a low-pass filter.
+ */
+static void
+compute_convolution_kernel(struct resize_kernel* kernel, long const in_size, long const out_size,
+	double (* filter)(double), double const support)
+{
+    double const scale = (double)in_size / (double)out_size;
+    double const filter_scale = scale > 1.0 ? scale : 1.0;
+    double const scaled_support = support * filter_scale;
+    long const max_count = (long)ceil(scaled_support) * 2 + 1;
+    double* w = ALLOC_N(double, max_count);
+    long i, j;
+
+    alloc_kernel(kernel, out_size, max_count);
+
+    for (i = 0; i < out_size; ++i) {
+	struct resize_contrib* c = &kernel->contribs[i];
+	double const center = (i + 0.5) * scale;
+	long first = (long)(center - scaled_support + 0.5);
+	long last = (long)(center + scaled_support + 0.5);
+	double total = 0;
+
+	if (first < 0)
+	    first = 0;
+	if (last > in_size)
+	    last = in_size;
+	if (last - first > max_count)
+	    last = first + max_count;
+	for (j = first; j < last; ++j) {
+	    w[j - first] = (* filter)((j - center + 0.5) / filter_scale);
+	    total += w[j - first];
+	}
+
+	c->first = first;
+	c->count = last - first;
+	c->weights = kernel->weights + i * max_count;
+	set_fixed_weights(c, w, total);
+    }
+
+    xfree(w);
+}
+
+static void
+compute_kernel(struct resize_kernel* kernel, long const in_size, long const out_size,
+	rb_image_file_resize_filter_t const filter)
+{
+    switch (filter) {
+	case RB_IMAGE_FILE_RESIZE_FILTER_BILINEAR:
+	    compute_convolution_kernel(kernel, in_size, out_size, bilinear_filter, 1.0);
+	    break;
+
+	case RB_IMAGE_FILE_RESIZE_FILTER_LANCZOS3:
+	    compute_convolution_kernel(kernel, in_size, out_size, lanczos3_filter, 3.0);
+	    break;
+
+	default:
+	    compute_area_kernel(kernel, in_size, out_size);
+	    break;
+    }
+}
+
+static void
+free_kernel(struct resize_kernel* kernel)
+{
+    xfree(kernel->contribs);
+    xfree(kernel->weights);
+}
+
+static inline unsigned char
+clamp_sample(int32_t const v)
+{
+    int32_t const s = (v + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+    return s < 0 ? 0 : s > 255 ? 255 : (unsigned char)s;
+}
+
+static void
+resample_row_generic(unsigned char const* src, unsigned char* dst, struct resize_kernel const* kernel)
+{
+    long i, j;
+
+    for (i = 0; i < kernel->size; ++i) {
+	struct resize_contrib const* c = &kernel->contribs[i];
+	unsigned char const* p = src + 4*c->first;
+	int32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	for (j = 0; j < c->count; ++j, p += 4) {
+	    int32_t const w = c->weights[j];
+	    s0 += p[0] * w;
+	    s1 += p[1] * w;
+	    s2 += p[2] * w;
+	    s3 += p[3] * w;
+	}
+	dst[4*i + 0] = clamp_sample(s0);
+	dst[4*i + 1] = clamp_sample(s1);
+	dst[4*i + 2] = clamp_sample(s2);
+	dst[4*i + 3] = clamp_sample(s3);
+    }
+}
+
+/* Resamples the +n+ bytes of the rows of +src+ with the weights of +c+. */
+static void
+resample_column_generic(unsigned char const* src, long const src_pitch, unsigned char* dst,
+	long const n, struct resize_contrib const* c, int32_t* acc)
+{
+    long i, j;
+
+    for (i = 0; i < n; ++i)
+	acc[i] = 0;
+    for (j = 0; j < c->count; ++j) {
+	unsigned char const* p = src + (c->first + j)*src_pitch;
+	int32_t const w = c->weights[j];
+	for (i = 0; i < n; ++i)
+	    acc[i] += p[i] * w;
+    }
+    for (i = 0; i < n; ++i)
+	dst[i] = clamp_sample(acc[i]);
+}
+
+#ifdef USE_X86_SIMD
+/* One pixel is four 32-bit lanes; the packs saturate like clamp_sample. */
+__attribute__((target("sse4.1")))
+static void
+resample_row_sse41(unsigned char const* src, unsigned char* dst, struct resize_kernel const* kernel)
+{
+    __m128i const half = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+    long i, j;
+
+    for (i = 0; i < kernel->size; ++i) {
+	struct resize_contrib const* c = &kernel->contribs[i];
+	unsigned char const* p = src + 4*c->first;
+	__m128i acc = half;
+	int32_t v;
+	for (j = 0; j < c->count; ++j, p += 4) {
+	    memcpy(&v, p, 4);
+	    acc = _mm_add_epi32(acc, _mm_mullo_epi32(
+			_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)), _mm_set1_epi32(c->weights[j])));
+	}
+	acc = _mm_srai_epi32(acc, WEIGHT_BITS);
+	acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+	v = _mm_cvtsi128_si32(acc);
+	memcpy(dst + 4*i, &v, 4);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void
+resample_column_sse41(unsigned char const* src, long const src_pitch, unsigned char* dst,
+	long const n, struct resize_contrib const* c, int32_t* acc)
+{
+    __m128i const half = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+    long i, j;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m128i lo = half, hi = half;
+	for (j = 0; j < c->count; ++j) {
+	    __m128i const w = _mm_set1_epi32(c->weights[j]);
+	    __m128i const p = _mm_loadl_epi64((__m128i const*)(src + (c->first + j)*src_pitch + i));
+	    lo = _mm_add_epi32(lo, _mm_mullo_epi32(_mm_cvtepu8_epi32(p), w));
+	    hi = _mm_add_epi32(hi, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(p, 4)), w));
+	}
+	lo = _mm_packs_epi32(_mm_srai_epi32(lo, WEIGHT_BITS), _mm_srai_epi32(hi, WEIGHT_BITS));
+	_mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(lo, lo));
+    }
+    if (i < n)
+	resample_column_generic(src + i, src_pitch, dst + i, n - i, c, acc);
+}
+
+__attribute__((target("avx2")))
+static void
+resample_column_avx2(unsigned char const* src, long const src_pitch, unsigned char* dst,
+	long const n, struct resize_contrib const* c, int32_t* acc)
+{
+    __m256i const half = _mm256_set1_epi32(1 << (WEIGHT_BITS - 1));
+    long i, j;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+	__m256i lo = half, hi = half;
+	__m128i packed;
+	for (j = 0; j < c->count; ++j) {
+	    __m256i const w = _mm256_set1_epi32(c->weights[j]);
+	    __m128i const p = _mm_loadu_si128((__m128i const*)(src + (c->first + j)*src_pitch + i));
+	    lo = _mm256_add_epi32(lo, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(p), w));
+	    hi = _mm256_add_epi32(hi, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(p, 8)), w));
+	}
+	lo = _mm256_srai_epi32(lo, WEIGHT_BITS);
+	hi = _mm256_srai_epi32(hi, WEIGHT_BITS);
+	/* packs work within 128-bit lanes, so the halves are put in order first */
+	lo = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+	packed = _mm_packus_epi16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+	_mm_storeu_si128((__m128i*)(dst + i), packed);
+    }
+    if (i < n)
+	resample_column_sse41(src + i, src_pitch, dst + i, n - i, c, acc);
+}
+#endif /* USE_X86_SIMD */
+
+struct resampler {
+    char const* name;
+    void (* resample_row)(unsigned char const* src, unsigned char* dst, struct resize_kernel const* kernel);
+    void (* resample_column)(unsigned char const* src, long src_pitch, unsigned char* dst,
+	    long n, struct resize_contrib const* c, int32_t* acc);
+};
+
+static struct resampler const generic_resampler = {
+    "generic",
+    resample_row_generic,
+    resample_column_generic,
+};
+
+#ifdef USE_X86_SIMD
+static struct resampler const sse41_resampler = {
+    "sse4.1",
+    resample_row_sse41,
+    resample_column_sse41,
+};
+
+static struct resampler const avx2_resampler = {
+    "avx2",
+    resample_row_sse41,
+    resample_column_avx2,
+};
+#endif
+
+static struct resampler resampler;
+
+static void
+expand_rgb16_565_row(uint16_t const* src, unsigned char* dst, long const n)
+{
+    long i;
+    for (i = 0; i < n; ++i, dst += 4) {
+	uint16_t const p = src[i];
+	unsigned int const r = (p >> 11) & 0x1F;
+	unsigned int const g = (p >> 5) & 0x3F;
+	unsigned int const b = p & 0x1F;
+	dst[0] = (unsigned char)((b << 3) | (b >> 2));
+	dst[1] = (unsigned char)((g << 2) | (g >> 4));
+	dst[2] = (unsigned char)((r << 3) | (r >> 2));
+	dst[3] = 0;
+    }
+}
+
+static void
+pack_rgb16_565_row(unsigned char const* src, uint16_t* dst, long const n)
+{
+    long i;
+    for (i = 0; i < n; ++i, src += 4)
+	dst[i] = (uint16_t)(((src[2] >> 3) << 11) | ((src[1] >> 2) << 5) | (src[0] >> 3));
+}
+
+struct resize_args {
+    char const* src;
+    long src_width;
+    long src_height;
+    long src_stride;
+    char* dst;
+    long dst_width;
+    long dst_height;
+    long dst_stride;
+    rb_image_file_image_pixel_format_t pf;
+    int threads;
+    struct resize_kernel hkernel;
+    struct resize_kernel vkernel;
+    unsigned char* tmp;		/* src_height rows of dst_width pixels */
+    long pitch;
+    unsigned char* rows;	/* a scratch row of every band */
+    int32_t* accs;		/* an accumulator row of every band */
+    long row_size;
+};
+
+/* The rows pass of a band of BAND_HEIGHT input rows. */
+static void
+resize_rows(void* ptr, long const band)
+{
+    struct resize_args* args = (struct resize_args*)ptr;
+    int const bpp = pixel_format_size(args->pf);
+    unsigned char* row = args->rows + band*args->row_size;
+    long y = band*BAND_HEIGHT;
+    long end = y + BAND_HEIGHT;
+
+    if (end > args->src_height)
+	end = args->src_height;
+    for (; y < end; ++y) {
+	char const* s = args->src + y*args->src_stride*bpp;
+	if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == args->pf) {
+	    expand_rgb16_565_row((uint16_t const*)s, row, args->src_width);
+	    (* resampler.resample_row)(row, args->tmp + y*args->pitch, &args->hkernel);
+	}
+	else
+	    (* resampler.resample_row)((unsigned char const*)s, args->tmp + y*args->pitch, &args->hkernel);
+    }
+}
+
+/* The columns pass of a band of BAND_HEIGHT output rows. */
+static void
+resize_columns(void* ptr, long const band)
+{
+    struct resize_args* args = (struct resize_args*)ptr;
+    int const bpp = pixel_format_size(args->pf);
+    unsigned char* row = args->rows + band*args->row_size;
+    int32_t* acc = args->accs + band*args->pitch;
+    long y = band*BAND_HEIGHT;
+    long end = y + BAND_HEIGHT;
+    long x;
+
+    if (end > args->dst_height)
+	end = args->dst_height;
+    for (; y < end; ++y) {
+	char* d = args->dst + y*args->dst_stride*bpp;
+	if (RB_IMAGE_FILE_IMAGE_PIXEL_FORMAT_RGB16_565 == args->pf) {
+	    (* resampler.resample_column)(args->tmp, args->pitch, row, args->pitch, &args->vkernel.contribs[y], acc);
+	    pack_rgb16_565_row(row, (uint16_t*)d, args->dst_width);
+	    for (x = args->dst_width; x < args->dst_stride; ++x)
+		((uint16_t*)d)[x] = 0;
+	}
+	else {
+	    (* resampler.resample_column)(args->tmp, args->pitch, (unsigned char*)d, args->pitch, &args->vkernel.contribs[y], acc);
+	    for (x = args->dst_width; x < args->dst_stride; ++x)
+		((uint32_t*)d)[x] = 0;
+	}
+    }
+}
+
+static inline long
+number_of_bands(long const rows)
+{
+    return (rows + BAND_HEIGHT - 1) / BAND_HEIGHT;
+}
+
+/* This function must not call any Ruby API; it may run without the GVL. */
+static void*
+resize_without_gvl(void* ptr)
+{
+    struct resize_args* args = (struct resize_args*)ptr;
+
+    rb_image_file_parallel_for(number_of_bands(args->src_height), args->threads, resize_rows, args);
+    rb_image_file_parallel_for(number_of_bands(args->dst_height), args->threads, resize_columns, args);
+
+    return NULL;
+}
+
+/*
+ * Resamples the +src_width+ x +src_height+ pixels of +src+ into the
+ * +dst_width+ x +dst_height+ pixels of +dst+ with +filter+.  The strides
+ * are in pixels.  The passes are computed without the GVL, in bands of
+ * rows shared by at most +threads+ native threads.
+ */
+void
+rb_image_file_resize(
+	char const* const src, long const src_width, long const src_height, long const src_stride,
+	char* const dst, long const dst_width, long const dst_height, long const dst_stride,
+	rb_image_file_image_pixel_format_t const pf,
+	rb_image_file_resize_filter_t const filter, int const threads)
+{
+    struct resize_args args;
+    long bands;
+
+    assert(src_width > 0 && src_height > 0);
+    assert(dst_width > 0 && dst_height > 0);
+
+    args.src = src;
+    args.src_width = src_width;
+    args.src_height = src_height;
+    args.src_stride = src_stride;
+    args.dst = dst;
+    args.dst_width = dst_width;
+    args.dst_height = dst_height;
+    args.dst_stride = dst_stride;
+    args.pf = pf;
+    args.threads = threads > 0 ? threads : 1;
+
+    compute_kernel(&args.hkernel, src_width, dst_width, filter);
+    compute_kernel(&args.vkernel, src_height, dst_height, filter);
+    args.pitch = dst_width*4;
+    args.row_size = (src_width > dst_width ? src_width : dst_width)*4;
+    bands = number_of_bands(src_height > dst_height ? src_height : dst_height);
+    args.tmp = ALLOC_N(unsigned char, args.pitch * src_height);
+    args.rows = ALLOC_N(unsigned char, args.row_size * bands);
+    args.accs = ALLOC_N(int32_t, args.pitch * bands);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(resize_without_gvl, &args, RUBY_UBF_PROCESS, NULL);
+#else
+    resize_without_gvl(&args);
+#endif
+
+    xfree(args.accs);
+    xfree(args.rows);
+    xfree(args.tmp);
+    free_kernel(&args.vkernel);
+    free_kernel(&args.hkernel);
+}
+
+static struct resampler const*
+select_resampler(void)
+{
+#if defined(USE_X86_SIMD) && defined(HAVE___BUILTIN_CPU_SUPPORTS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return &avx2_resampler;
+    if (__builtin_cpu_supports("sse4.1"))
+	return &sse41_resampler;
+#endif
+    return &generic_resampler;
+}
+
+void
+rb_image_file_Init_image_file_resize(void)
+{
+    resampler = *select_resampler();
+}
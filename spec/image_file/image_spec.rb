@@ -43,6 +43,154 @@ module ImageFile
     its(:row_stride) { should be == 64 }
     its(:pixel_format) { should be == :RGB24 }
   end
+
+  describe Image, "with data and copy: false" do
+    let(:data) { "\0" * (500 * 300 * 4) }
+    subject { Image.new(width:500, height:300, pixel_format: :RGB24, data: data, copy: false) }
+
+    it "should share the pixels with the data" do
+      JpegReader.open(File.expand_path('support/recompile_cat.jpg', SPEC_DIR)).read_image(into: subject)
+      data.should_not be == "\0" * data.bytesize
+    end
+
+    describe "create_cairo_surface", "with copy: false" do
+      it "should lock the data until the surface is destroyed" do
+        surface = subject.create_cairo_surface(copy: false)
+        expect { data << "\0" }.to raise_error(RuntimeError)
+        expect { subject.convert!(pixel_format: :ARGB32, row_stride: 512) }.to raise_error(RuntimeError)
+        surface.destroy
+        expect { data << "\0" }.to_not raise_error
+      end
+    end
+  end
+
+  describe Image, "with data" do
+    let(:data) { "\0" * (500 * 300 * 4) }
+    subject { Image.new(width:500, height:300, pixel_format: :RGB24, data: data) }
+
+    it "should copy the data" do
+      JpegReader.open(File.expand_path('support/recompile_cat.jpg', SPEC_DIR)).read_image(into: subject)
+      data.should be == "\0" * data.bytesize
+    end
+  end
+
+  describe Image, "#convert" do
+    let(:data) { [0x80402010, 0xFF00FF00].pack('L*') * 8 }
+    let(:image) { Image.new(width:4, height:4, pixel_format: :ARGB32, data: data) }
+
+    context "to RGB16_565 with row-stride" do
+      subject { image.convert(pixel_format: :RGB16_565, row_stride: 8) }
+      its(:width) { should be == 4 }
+      its(:height) { should be == 4 }
+      its(:row_stride) { should be == 8 }
+      its(:pixel_format) { should be == :RGB16_565 }
+    end
+
+    context "without pixel_format" do
+      subject { image.convert }
+      its(:pixel_format) { should be == :ARGB32 }
+      it { should_not equal(image) }
+    end
+
+    context "to RGB24 and back" do
+      it "should make the pixels opaque" do
+        out = "\0".b * (4 * 4 * 4)
+        converted = image.convert(pixel_format: :RGB24).convert(pixel_format: :ARGB32)
+        converted.resize(4, 4, into: Image.new(width:4, height:4, pixel_format: :ARGB32, data: out, copy: false))
+        out.unpack('L2').should be == [0xFF402010, 0xFF00FF00]
+      end
+    end
+
+    context "with an unknown pixel format" do
+      it { expect { image.convert(pixel_format: :RGB48) }.to raise_error(ArgumentError) }
+    end
+  end
+
+  describe Image, "#convert!" do
+    let(:data) { [0xFF336699].pack('L') * (16 * 4) }
+    subject { Image.new(width:16, height:4, pixel_format: :RGB24, data: data, copy: false) }
+
+    it "should convert the pixels in the shared buffer" do
+      subject.convert!(pixel_format: :RGB16_565)
+      subject.pixel_format.should be == :RGB16_565
+      subject.row_stride.should be == 16
+      data.unpack('S16').uniq.should be == [0x3333]
+    end
+
+    it "should spread a flat color with dither: true" do
+      subject.convert!(pixel_format: :RGB16_565, dither: true)
+      data.unpack('S16').uniq.size.should be > 1
+    end
+
+    it "should convert into a new buffer for longer rows" do
+      subject.convert!(pixel_format: :RGB16_565).convert!(pixel_format: :ARGB32)
+      subject.pixel_format.should be == :ARGB32
+      data.unpack('S16').uniq.should be == [0x3333]
+    end
+  end
+
+  describe Image, "#resize" do
+    let(:cat) { JpegReader.open(File.expand_path('support/recompile_cat.jpg', SPEC_DIR)).read_image }
+
+    [:box, :bilinear, :lanczos3].each do |filter|
+      context "with filter: #{filter.inspect}" do
+        subject { cat.resize(125, 75, filter: filter) }
+        its(:width) { should be == 125 }
+        its(:height) { should be == 75 }
+        its(:pixel_format) { should be == :RGB24 }
+      end
+    end
+
+    context "to a larger size" do
+      subject { cat.resize(1000, 600, filter: :lanczos3) }
+      its(:width) { should be == 1000 }
+      its(:height) { should be == 600 }
+    end
+
+    context "of a solid color image" do
+      let(:data) { [0xFF336699].pack('L') * (64 * 64) }
+      let(:solid) { Image.new(width:64, height:64, pixel_format: :ARGB32, data: data) }
+      [:box, :bilinear, :lanczos3].each do |filter|
+        it "should keep the color with filter: #{filter.inspect}" do
+          out = "\0".b * (20 * 30 * 4)
+          solid.resize(20, 30, filter: filter, into: Image.new(width:20, height:30, pixel_format: :ARGB32, data: out, copy: false))
+          out.unpack('L*').uniq.should be == [0xFF336699]
+        end
+      end
+    end
+
+    context "with threads: 4" do
+      it "should be the same as with one thread" do
+        one, four = "\0".b * (333 * 222 * 4), "\0".b * (333 * 222 * 4)
+        cat.resize(333, 222, filter: :lanczos3, into: Image.new(width:333, height:222, pixel_format: :RGB24, data: one, copy: false))
+        cat.resize(333, 222, filter: :lanczos3, threads: 4, into: Image.new(width:333, height:222, pixel_format: :RGB24, data: four, copy: false))
+        four.should be == one
+      end
+    end
+
+    context "into an image with row-stride" do
+      let(:into) { Image.new(width:300, height:300, pixel_format: :RGB16_565, row_stride:320) }
+      subject { cat.resize(250, 150, into: into) }
+      it { should equal(into) }
+      its(:width) { should be == 250 }
+      its(:height) { should be == 150 }
+      its(:row_stride) { should be == 320 }
+      its(:pixel_format) { should be == :RGB24 }
+    end
+
+    context "into a too small image" do
+      let(:into) { Image.new(width:10, height:10, pixel_format: :RGB24) }
+      it { expect { cat.resize(250, 150, into: into) }.to raise_error(ArgumentError) }
+    end
+
+    context "with an unknown filter" do
+      it { expect { cat.resize(250, 150, filter: :cubic) }.to raise_error(ArgumentError) }
+    end
+
+    context "with zero width" do
+      it { expect { cat.resize(0, 150) }.to raise_error(ArgumentError) }
+    end
+  end
 end
 
 # vim: foldmethod=marker
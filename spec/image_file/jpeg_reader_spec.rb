@@ -1,7 +1,11 @@
 require 'spec_helper'
+require 'pathname'
+require 'stringio'
 
 RECOMPILE_CAT_JPG = File.expand_path(File.join('support', 'recompile_cat.jpg'), SPEC_DIR).freeze
 RECOMPILE_CAT_CMYK_JPG = File.expand_path(File.join('support', 'recompile_cat_CMYK.jpg'), SPEC_DIR).freeze
+RECOMPILE_CAT_PROGRESSIVE_JPG = File.expand_path(File.join('support', 'recompile_cat_progressive.jpg'), SPEC_DIR).freeze
+RECOMPILE_CAT_EXIF_JPG = File.expand_path(File.join('support', 'recompile_cat_exif.jpg'), SPEC_DIR).freeze
 RECOMPILE_CAT_PNG = RECOMPILE_CAT_JPG.sub(/\.jpg\Z/, '.png').freeze
 
 module ImageFile
@@ -10,6 +14,102 @@ module ImageFile
       subject { described_class.open(RECOMPILE_CAT_JPG) }
       it { should be_source_will_be_closed }
     end
+
+    context "created by new with an IO" do
+      subject { described_class.new(File.open(RECOMPILE_CAT_JPG, 'rb')) }
+      it { should_not be_source_will_be_closed }
+      its(:image_width) { should be == 500 }
+      its('read_image.height') { should be == 300 }
+    end
+
+    context "in nonblocking mode with a pipe" do
+      let(:jpeg) { File.binread(RECOMPILE_CAT_JPG) }
+      subject { described_class.new(@pipe).tap {|reader| reader.nonblock = true } }
+
+      before do
+        data = jpeg
+        @pipe, writer = IO.pipe
+        @writer = Thread.new do
+          (0...data.bytesize).step(1000) {|i| writer.write(data.byteslice(i, 1000)); sleep 0.001 }
+          writer.close
+        end
+      end
+
+      after do
+        @writer.kill
+        @pipe.close
+      end
+
+      it { should be_nonblock }
+      its(:image_width) { should be == 500 }
+
+      it "should decode the pieces as they arrive" do
+        out, expected = "\0".b * (500 * 300 * 4), "\0".b * (500 * 300 * 4)
+        subject.read_image(into: Image.new(width:500, height:300, pixel_format: :RGB24, data: out, copy: false))
+        described_class.from_string(jpeg).read_image(into: Image.new(width:500, height:300, pixel_format: :RGB24, data: expected, copy: false))
+        out.should be == expected
+      end
+    end
+
+    context "while another thread reads from a pipe" do
+      subject { described_class.new(@pipe) }
+
+      before do
+        @pipe, @writer = IO.pipe
+        @reading = Thread.new(subject) {|reader| reader.read_image rescue $! }
+        Thread.pass until @reading.status == 'sleep'
+      end
+
+      after do
+        @writer.close unless @writer.closed?
+        @reading.join rescue nil
+        @pipe.close
+      end
+
+      it { expect { subject.read_image }.to raise_error(described_class::Error) }
+      it { expect { subject.scale = 1.quo(2) }.to raise_error(described_class::Error) }
+      it { expect { subject.reset(RECOMPILE_CAT_JPG) }.to raise_error(described_class::Error) }
+      it { expect { subject.reset(Pathname(RECOMPILE_CAT_JPG)) }.to raise_error(described_class::Error) }
+
+      it "should finish the read of the other thread" do
+        Thread.new { @writer.write(File.binread(RECOMPILE_CAT_JPG)); @writer.close }
+        @reading.value.height.should be == 300
+      end
+    end
+
+    context "created by from_string" do
+      subject { described_class.from_string(File.binread(RECOMPILE_CAT_JPG)) }
+      its(:image_width) { should be == 500 }
+      its('read_image.height') { should be == 300 }
+    end
+
+    context "created by from_string with an empty string" do
+      subject { described_class.from_string('') }
+      it { expect { subject.image_width }.to raise_error(described_class::Error) }
+    end
+
+    if described_class.respond_to?(:from_buffer)
+      context "created by from_buffer" do
+        subject { described_class.from_buffer(IO::Buffer.for(File.binread(RECOMPILE_CAT_JPG))) }
+        its(:image_width) { should be == 500 }
+        its('read_image.height') { should be == 300 }
+      end
+
+      context "created by from_buffer with a buffer to be freed" do
+        let(:buffer) { IO::Buffer.new(File.size(RECOMPILE_CAT_JPG)).tap {|buffer| buffer.set_string(File.binread(RECOMPILE_CAT_JPG)) } }
+        subject { described_class.from_buffer(buffer) }
+
+        it "should keep the buffer from being freed" do
+          subject
+          expect { buffer.free }.to raise_error(IO::Buffer::LockedError)
+        end
+
+        it "should release the buffer by reset" do
+          subject.reset(RECOMPILE_CAT_JPG)
+          expect { buffer.free }.to_not raise_error
+        end
+      end
+    end
   end
 
   describe JpegReader, "for 'recompile_cat.jpg'" do #{{{
@@ -19,6 +119,7 @@ module ImageFile
     its(:image_height) { should be == 300 }
     its(:num_components) { should be == 3 }
     its(:jpeg_color_space) { should be == :YCbCr }
+    its(:restart_interval) { should be == 0 }
 
     its(:out_color_space) { should be == :RGB }
     its(:scale) { should be == 1 }
@@ -43,6 +144,29 @@ module ImageFile
       its(:output_gamma) { should be == 1.2 }
     end
 
+    it { should be_do_fancy_upsampling }
+    it { should be_do_block_smoothing }
+
+    context "after setting dct_method to :IFAST" do
+      before { subject.dct_method = :IFAST }
+      its(:dct_method) { should be == :IFAST }
+    end
+
+    context "after setting do_fancy_upsampling and do_block_smoothing to false" do
+      before do
+        subject.do_fancy_upsampling = false
+        subject.do_block_smoothing = false
+      end
+      it { should_not be_do_fancy_upsampling }
+      it { should_not be_do_block_smoothing }
+      its('read_image.width') { should be == 500 }
+    end
+
+    context "after read_scanlines" do
+      before { subject.read_scanlines(1) }
+      it { expect { subject.dct_method = :IFAST }.to raise_error(described_class::Error) }
+    end
+
     describe :read_image do
       subject { described_class.open(RECOMPILE_CAT_JPG).read_image }
       its(:width) { should be == 500 }
@@ -70,8 +194,228 @@ module ImageFile
       subject { described_class.open(RECOMPILE_CAT_JPG).read_image(pixel_format: :xyzzy) }
       its(:pixel_format) { should be == :RGB24 }
     end
+
+    describe :read_image, "with quality: :fast" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).tap {|reader| reader.read_image(quality: :fast) } }
+      its(:dct_method) { should be == :IFAST }
+      it { should_not be_do_fancy_upsampling }
+    end
+
+    describe :read_image, "with fit: [100, 100]" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).read_image(fit: [100, 100]) }
+      its(:width) { should be == 100 }
+      its(:height) { should be == 60 }
+    end
+
+    describe :read_image, "with fit: [1000, 1000]" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).read_image(fit: [1000, 1000]) }
+      its(:width) { should be == 500 }
+      its(:height) { should be == 300 }
+    end
+
+    describe :read_image, "with region: [100, 50, 64, 32]" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).read_image(region: [100, 50, 64, 32]) }
+      its(:width) { should be == 64 }
+      its(:height) { should be == 32 }
+      its(:row_stride) { should be == 64 }
+    end
+
+    describe :read_image, "with into: an image with row_stride 512" do
+      let(:image) { Image.new(pixel_format: :ARGB32, width: 500, height: 300, row_stride: 512) }
+      subject { described_class.open(RECOMPILE_CAT_JPG).read_image(into: image) }
+      it { should equal(image) }
+      its(:pixel_format) { should be == :ARGB32 }
+      its(:row_stride) { should be == 512 }
+    end
+
+    describe :read_image, "with into: an image too small" do
+      let(:image) { Image.new(pixel_format: :RGB24, width: 10, height: 10) }
+      subject { described_class.open(RECOMPILE_CAT_JPG) }
+      it { expect { subject.read_image(into: image) }.to raise_error(ArgumentError) }
+    end
+
+    describe :read_image, "with a region out of the image" do
+      subject { described_class.open(RECOMPILE_CAT_JPG) }
+      it { expect { subject.read_image(region: [490, 0, 20, 10]) }.to raise_error(ArgumentError) }
+    end
+
+    describe :read_image, "pixels" do
+      def pixels(pixel_format, depth, **opts)
+        width, height = opts[:region] ? opts[:region][2, 2] : [500, 300]
+        data = "\0".b * (width * height * depth)
+        described_class.open(RECOMPILE_CAT_JPG).read_image(**opts, into: Image.new(width: width, height: height, pixel_format: pixel_format, data: data, copy: false))
+        data
+      end
+
+      let(:rgb24) { pixels(:RGB24, 4).unpack('V*') }
+
+      it "should read the same RGB24 and ARGB32 pixels with 0xFF in the unused byte" do
+        rgb24.map {|pixel| pixel >> 24 }.uniq.should be == [0xFF]
+        pixels(:ARGB32, 4).unpack('V*').should be == rgb24
+      end
+
+      it "should read the RGB16_565 pixels the converters make from RGB without dithering" do
+        expected = rgb24.map {|pixel| ((pixel >> 8) & 0xF800) | ((pixel >> 5) & 0x07E0) | ((pixel >> 3) & 0x001F) }
+        pixels(:RGB16_565, 2).unpack('v*').should be == expected
+      end
+    end
+
+    describe :read_thumbnail, "with max_height: 37" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).read_thumbnail(max_height: 37, pixel_format: :RGB16_565) }
+      its(:width) { should be == 62 }
+      its(:height) { should be == 37 }
+      its(:pixel_format) { should be == :RGB16_565 }
+    end
+
+    describe :read_thumbnail, "without max_width and max_height" do
+      subject { described_class.open(RECOMPILE_CAT_JPG) }
+      it { expect { subject.read_thumbnail({}) }.to raise_error(ArgumentError) }
+    end
+
+    describe :embedded_thumbnail do
+      subject { described_class.open(RECOMPILE_CAT_EXIF_JPG).embedded_thumbnail(pixel_format: :RGB16_565) }
+      its(:width) { should be == 160 }
+      its(:height) { should be == 96 }
+      its(:pixel_format) { should be == :RGB16_565 }
+    end
+
+    describe :embedded_thumbnail, "after image_width" do
+      subject { described_class.open(RECOMPILE_CAT_EXIF_JPG).tap(&:image_width).embedded_thumbnail }
+      its(:width) { should be == 160 }
+    end
+
+    describe :embedded_thumbnail, "from an IO" do
+      subject { described_class.new(StringIO.new(File.binread(RECOMPILE_CAT_EXIF_JPG))).embedded_thumbnail }
+      its(:width) { should be == 160 }
+    end
+
+    describe :embedded_thumbnail, "from an IO after image_width" do
+      subject { described_class.new(StringIO.new(File.binread(RECOMPILE_CAT_EXIF_JPG))).tap(&:image_width) }
+      it { expect { subject.embedded_thumbnail }.to raise_error(described_class::Error) }
+    end
+
+    describe :embedded_thumbnail, "without Exif" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).embedded_thumbnail }
+      it { should be_nil }
+    end
+
+    describe :read_scanlines, "(128)" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).read_scanlines(128, pixel_format: :ARGB32) }
+      its(:width) { should be == 500 }
+      its(:height) { should be == 128 }
+      its(:pixel_format) { should be == :ARGB32 }
+    end
+
+    describe :read_scanlines, "after the last scanline" do
+      subject do
+        reader = described_class.open(RECOMPILE_CAT_JPG)
+        [reader.read_scanlines(256).height, reader.read_scanlines(256).height, reader.read_scanlines(256)]
+      end
+      it { should be == [256, 44, nil] }
+    end
+
+    describe :each_scanline, "(128)" do
+      subject do
+        bands = []
+        described_class.open(RECOMPILE_CAT_JPG).each_scanline(128) {|band, y| bands << [y, band.height] }
+        bands
+      end
+      it { should be == [[0, 128], [128, 128], [256, 44]] }
+    end
+
+    describe :each_scanline do
+      subject do
+        bands = []
+        described_class.open(RECOMPILE_CAT_JPG).each_scanline {|band, y| bands << band.height }
+        bands
+      end
+      its(:size) { should be == 19 }
+      its(:first) { should be == 16 }
+    end
+
+    describe :read_image, "after read_scanlines" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).tap {|reader| reader.read_scanlines(1) } }
+      it { expect { subject.read_image }.to raise_error(described_class::Error) }
+    end
+
+    describe :stats, "after read_image" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).tap {|reader| reader.read_image }.stats }
+      it { subject[:bytes_read].should be == File.size(RECOMPILE_CAT_JPG) }
+      it { subject[:scanlines].should be == 300 }
+      it { subject[:decompress_time].should be > 0 }
+    end
+
+    describe :reset, "to 'recompile_cat_CMYK.jpg' after read_image" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).tap {|reader| reader.read_image; reader.reset(RECOMPILE_CAT_CMYK_JPG) } }
+      it { should be_source_will_be_closed }
+      its(:jpeg_color_space) { should be == :CMYK }
+      its('read_image.height') { should be == 300 }
+    end
+
+    describe :reset, "to a Pathname after read_image" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).tap {|reader| reader.read_image; reader.reset(Pathname(RECOMPILE_CAT_CMYK_JPG)) } }
+      it { should be_source_will_be_closed }
+      its(:jpeg_color_space) { should be == :CMYK }
+      its('read_image.height') { should be == 300 }
+    end
+
+    describe :reset, "with the content of a file after read_scanlines" do
+      subject { described_class.open(RECOMPILE_CAT_JPG).tap {|reader| reader.read_scanlines(1); reader.reset(File.binread(RECOMPILE_CAT_JPG)) } }
+      it { should_not be_source_will_be_closed }
+      its('read_image.height') { should be == 300 }
+    end
   end #}}}
 
+  describe JpegReader, "with restart markers" do
+    let(:jpeg) { JpegWriter.encode(described_class.open(RECOMPILE_CAT_JPG).read_image, restart_interval: 7) }
+    subject { described_class.from_string(jpeg) }
+    its(:restart_interval) { should be == 7 }
+
+    [:RGB24, :RGB16_565].each do |pixel_format|
+      it "should read the same #{pixel_format} pixels with threads: 4" do
+        one, four = "\0".b * (500 * 300 * 4), "\0".b * (500 * 300 * 4)
+        described_class.from_string(jpeg).read_image(into: Image.new(width:500, height:300, pixel_format: pixel_format, data: one, copy: false))
+        described_class.from_string(jpeg).read_image(threads: 4, into: Image.new(width:500, height:300, pixel_format: pixel_format, data: four, copy: false))
+        four.should be == one
+      end
+    end
+
+    it "should read the same pixels with scale of 1/2 and threads: 3" do
+      one, four = "\0".b * (250 * 150 * 4), "\0".b * (250 * 150 * 4)
+      described_class.from_string(jpeg).tap {|reader| reader.scale = 1.quo(2) }.read_image(into: Image.new(width:250, height:150, pixel_format: :RGB24, data: one, copy: false))
+      described_class.from_string(jpeg).tap {|reader| reader.scale = 1.quo(2) }.read_image(threads: 3, into: Image.new(width:250, height:150, pixel_format: :RGB24, data: four, copy: false))
+      four.should be == one
+    end
+
+    describe :read_image, "with threads: 0" do
+      it { expect { subject.read_image(threads: 0) }.to raise_error(ArgumentError) }
+    end
+  end
+
+  describe JpegReader, ".stats" do
+    before do
+      described_class.reset_stats
+      2.times { described_class.open(RECOMPILE_CAT_JPG).read_image }
+    end
+    subject { described_class.stats }
+    it { subject[:scanlines].should be == 600 }
+    it { subject[:bytes_read].should be == 2 * File.size(RECOMPILE_CAT_JPG) }
+
+    it "should add the counts of a reader once" do
+      reader = described_class.open(RECOMPILE_CAT_JPG)
+      reader.read_scanlines(100)
+      reader.read_scanlines(200)
+      reader.stats[:scanlines].should be == 300
+      subject[:scanlines].should be == 900
+    end
+
+    it "should include the counts of decode_batch" do
+      ImageFile.decode_batch([RECOMPILE_CAT_JPG, RECOMPILE_CAT_JPG], threads: 2)
+      subject[:scanlines].should be == 1200
+      subject[:bytes_read].should be == 4 * File.size(RECOMPILE_CAT_JPG)
+    end
+  end
+
   describe JpegReader, "for 'recompile_cat_CMYK.jpg'" do #{{{
     subject { described_class.open(RECOMPILE_CAT_CMYK_JPG) }
     its(:num_components) { should be == 4 }
@@ -85,6 +429,71 @@ module ImageFile
       its(:row_stride) { should be == 500 }
       its(:pixel_format) { should be == :RGB24 }
     end
+
+    describe :read_image, "pixels" do
+      # R = C*K/255 and so on, rounded, from the samples libjpeg gives for these points
+      let(:expected) { {[0, 0] => 0x512811, [499, 0] => 0xD0BEAA, [60, 10] => 0x9A6A48, [17, 33] => 0x5F3219,
+                        [123, 45] => 0xBA906A, [250, 150] => 0x826341, [0, 299] => 0xC7B6A8, [499, 299] => 0x634223} }
+
+      def pixels(pixel_format, depth, region = [0, 0, 500, 300])
+        data = "\0".b * (region[2] * region[3] * depth)
+        described_class.open(RECOMPILE_CAT_CMYK_JPG).read_image(region: region, into: Image.new(width: region[2], height: region[3], pixel_format: pixel_format, data: data, copy: false))
+        data.unpack(depth == 4 ? 'V*' : 'v*')
+      end
+
+      def rgb16_565(pixel)
+        ((pixel >> 8) & 0xF800) | ((pixel >> 5) & 0x07E0) | ((pixel >> 3) & 0x001F)
+      end
+
+      let(:rgb24) { pixels(:RGB24, 4) }
+
+      it "should convert CMYK exactly" do
+        expected.each {|(x, y), pixel| rgb24[y * 500 + x].should be == 0xFF000000 | pixel }
+      end
+
+      it "should not make every channel 0 or 255" do
+        rgb24.flat_map {|pixel| [(pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF, pixel & 0xFF] }.uniq.size.should be > 200
+      end
+
+      it "should convert rows of widths 1 to 65 as the whole row" do
+        (1..65).each do |width|
+          [[17, 33], [124 - width, 45]].each do |x, y|
+            row = rgb24[y * 500 + x, width]
+            row.first.should be == 0xFF000000 | expected[[17, 33]] if x == 17
+            row.last.should be == 0xFF000000 | expected[[123, 45]] if x + width == 124
+            pixels(:RGB24, 4, [x, y, width, 1]).should be == row
+            pixels(:ARGB32, 4, [x, y, width, 1]).should be == row
+            pixels(:RGB16_565, 2, [x, y, width, 1]).should be == row.map {|pixel| rgb16_565(pixel) }
+          end
+        end
+      end
+    end
+
+    describe :read_image, "with scale of 1/2 and pixel_format: :RGB16_565" do
+      subject { described_class.open(RECOMPILE_CAT_CMYK_JPG).tap {|reader| reader.scale = 1.quo(2) }.read_image(pixel_format: :RGB16_565) }
+      its(:width) { should be == 250 }
+      its(:pixel_format) { should be == :RGB16_565 }
+    end
+  end #}}}
+
+  describe JpegReader, "for 'recompile_cat_progressive.jpg'" do #{{{
+    subject { described_class.open(RECOMPILE_CAT_PROGRESSIVE_JPG) }
+
+    context "after setting buffered_image to true" do
+      before { subject.buffered_image = true }
+      it { should be_buffered_image }
+      its('read_image.height') { should be == 300 }
+    end
+
+    describe :each_progressive_pass do
+      subject do
+        scans = []
+        described_class.open(RECOMPILE_CAT_PROGRESSIVE_JPG).each_progressive_pass {|image, scan| scans << [scan, image.height] }
+        scans
+      end
+      its(:size) { should be == 10 }
+      its(:first) { should be == [1, 300] }
+    end
   end #}}}
 
   describe JpegReader, "for 'recompile_cat.png'" do #{{{
@@ -0,0 +1,104 @@
+require 'spec_helper'
+
+RECOMPILE_CAT_JPG = File.expand_path(File.join('support', 'recompile_cat.jpg'), SPEC_DIR).freeze unless defined?(RECOMPILE_CAT_JPG)
+
+module ImageFile
+  describe JpegTransformer do
+    let(:jpeg) { File.binread(RECOMPILE_CAT_JPG) }
+
+    def pixels(jpeg)
+      reader = JpegReader.from_string(jpeg)
+      data = "\0".b * (reader.image_width * reader.image_height * 4)
+      reader.read_image(into: Image.new(width: reader.image_width, height: reader.image_height, pixel_format: :RGB24, data: data, copy: false))
+      data
+    end
+
+    context "created by open" do
+      subject { JpegReader.from_string(described_class.open(RECOMPILE_CAT_JPG).transform(rotate: 90)) }
+      its(:image_width) { should be == 288 }
+      its(:image_height) { should be == 500 }
+    end
+
+    describe :transform, "without parameters" do
+      subject { described_class.transform(jpeg) }
+      it "should keep the pixels" do
+        pixels(subject).should be == pixels(jpeg)
+      end
+    end
+
+    describe :transform, "with rotate: 180" do
+      subject { JpegReader.from_string(described_class.transform(jpeg, rotate: 180)) }
+      its(:image_width) { should be == 496 }
+      its(:image_height) { should be == 288 }
+    end
+
+    describe :transform, "with flip: :horizontal" do
+      subject { JpegReader.from_string(described_class.transform(jpeg, flip: :horizontal)) }
+      its(:image_width) { should be == 496 }
+      its(:image_height) { should be == 300 }
+    end
+
+    describe :transform, "with rotate: 90 four times" do
+      let(:cropped) { described_class.transform(jpeg, crop: [0, 0, 496, 288]) }
+      it "should give the same pixels" do
+        rotated = (1..4).inject(cropped) {|data, _| described_class.transform(data, rotate: 90) }
+        pixels(rotated).should be == pixels(cropped)
+      end
+    end
+
+    context "with an MCU-aligned image" do
+      let(:cropped) { described_class.transform(jpeg, crop: [0, 0, 496, 288]) }
+
+      # the corners as [x, y] of the source and the result of the transform
+      def corners(jpeg, width, height, &map)
+        reader = JpegReader.from_string(jpeg)
+        source, result = pixels(cropped).unpack('V*'), pixels(jpeg).unpack('V*')
+        [[0, 0], [width - 1, 0], [0, height - 1], [width - 1, height - 1]].map do |x, y|
+          tx, ty = map.(x, y)
+          [source[y * width + x], result[ty * reader.image_width + tx]]
+        end
+      end
+
+      def should_match(corners)
+        corners.each do |source, result|
+          [16, 8, 0].each {|shift| ((source >> shift & 0xFF) - (result >> shift & 0xFF)).abs.should be <= 3 }
+        end
+      end
+
+      it "should rotate 90 degrees clockwise" do
+        should_match(corners(described_class.transform(cropped, rotate: 90), 496, 288) {|x, y| [287 - y, x] })
+      end
+
+      it "should flip horizontally" do
+        should_match(corners(described_class.transform(cropped, flip: :horizontal), 496, 288) {|x, y| [495 - x, y] })
+      end
+
+      it "should flip vertically" do
+        should_match(corners(described_class.transform(cropped, flip: :vertical), 496, 288) {|x, y| [x, 287 - y] })
+      end
+    end
+
+    describe :transform, "with crop" do
+      subject { JpegReader.from_string(described_class.transform(jpeg, crop: [20, 20, 100, 40])) }
+      its(:image_width) { should be == 104 }
+      its(:image_height) { should be == 44 }
+    end
+
+    describe :transform, "with progressive: true" do
+      subject { ImageFile.probe(described_class.transform(jpeg, progressive: true)) }
+      it { subject[:progressive].should be == true }
+    end
+
+    describe :transform, "with rotate: 45" do
+      it { expect { described_class.transform(jpeg, rotate: 45) }.to raise_error(ArgumentError) }
+    end
+
+    describe :transform, "with crop out of the image" do
+      it { expect { described_class.transform(jpeg, crop: [400, 0, 200, 100]) }.to raise_error(ArgumentError) }
+    end
+
+    describe :transform, "of a non-JPEG string" do
+      it { expect { described_class.transform('not a jpeg') }.to raise_error(described_class::Error) }
+    end
+  end
+end
@@ -0,0 +1,148 @@
+require 'spec_helper'
+require 'stringio'
+require 'tmpdir'
+
+RECOMPILE_CAT_JPG = File.expand_path(File.join('support', 'recompile_cat.jpg'), SPEC_DIR).freeze unless defined?(RECOMPILE_CAT_JPG)
+
+module ImageFile
+  describe JpegWriter do
+    let(:image) { JpegReader.open(RECOMPILE_CAT_JPG).read_image }
+
+    context "created by new with an IO" do
+      let(:io) { StringIO.new(''.b) }
+      subject { described_class.new(io).tap {|writer| writer.write_image(image) } }
+      it { should_not be_destination_will_be_closed }
+      it { should be_finished }
+      it { subject; io.string[0, 2].should be == "\xFF\xD8".b }
+      it { subject; JpegReader.from_string(io.string).image_width.should be == 500 }
+    end
+
+    context "created by new with an object without write" do
+      it { expect { described_class.new(Object.new) }.to raise_error(TypeError) }
+    end
+
+    context "created by open" do
+      let(:path) { File.join(Dir.tmpdir, "image_file_jpeg_writer_#{$$}.jpg") }
+      after { File.unlink(path) if File.exist?(path) }
+      subject { described_class.open(path).tap {|writer| writer.write_image(image) } }
+      it { should be_destination_will_be_closed }
+      it { subject; ImageFile.probe(path)[:width].should be == 500 }
+      it { subject; ImageFile.probe(path)[:height].should be == 300 }
+    end
+
+    describe :encode do
+      subject { JpegReader.from_string(described_class.encode(image)) }
+      its(:image_width) { should be == 500 }
+      its(:image_height) { should be == 300 }
+      its(:jpeg_color_space) { should be == :YCbCr }
+    end
+
+    describe :encode, "with progressive: true" do
+      subject { ImageFile.probe(described_class.encode(image, progressive: true)) }
+      it { subject[:progressive].should be == true }
+    end
+
+    describe :encode, "with quality: 20" do
+      subject { described_class.encode(image, quality: 20).bytesize }
+      it { should be < described_class.encode(image, quality: 95).bytesize }
+    end
+
+    describe :encode, "with optimize_coding: true" do
+      subject { described_class.encode(image, optimize_coding: true).bytesize }
+      it { should be < described_class.encode(image).bytesize }
+    end
+
+    describe :encode, "with quality: 101" do
+      it { expect { described_class.encode(image, quality: 101) }.to raise_error(ArgumentError) }
+    end
+
+    describe :encode, "with restart_interval: 16" do
+      subject { JpegReader.from_string(described_class.encode(image, restart_interval: 16)) }
+      its(:restart_interval) { should be == 16 }
+      its('read_image.height') { should be == 300 }
+    end
+
+    describe :encode, "with restart_interval: 65536" do
+      it { expect { described_class.encode(image, restart_interval: 65536) }.to raise_error(ArgumentError) }
+    end
+
+    [:RGB24, :ARGB32, :RGB16_565].each do |pixel_format|
+      describe :encode, "of a red #{pixel_format} image" do
+        let(:red) do
+          pixel = pixel_format == :RGB16_565 ? [0xF800].pack('S') : [0xFFFF0000].pack('L')
+          Image.new(pixel_format: pixel_format, width: 16, height: 16, row_stride: 16, data: pixel * 256)
+        end
+        subject do
+          data = "\0".b * (16 * 16 * 4)
+          decoded = Image.new(pixel_format: :RGB24, width: 16, height: 16, row_stride: 16, data: data, copy: false)
+          JpegReader.from_string(described_class.encode(red, quality: 100)).read_image(into: decoded)
+          data.unpack('L').first
+        end
+        it { (subject >> 16 & 0xFF).should be >= 250 }
+        it { (subject >> 8 & 0xFF).should be <= 5 }
+        it { (subject & 0xFF).should be <= 5 }
+      end
+    end
+
+    describe :write_scanlines, "in bands of 128 rows" do
+      let(:io) { StringIO.new(''.b) }
+      subject do
+        writer = described_class.new(io)
+        reader = JpegReader.open(RECOMPILE_CAT_JPG)
+        reader.each_scanline(128) {|band, y| writer.write_scanlines(band, height: 300) }
+        writer
+      end
+      it { should be_finished }
+      it { subject; JpegReader.from_string(io.string).read_image.height.should be == 300 }
+    end
+
+    describe :write_scanlines, "beyond the height" do
+      subject { described_class.new(StringIO.new(''.b)).tap {|writer| writer.write_scanlines(image, height: 400) } }
+      it { should_not be_finished }
+      it { expect { subject.write_scanlines(image) }.to raise_error(ArgumentError) }
+    end
+
+    describe :write_image, "after the last scanline" do
+      subject { described_class.new(StringIO.new(''.b)).tap {|writer| writer.write_image(image) } }
+      it { expect { subject.write_image(image) }.to raise_error(described_class::Error) }
+    end
+
+    context "with an IO whose write raises" do
+      let(:io) do
+        Object.new.tap do |io|
+          def io.write(data) raise IOError, "disk full" end
+        end
+      end
+      subject { described_class.new(io) }
+      it { expect { subject.write_image(image) }.to raise_error(IOError) }
+      it do
+        subject.write_image(image) rescue nil
+        expect { subject.write_scanlines(image) }.to raise_error(described_class::Error)
+      end
+      it { (subject.write_image(image) rescue nil); should_not be_finished }
+    end
+
+    context "while another thread waits for IO#write" do
+      let(:gate) { Queue.new }
+      let(:io) do
+        gate = self.gate
+        Object.new.tap do |io|
+          io.define_singleton_method(:write) {|data| gate.pop; data.bytesize }
+        end
+      end
+      subject { described_class.new(io) }
+      before do
+        @writing = Thread.new(subject, image) {|w, i| w.write_image(i) }
+        Thread.pass until @writing.status == 'sleep'
+      end
+      after do
+        gate.close
+        @writing.join
+      end
+      it { gate.close; @writing.value.should be_finished }
+      it { expect { subject.write_image(image) }.to raise_error(described_class::Error) }
+      it { expect { subject.write_scanlines(image) }.to raise_error(described_class::Error) }
+      it { expect { subject.send(:initialize, StringIO.new(''.b)) }.to raise_error(described_class::Error) }
+    end
+  end
+end
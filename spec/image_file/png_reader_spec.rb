@@ -0,0 +1,138 @@
+require 'spec_helper'
+require 'stringio'
+require 'zlib'
+
+RECOMPILE_CAT_PNG = File.expand_path(File.join('support', 'recompile_cat.png'), SPEC_DIR).freeze unless defined?(RECOMPILE_CAT_PNG)
+RECOMPILE_CAT_JPG = File.expand_path(File.join('support', 'recompile_cat.jpg'), SPEC_DIR).freeze unless defined?(RECOMPILE_CAT_JPG)
+
+module ImageFile
+  if defined?(PngReader)
+    describe PngReader do
+      # A PNG file of 8-bit RGBA pixels given as rows of [r, g, b, a].
+      def rgba_png(rows, interlace = false)
+        chunk = lambda {|type, data| [data.bytesize].pack('N') + type + data + [Zlib.crc32(type + data)].pack('N') }
+        raw = ''.b
+        if interlace
+          [[0, 0, 8, 8], [4, 0, 8, 8], [0, 4, 4, 8], [2, 0, 4, 4], [0, 2, 2, 4], [1, 0, 2, 2], [0, 1, 1, 2]].each do |x0, y0, dx, dy|
+            (y0...rows.size).step(dy) do |y|
+              pixels = (x0...rows[0].size).step(dx).map {|x| rows[y][x] }
+              raw << "\0" << pixels.flatten.pack('C*') unless pixels.empty?
+            end
+          end
+        else
+          rows.each {|row| raw << "\0" << row.flatten.pack('C*') }
+        end
+        "\x89PNG\r\n\x1A\n".b +
+          chunk.('IHDR', [rows[0].size, rows.size, 8, 6, 0, 0, interlace ? 1 : 0].pack('NNCCCCC')) +
+          chunk.('IDAT', Zlib::Deflate.deflate(raw)) +
+          chunk.('IEND', '')
+      end
+
+      context "created by open" do
+        subject { described_class.open(RECOMPILE_CAT_PNG) }
+        it { should be_source_will_be_closed }
+        its(:image_width) { should be == 500 }
+        its(:image_height) { should be == 300 }
+        its(:bit_depth) { should be == 8 }
+        its(:color_type) { should be == :RGB_ALPHA }
+        it { should be_alpha }
+        it { should_not be_interlaced }
+      end
+
+      context "created by new with an IO" do
+        subject { described_class.new(File.open(RECOMPILE_CAT_PNG, 'rb')) }
+        it { should_not be_source_will_be_closed }
+        its('read_image.height') { should be == 300 }
+      end
+
+      context "initialized again" do
+        subject { described_class.new(File.open(RECOMPILE_CAT_PNG, 'rb')) }
+        it { expect { subject.send(:initialize, StringIO.new('')) }.to raise_error(described_class::Error) }
+      end
+
+      context "while another thread reads from a pipe" do
+        subject { described_class.new(@pipe) }
+
+        before do
+          @pipe, @writer = IO.pipe
+          @reading = Thread.new(subject) {|reader| reader.image_width rescue $! }
+          Thread.pass until @reading.status == 'sleep'
+        end
+
+        after do
+          @writer.close unless @writer.closed?
+          @reading.join rescue nil
+          @pipe.close
+        end
+
+        it { expect { subject.image_width }.to raise_error(described_class::Error) }
+        it { expect { subject.read_image }.to raise_error(described_class::Error) }
+
+        it "should finish the read of the other thread" do
+          @writer.write(File.binread(RECOMPILE_CAT_PNG, 8192))
+          @writer.close
+          @reading.value.should be == 500
+        end
+      end
+
+      context "created by from_string with an empty string" do
+        subject { described_class.from_string('') }
+        it { expect { subject.image_width }.to raise_error(described_class::Error) }
+      end
+
+      context "for a JPEG file" do
+        subject { described_class.open(RECOMPILE_CAT_JPG) }
+        it { expect { subject.image_width }.to raise_error(described_class::Error) }
+      end
+
+      describe :read_image do
+        subject { described_class.open(RECOMPILE_CAT_PNG).read_image }
+        its(:width) { should be == 500 }
+        its(:height) { should be == 300 }
+        its(:row_stride) { should be == 500 }
+        its(:pixel_format) { should be == :ARGB32 }
+      end
+
+      describe :read_image, "with pixel_format: :RGB16_565 and row_stride: 512" do
+        subject { described_class.open(RECOMPILE_CAT_PNG).read_image(pixel_format: :RGB16_565, row_stride: 512) }
+        its(:pixel_format) { should be == :RGB16_565 }
+        its(:row_stride) { should be == 512 }
+      end
+
+      describe :read_image, "after read_image" do
+        subject { described_class.open(RECOMPILE_CAT_PNG).tap {|reader| reader.read_image } }
+        it { expect { subject.read_image }.to raise_error(described_class::Error) }
+      end
+
+      describe :read_image, "of a truncated file" do
+        subject { described_class.from_string(File.binread(RECOMPILE_CAT_PNG)[0, 65536]) }
+        its(:image_width) { should be == 500 }
+        it { expect { subject.read_image }.to raise_error(described_class::Error) }
+      end
+
+      [false, true].each do |interlace|
+        describe :read_image, "into an ARGB32 image of RGBA pixels#{interlace ? ' interlaced' : ''}" do
+          let(:png) { rgba_png([[[255, 0, 0, 128], [0, 255, 0, 0], [0, 0, 255, 255]]] * 2, interlace) }
+          subject do
+            data = "\0".b * (3 * 2 * 4)
+            image = Image.new(pixel_format: :ARGB32, width: 3, height: 2, data: data, copy: false)
+            described_class.from_string(png).read_image(into: image)
+            data.unpack('L*')
+          end
+          it { should be == [0x80800000, 0x00000000, 0xFF0000FF] * 2 }
+        end
+      end
+
+      describe :read_image, "with pixel_format: :RGB24 for RGBA pixels" do
+        let(:png) { rgba_png([[[255, 0, 0, 128], [0, 255, 0, 0]]]) }
+        subject do
+          data = "\0".b * (2 * 4)
+          image = Image.new(pixel_format: :RGB24, width: 2, height: 1, data: data, copy: false)
+          described_class.from_string(png).read_image(into: image)
+          data.unpack('L*')
+        end
+        it { should be == [0xFFFF0000, 0xFF00FF00] }
+      end
+    end
+  end
+end
@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'pathname'
 
 describe "ImageFile module" do
   it "should exists" do
@@ -6,6 +7,65 @@ describe "ImageFile module" do
   end
 end
 
+describe ImageFile, ".decode_batch" do
+  let(:jpeg_path) { File.expand_path('support/recompile_cat.jpg', SPEC_DIR) }
+  let(:png_path) { File.expand_path('support/recompile_cat.png', SPEC_DIR) }
+
+  subject { ImageFile.decode_batch([jpeg_path, png_path, jpeg_path], threads: 2, scale: 1.quo(2)) }
+
+  its(:size) { should be == 3 }
+  its('first.width') { should be == 250 }
+  its('first.height') { should be == 150 }
+  its('first.pixel_format') { should be == :RGB24 }
+  its(:last) { should be_a(ImageFile::Image) }
+
+  it "should return an error in place of an undecodable file" do
+    subject[1].should be_a(ImageFile::JpegReader::Error)
+  end
+
+  it "should not change the given array" do
+    paths = [Pathname(jpeg_path)]
+    ImageFile.decode_batch(paths)
+    paths.first.should be_a(Pathname)
+  end
+end
+
+describe ImageFile, ".probe" do
+  let(:jpeg_path) { File.expand_path('support/recompile_cat.jpg', SPEC_DIR) }
+  let(:png_path) { File.expand_path('support/recompile_cat.png', SPEC_DIR) }
+
+  subject { ImageFile.probe(jpeg_path) }
+
+  it { should be == { width: 500, height: 300, components: 3, color_space: :YCbCr, progressive: false } }
+
+  it "should accept the content of a file" do
+    ImageFile.probe(File.binread(jpeg_path)).should be == subject
+  end
+
+  it "should detect a progressive file" do
+    ImageFile.probe(File.expand_path('support/recompile_cat_progressive.jpg', SPEC_DIR))[:progressive].should be == true
+  end
+
+  it "should detect a CMYK file" do
+    ImageFile.probe(File.expand_path('support/recompile_cat_CMYK.jpg', SPEC_DIR))[:color_space].should be == :CMYK
+  end
+
+  it "should raise for a non-JPEG file" do
+    expect { ImageFile.probe(png_path) }.to raise_error(ImageFile::JpegReader::Error)
+  end
+end
+
+describe ImageFile, ".probe_batch" do
+  let(:jpeg_path) { File.expand_path('support/recompile_cat.jpg', SPEC_DIR) }
+  let(:png_path) { File.expand_path('support/recompile_cat.png', SPEC_DIR) }
+
+  subject { ImageFile.probe_batch([jpeg_path, png_path], threads: 2) }
+
+  its(:size) { should be == 2 }
+  its('first') { should be == ImageFile.probe(jpeg_path) }
+  its(:last) { should be_a(ImageFile::JpegReader::Error) }
+end
+
 module ImageFile
   describe "Image class" do
     it "should exists" do